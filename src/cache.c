@@ -0,0 +1,516 @@
+/******************************************************************************
+ * Copyright (c) 2010 Joey Degges
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "image.h"
+#include "plugin.h"
+#include "cache.h"
+#include "rbio.h"
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3  1609587929392839161ULL
+#define XXH_P4  9650029242287828579ULL
+#define XXH_P5  2870177450012600261ULL
+
+/* default limit of the cache directory, in bytes */
+#define CACHE_SIZE (1LL << 30)
+
+/* eviction trims the cache to this fraction of its limit so that it does not
+ * rescan the directory on every store once full */
+#define CACHE_TRIM(limit) ((limit) / 10 * 9)
+
+static const char cache_magic[4] = {'R', 'B', 'C', '1'};
+
+/* entries are a fixed header followed by the frame data. the header is
+ * padded to a cache line so that mapped pixels are aligned for the vector
+ * paths of the process plugins */
+typedef struct cache_header {
+    char    magic[4];
+    int32_t fmt;
+    int64_t width;
+    int64_t height;
+    int64_t bpp;
+    int64_t size;
+    int64_t reserved[3];
+} cache_header;
+
+typedef struct cache_map {
+    void*   addr;
+    size_t  len;
+} cache_map;
+
+typedef struct cache_entry {
+    char*           name;
+    struct timespec mtime;
+    int64_t         size;
+} cache_entry;
+
+static inline uint64_t xxh_rotl (uint64_t x, int r)
+{
+    return x << r | x >> (64 - r);
+}
+
+static inline uint64_t xxh_read64 (const uint8_t* p)
+{
+    uint64_t v;
+
+    memcpy (&v, p, sizeof v);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64 (v);
+#endif
+    return v;
+}
+
+static inline uint32_t xxh_read32 (const uint8_t* p)
+{
+    uint32_t v;
+
+    memcpy (&v, p, sizeof v);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32 (v);
+#endif
+    return v;
+}
+
+static inline uint64_t xxh_round (uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_P2;
+    acc = xxh_rotl (acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxh_merge (uint64_t acc, uint64_t val)
+{
+    acc ^= xxh_round (0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+uint64_t rb_xxh64 (const void* data, size_t len, uint64_t seed)
+{
+    const uint8_t* p = data;
+    const uint8_t* end = p + len;
+    uint64_t h;
+
+    if (32 <= len) {
+        const uint8_t* limit = end - 32;
+        uint64_t v1 = seed + XXH_P1 + XXH_P2;
+        uint64_t v2 = seed + XXH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_P1;
+
+        do {
+            v1 = xxh_round (v1, xxh_read64 (p));
+            v2 = xxh_round (v2, xxh_read64 (p + 8));
+            v3 = xxh_round (v3, xxh_read64 (p + 16));
+            v4 = xxh_round (v4, xxh_read64 (p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = xxh_rotl (v1, 1) + xxh_rotl (v2, 7) +
+            xxh_rotl (v3, 12) + xxh_rotl (v4, 18);
+        h = xxh_merge (h, v1);
+        h = xxh_merge (h, v2);
+        h = xxh_merge (h, v3);
+        h = xxh_merge (h, v4);
+    } else {
+        h = seed + XXH_P5;
+    }
+
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round (0, xxh_read64 (p));
+        h = xxh_rotl (h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (p + 4 <= end) {
+        h ^= xxh_read32 (p) * XXH_P1;
+        h = xxh_rotl (h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_P5;
+        h = xxh_rotl (h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+static int64_t cache_parse_size (const char* str)
+{
+    char* end;
+    int64_t size = strtoll (str, &end, 10);
+
+    switch (*end) {
+        case 'g': case 'G':
+            size <<= 10;
+            /* fall through */
+        case 'm': case 'M':
+            size <<= 10;
+            /* fall through */
+        case 'k': case 'K':
+            size <<= 10;
+        default:
+            break;
+    }
+    return size;
+}
+
+static int cache_is_entry (const char* name)
+{
+    size_t len = strlen (name);
+
+    return 20 == len && 0 == strcmp (name + 16, ".rbc");
+}
+
+/* sums up the entries already in the directory */
+static int64_t cache_scan (rb_cache* cache)
+{
+    DIR* dir;
+    struct dirent* dp;
+    struct stat st;
+    int64_t bytes = 0;
+
+    if (NULL == (dir = opendir (cache->dir))) {
+        return -1;
+    }
+    while (NULL != (dp = readdir (dir))) {
+        if (cache_is_entry (dp->d_name) &&
+            0 == fstatat (dirfd (dir), dp->d_name, &st, 0))
+        {
+            bytes += st.st_size;
+        }
+    }
+    closedir (dir);
+    return bytes;
+}
+
+rb_cache* cache_new (const char* name, char* args, uint64_t seed)
+{
+    rb_cache* cache;
+    char* param;
+    int ret_val = 0;
+
+    if (NULL == (cache = calloc (1, sizeof *cache))) {
+        error_exit ("Out of memory");
+    }
+    pthread_mutex_init (&cache->mutex, NULL);
+    cache->name = name;
+    cache->seed = seed;
+
+    parse_args (args, 0, "dir", &cache->dir);
+    if (NULL == cache->dir) {
+        error_exit ("The cache needs a ``dir''");
+    }
+    if (mkdir (cache->dir, 0755) && EEXIST != errno) {
+        error_exit ("Unable to create %s: %s", cache->dir, strerror (errno));
+    }
+
+    parse_args (args, 0, "size", &param);
+    cache->limit = NULL == param ? CACHE_SIZE : cache_parse_size (param);
+    free (param);
+    if (cache->limit <= 0) {
+        error_exit ("Invalid cache ``size''");
+    }
+
+    if ((cache->bytes = cache_scan (cache)) < 0) {
+        error_exit ("Unable to read %s: %s", cache->dir, strerror (errno));
+    }
+
+exit:
+    if (ret_val < 0 && cache) {
+        pthread_mutex_destroy (&cache->mutex);
+        free (cache->dir);
+        free (cache);
+        cache = NULL;
+    }
+    return cache;
+}
+
+void cache_free (rb_cache* cache)
+{
+    int64_t lookups;
+
+    if (NULL == cache) {
+        return;
+    }
+
+    lookups = cache->hits + cache->misses;
+    fprintf (stderr,
+             "%s cache: %" PRId64 " hits, %" PRId64 " misses "
+             "(%.1f%% hit rate), %" PRId64 " stored, %" PRId64 " evicted\n",
+             cache->name, cache->hits, cache->misses,
+             lookups ? 100.0 * cache->hits / lookups : 0.0,
+             cache->stored, cache->evicted);
+
+    pthread_mutex_destroy (&cache->mutex);
+    free (cache->dir);
+    free (cache);
+}
+
+uint64_t cache_key (const image_t* im)
+{
+    int64_t shape[4];
+    uint64_t key;
+
+    /* raw frames of the same bytes mean different things in another
+     * geometry or pixel format */
+    shape[0] = im->width;
+    shape[1] = im->height;
+    shape[2] = im->bpp;
+    shape[3] = im->fmt;
+
+    key = rb_xxh64 (im->pix, im->size, 0);
+    key = rb_xxh64 (shape, sizeof shape, key);
+    return key ? key : 1;
+}
+
+/* entries are named after the frame's key mixed with the cache's seed, so
+ * caches of different chains can share a directory */
+static void cache_path (rb_cache* cache, uint64_t key, char* path, size_t len)
+{
+    key = rb_xxh64 (&key, sizeof key, cache->seed);
+    snprintf (path, len, "%s/%016" PRIx64 ".rbc", cache->dir, key);
+}
+
+static void cache_unmap (void* data)
+{
+    cache_map* m = data;
+
+    munmap (m->addr, m->len);
+    free (m);
+}
+
+int cache_fetch (rb_cache* cache, image_t* im)
+{
+    char path[FILENAME_MAX];
+    cache_header* hdr;
+    cache_map* m = NULL;
+    struct stat st;
+    void* addr = MAP_FAILED;
+    int fd;
+
+    cache_path (cache, im->key, path, sizeof path);
+
+    if (-1 == (fd = open (path, O_RDONLY))) {
+        goto miss;
+    }
+    if (fstat (fd, &st) || st.st_size < (off_t) sizeof *hdr ||
+        MAP_FAILED == (addr = mmap (NULL, st.st_size,
+                                    PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                                    fd, 0)))
+    {
+        goto miss;
+    }
+
+    hdr = addr;
+    if (memcmp (hdr->magic, cache_magic, sizeof cache_magic) ||
+        hdr->size != st.st_size - (off_t) sizeof *hdr ||
+        NULL == (m = malloc (sizeof *m)))
+    {
+        goto miss;
+    }
+
+    /* mtime orders the entries for eviction */
+    futimens (fd, NULL);
+    close (fd);
+
+    if (im->ext_data && im->ext_free) {
+        im->ext_free (im->ext_data);
+    } else {
+        free (im->pix);
+    }
+
+    m->addr = addr;
+    m->len = st.st_size;
+    im->pix = (uint8_t*) addr + sizeof *hdr;
+    im->size = hdr->size;
+    im->width = hdr->width;
+    im->height = hdr->height;
+    im->bpp = hdr->bpp;
+    im->fmt = hdr->fmt;
+    im->ext_data = m;
+    im->ext_free = cache_unmap;
+
+    pthread_mutex_lock (&cache->mutex);
+    cache->hits++;
+    pthread_mutex_unlock (&cache->mutex);
+    return 1;
+
+miss:
+    if (MAP_FAILED != addr) {
+        munmap (addr, st.st_size);
+    }
+    if (-1 != fd) {
+        close (fd);
+    }
+    pthread_mutex_lock (&cache->mutex);
+    cache->misses++;
+    pthread_mutex_unlock (&cache->mutex);
+    return 0;
+}
+
+static int cache_entry_cmp (const void* a, const void* b)
+{
+    const cache_entry* x = a;
+    const cache_entry* y = b;
+
+    if (x->mtime.tv_sec != y->mtime.tv_sec) {
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    }
+    return (x->mtime.tv_nsec > y->mtime.tv_nsec) -
+           (x->mtime.tv_nsec < y->mtime.tv_nsec);
+}
+
+/* drop the least recently used entries until the cache is back under its
+ * trim size. the directory is rescanned so that entries written by other
+ * runs sharing it are accounted for. called locked */
+static void cache_evict (rb_cache* cache)
+{
+    DIR* dir;
+    struct dirent* dp;
+    struct stat st;
+    cache_entry* list = NULL;
+    size_t n = 0, cap = 0, i;
+
+    if (NULL == (dir = opendir (cache->dir))) {
+        return;
+    }
+
+    cache->bytes = 0;
+    while (NULL != (dp = readdir (dir))) {
+        if (!cache_is_entry (dp->d_name) ||
+            fstatat (dirfd (dir), dp->d_name, &st, 0))
+        {
+            continue;
+        }
+        if (n == cap) {
+            cache_entry* tmp;
+
+            cap = cap ? 2 * cap : 256;
+            if (NULL == (tmp = realloc (list, cap * sizeof *list))) {
+                break;
+            }
+            list = tmp;
+        }
+        if (NULL == (list[n].name = strdup (dp->d_name))) {
+            break;
+        }
+        list[n].mtime = st.st_mtim;
+        list[n].size = st.st_size;
+        cache->bytes += st.st_size;
+        n++;
+    }
+
+    qsort (list, n, sizeof *list, cache_entry_cmp);
+
+    for (i = 0; i < n; i++) {
+        if (CACHE_TRIM (cache->limit) < cache->bytes &&
+            0 == unlinkat (dirfd (dir), list[i].name, 0))
+        {
+            cache->bytes -= list[i].size;
+            cache->evicted++;
+        }
+        free (list[i].name);
+    }
+
+    free (list);
+    closedir (dir);
+}
+
+int cache_store (rb_cache* cache, const image_t* im)
+{
+    char path[FILENAME_MAX];
+    char tmp[FILENAME_MAX];
+    cache_header hdr;
+    struct iovec iov[2];
+    int64_t len = sizeof hdr + im->size;
+    int fd = -1;
+    int ret_val = 0;
+
+    if (NULL == im->pix || im->size <= 0 || cache->limit < len) {
+        return 0;
+    }
+
+    memcpy (hdr.magic, cache_magic, sizeof cache_magic);
+    hdr.fmt = im->fmt;
+    hdr.width = im->width;
+    hdr.height = im->height;
+    hdr.bpp = im->bpp;
+    hdr.size = im->size;
+
+    /* written aside and renamed into place so that concurrent runs never
+     * see a partial entry */
+    snprintf (tmp, sizeof tmp, "%s/.rbc-XXXXXX", cache->dir);
+    if (-1 == (fd = mkstemp (tmp))) {
+        error_exit ("Unable to create %s: %s", tmp, strerror (errno));
+    }
+    fchmod (fd, 0644);
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof hdr;
+    iov[1].iov_base = im->pix;
+    iov[1].iov_len = im->size;
+    if (rb_writev_full (fd, iov, 2)) {
+        unlink (tmp);
+        error_exit ("Unable to write %s: %s", tmp, strerror (errno));
+    }
+
+    cache_path (cache, im->key, path, sizeof path);
+    if (rename (tmp, path)) {
+        unlink (tmp);
+        error_exit ("Unable to rename %s: %s", tmp, strerror (errno));
+    }
+
+    pthread_mutex_lock (&cache->mutex);
+    cache->stored++;
+    cache->bytes += len;
+    if (cache->limit < cache->bytes) {
+        cache_evict (cache);
+    }
+    pthread_mutex_unlock (&cache->mutex);
+
+exit:
+    if (-1 != fd) {
+        close (fd);
+    }
+    return ret_val;
+}
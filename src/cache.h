@@ -0,0 +1,71 @@
+/******************************************************************************
+ * Copyright (c) 2010 Joey Degges
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef _H_RB_CACHE
+#define _H_RB_CACHE
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "image.h"
+
+/* On-disk caches of frames, keyed by a hash of the input frame and of the
+ * options of the stages that produced them. The result cache holds what
+ * reaches the output stage and lets a hit skip every stage in between; the
+ * frame cache holds decoded frames for jobs that rerun the later stages. */
+
+typedef struct rb_cache {
+    pthread_mutex_t mutex;
+    const char*     name;
+    char*           dir;
+    uint64_t        seed;
+    int64_t         limit;
+    int64_t         bytes;
+    int64_t         hits;
+    int64_t         misses;
+    int64_t         stored;
+    int64_t         evicted;
+} rb_cache;
+
+/* 64-bit xxhash of len bytes at p */
+uint64_t rb_xxh64 (const void* p, size_t len, uint64_t seed);
+
+/* args are "dir:<path>,size:<bytes>[K|M|G]". seed identifies the chain of
+ * stages whose results are cached, name labels the statistics */
+rb_cache* cache_new (const char* name, char* args, uint64_t seed);
+
+/* prints the hit rate to stderr */
+void cache_free (rb_cache* cache);
+
+/* content key of an input frame, never 0 */
+uint64_t cache_key (const image_t* im);
+
+/* on a hit the frame's data is replaced by a private mapping of the cached
+ * frame. returns 1 on a hit, 0 on a miss */
+int cache_fetch (rb_cache* cache, image_t* im);
+
+/* store the result for im->key, evicting the least recently used entries
+ * once the cache outgrows its limit */
+int cache_store (rb_cache* cache, const image_t* im);
+
+#endif
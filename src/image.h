@@ -25,6 +25,7 @@
 
 #include <stdlib.h>
 #include <inttypes.h>
+#include <strings.h>
 
 typedef enum {
 /* originally inspired from v4l, v4l2, and ffmpeg fmt lists */
@@ -71,10 +72,19 @@ typedef enum {
     FMT_TIFF,           FMT_WBMP,           FMT_XBM,
     FMT_XPM,
 
+/* "Quite OK Image" lossless format, see the rawfmt plugin */
+    FMT_QOI,
+
 /* used to specify a list of single image files */
     FMT_LIST
 } data_fmt;
 
+/* image_t.flags */
+#define IMAGE_CACHED    1   /* result taken from the cache, pumps skip it */
+#define IMAGE_DECODED   2   /* decoded frame from the cache, decode skips it */
+
+/* raw pixel formats are laid out top-down with no row padding: row r starts
+ * at pix + r*width*bpp/8. FMT_RGB24 is R,G,B bytes and FMT_BGR24 B,G,R */
 typedef struct image_t {
     uint8_t* pix;
     int64_t width;
@@ -82,12 +92,14 @@ typedef struct image_t {
     int64_t bpp;
     int64_t size;
     int64_t frame;
+    uint64_t key;
+    int flags;
     data_fmt fmt;
     void* ext_data;
     void (*ext_free)(void*);
 } image_t;
 
-void image_close (image_t* im) {
+static inline void image_close (image_t* im) {
     if (im) {
         if (im->ext_data && im->ext_free) {
             im->ext_free (im->ext_data);
@@ -99,4 +111,59 @@ void image_close (image_t* im) {
         im = NULL;
     }
 }
+
+/* bits per pixel of the uncompressed pixel formats, 0 for anything that
+ * has no fixed frame size (containers, compressed streams) */
+static inline int64_t image_fmt_bpp (data_fmt fmt)
+{
+    switch (fmt) {
+        case FMT_GREY8:     case FMT_PAL8:      case FMT_RGB8:
+        case FMT_BGR8:
+            return 8;
+        case FMT_YUV420P:   case FMT_YUVJ420P:  case FMT_YVU420:
+        case FMT_NV12:      case FMT_NV21:
+            return 12;
+        case FMT_GREY16:    case FMT_RGB565:    case FMT_RGB555:
+        case FMT_BGR565:    case FMT_BGR555:    case FMT_YUYV:
+        case FMT_UYVY:      case FMT_YVYU:      case FMT_YUV422P:
+        case FMT_YUVJ422P:
+            return 16;
+        case FMT_RGB24:     case FMT_BGR24:     case FMT_YUV444P:
+        case FMT_YUVJ444P:
+            return 24;
+        case FMT_RGB32:     case FMT_BGR32:     case FMT_RGB32_1:
+        case FMT_BGR32_1:
+            return 32;
+        default:
+            return 0;
+    }
+}
+
+/* map a pixel format name as given on the command line to a data_fmt */
+static inline data_fmt image_fmt_from_str (const char* str)
+{
+    static const struct {
+        const char* name;
+        data_fmt    fmt;
+    } names[] = {
+        {"GREY8",   FMT_GREY8},     {"GRAY8",   FMT_GREY8},
+        {"GREY16",  FMT_GREY16},    {"PAL8",    FMT_PAL8},
+        {"RGB24",   FMT_RGB24},     {"BGR24",   FMT_BGR24},
+        {"RGB32",   FMT_RGB32},     {"BGR32",   FMT_BGR32},
+        {"RGB32_1", FMT_RGB32_1},   {"BGR32_1", FMT_BGR32_1},
+        {"YUYV",    FMT_YUYV},      {"UYVY",    FMT_UYVY},
+        {"YVYU",    FMT_YVYU},      {"NV12",    FMT_NV12},
+        {"NV21",    FMT_NV21},      {"YUV420P", FMT_YUV420P},
+        {"YUV422P", FMT_YUV422P},   {"YUV444P", FMT_YUV444P},
+        {NULL,      FMT_NONE}
+    };
+    int i;
+
+    for (i = 0; NULL != str && NULL != names[i].name; i++) {
+        if (0 == strcasecmp (str, names[i].name)) {
+            return names[i].fmt;
+        }
+    }
+    return FMT_NONE;
+}
 #endif
@@ -38,6 +38,7 @@
 
 #include "image.h"
 #include "plugin.h"
+#include "cache.h"
 
 
 #if 1 == BUILD_DEBUG
@@ -57,6 +58,9 @@ typedef struct plugin_state {
     plugin_stage stage;
     plugin_entry* plugin;
     plugin_context* context;
+    struct plugin_state* chain;
+    rb_cache* cache;
+    rb_cache* frame_cache;
 } plugin_state;
 
 static int nframes;
@@ -206,6 +210,8 @@ exec_plugin (struct async_queue* tid_queue,
                   plugin_context* context)
 {
     int* tid = async_queue_pop (tid_queue, true);
+    uint64_t key = *src_im ? (*src_im)->key : 0;
+
     if (plugin->pi[stage]->exec(context, *tid, src_im, dst_im) < 0) {
         fprintf (stderr,
                  "Error executing plugin.exec %s on stage %d\n",
@@ -214,9 +220,57 @@ exec_plugin (struct async_queue* tid_queue,
         *dst_im = NULL;
     }
     async_queue_push (tid_queue, tid);
+
+    /* the cache key follows the frame down to the output stage */
+    if (*dst_im) {
+        (*dst_im)->key = key;
+        (*dst_im)->flags = 0;
+    }
     image_close (*src_im);
 }
 
+/* walk a new frame's header through the later stages before it is queued,
+ * so plans, contexts and pools get sized while earlier frames are still in
+ * flight. a stage without hooks ends the walk since its output is unknown */
+static void
+prepare_stages (plugin_state* chain, image_t* im)
+{
+    image_t info = *im;
+    plugin_info* pi;
+    int c;
+
+    info.pix = NULL;
+    info.ext_data = NULL;
+    info.ext_free = NULL;
+
+    for (c = PLUGIN_STAGE_DECODE; c < PLUGIN_STAGE_OUTPUT; c++) {
+        if (NULL == chain[c].plugin) {
+            continue;
+        }
+        pi = chain[c].plugin->pi[c];
+
+        /* a decode stage whose input already carries its shape, such as a
+         * scaler fed raw frames, is prepared like the later stages */
+        if (PLUGIN_STAGE_DECODE == c && IMAGE_DECODED & im->flags) {
+            continue;
+        } else if (pi->prepare && 0 < info.width && 0 < info.height) {
+            if (pi->prepare (chain[c].context, &info) < 0) {
+                fprintf (stderr,
+                         "Error executing plugin.prepare %s on stage %d\n",
+                         chain[c].plugin->path,
+                         c);
+                return;
+            }
+        } else if (PLUGIN_STAGE_DECODE == c && pi->probe) {
+            if (pi->probe (chain[c].context, im, &info) < 0) {
+                return;
+            }
+        } else {
+            return;
+        }
+    }
+}
+
 static void *
 exec_inlet_plugin (void* data)
 {
@@ -235,6 +289,23 @@ exec_inlet_plugin (void* data)
     exec_plugin (args->tid_queue, args->stage, &src_im, &dst_im,
                  args->plugin, args->context);
 
+    if (dst_im && (args->cache || args->frame_cache) &&
+        dst_im->pix && 0 < dst_im->size)
+    {
+        dst_im->key = cache_key (dst_im);
+        if (args->cache && cache_fetch (args->cache, dst_im)) {
+            dst_im->flags |= IMAGE_CACHED;
+            return dst_im;
+        }
+        if (args->frame_cache && cache_fetch (args->frame_cache, dst_im)) {
+            dst_im->flags |= IMAGE_DECODED;
+        }
+    }
+
+    if (dst_im) {
+        prepare_stages (args->chain, dst_im);
+    }
+
     return dst_im;
 }
 
@@ -245,9 +316,23 @@ exec_pump_plugin (void* data, void* product)
     image_t* src_im = product;
     image_t* dst_im = NULL;
 
+    /* cached results go straight through to the output stage */
+    if (src_im && (IMAGE_CACHED & src_im->flags ||
+                   (IMAGE_DECODED & src_im->flags &&
+                    PLUGIN_STAGE_DECODE == args->stage)))
+    {
+        return src_im;
+    }
+
     exec_plugin (args->tid_queue, args->stage, &src_im, &dst_im,
                  args->plugin, args->context);
 
+    if (args->frame_cache && PLUGIN_STAGE_DECODE == args->stage &&
+        dst_im && dst_im->key)
+    {
+        cache_store (args->frame_cache, dst_im);
+    }
+
     return dst_im;
 }
 
@@ -258,6 +343,12 @@ exec_outlet_plugin (void* data, void* product)
     image_t* src_im = product;
     image_t* dst_im = NULL;
 
+    if (args->cache && src_im && src_im->key &&
+        !(IMAGE_CACHED & src_im->flags))
+    {
+        cache_store (args->cache, src_im);
+    }
+
     exec_plugin (args->tid_queue, args->stage, &src_im, &dst_im,
                  args->plugin, args->context);
 }
@@ -276,6 +367,10 @@ exec_outlet_plugin (void* data, void* product)
 int main (int argc, char** argv) {
     int c;
     char* stage_options[PLUGIN_STAGE_MAX] = {0};
+    char* cache_options = NULL;
+    char* frame_cache_options = NULL;
+    rb_cache* cache = NULL;
+    rb_cache* frame_cache = NULL;
     plugin_entry* plugins[PLUGIN_STAGE_MAX] = {NULL};
     plugin_entry* pe_list[100] = {NULL};
     plugin_context context_list[PLUGIN_STAGE_MAX];
@@ -294,15 +389,18 @@ int main (int argc, char** argv) {
         static struct option long_options[] = {
             {"input",     required_argument,  0,  'i'},
             {"decode",    required_argument,  0,  'd'},
+            {"convert",   required_argument,  0,  'v'},
             {"process",   required_argument,  0,  'p'},
             {"encode",    required_argument,  0,  'e'},
             {"output",    required_argument,  0,  'o'},
             {"parallel",  required_argument,  0,  'j'},
             {"frames",    required_argument,  0,  'f'},
+            {"cache",     required_argument,  0,  'c'},
+            {"frame-cache", required_argument, 0, 'C'},
             {0,           0,                  0,  0}
         };
 
-        c = getopt_long (argc, argv, "i:d:p:e:o:j:f:", long_options, &option_index);
+        c = getopt_long (argc, argv, "i:d:v:p:e:o:j:f:c:C:", long_options, &option_index);
         if (-1 == c) {
             break;
         }
@@ -310,6 +408,7 @@ int main (int argc, char** argv) {
         switch (c) {
             SET_STAGE_ARGS ('i', PLUGIN_STAGE_INPUT);
             SET_STAGE_ARGS ('d', PLUGIN_STAGE_DECODE);
+            SET_STAGE_ARGS ('v', PLUGIN_STAGE_CONVERT);
             SET_STAGE_ARGS ('p', PLUGIN_STAGE_PROCESS);
             SET_STAGE_ARGS ('e', PLUGIN_STAGE_ENCODE);
             SET_STAGE_ARGS ('o', PLUGIN_STAGE_OUTPUT);
@@ -330,6 +429,18 @@ int main (int argc, char** argv) {
                     nframes = -1;
                 }
                 break;
+            case 'c':
+                free (cache_options);
+                if (NULL == (cache_options = strdup (optarg))) {
+                    return -1;
+                }
+                break;
+            case 'C':
+                free (frame_cache_options);
+                if (NULL == (frame_cache_options = strdup (optarg))) {
+                    return -1;
+                }
+                break;
             case '?':
             default:
                 usage ();
@@ -376,6 +487,44 @@ int main (int argc, char** argv) {
     dprintf ("\n");
     /* } end plugin selection */
 
+    /* { the result cache is keyed on every stage between input and output,
+     * so it only applies when at least one of them is in use */
+    if (cache_options) {
+        uint64_t seed = 0;
+        int cached = 0;
+
+        for (c = PLUGIN_STAGE_DECODE; c < PLUGIN_STAGE_OUTPUT; c++) {
+            if (plugins[c]) {
+                seed = rb_xxh64 (&c, sizeof c, seed);
+                seed = rb_xxh64 (stage_options[c], strlen (stage_options[c]),
+                                 seed);
+                cached = 1;
+            }
+        }
+
+        if (cached && plugins[PLUGIN_STAGE_INPUT] &&
+            plugins[PLUGIN_STAGE_OUTPUT] &&
+            NULL == (cache = cache_new ("result", cache_options, seed)))
+        {
+            return -1;
+        }
+    }
+
+    /* decoded frames only depend on the decode stage */
+    if (frame_cache_options && plugins[PLUGIN_STAGE_INPUT] &&
+        plugins[PLUGIN_STAGE_DECODE])
+    {
+        c = PLUGIN_STAGE_DECODE;
+        if (NULL == (frame_cache = cache_new ("frame", frame_cache_options,
+                                              rb_xxh64 (stage_options[c],
+                                                  strlen (stage_options[c]),
+                                                  c))))
+        {
+            return -1;
+        }
+    }
+    /* } end cache setup */
+
     /* TODO: spawn a new thread for each stage.
     * - each thread should have an input queue associated with it
     * - each thread should have an output queue associated with it
@@ -423,6 +572,8 @@ int main (int argc, char** argv) {
         struct async_queue* tid_queue = async_queue_new ();
         plugin_state args[PLUGIN_STAGE_MAX];
 
+        memset (args, 0, sizeof args);
+
         for (tid = 0; tid < parallel; tid++) {
             t = malloc (sizeof *t);
             *t = tid;
@@ -435,6 +586,9 @@ int main (int argc, char** argv) {
                 args[c].stage = c;
                 args[c].plugin = plugins[c];
                 args[c].context = &context_list[c];
+                args[c].chain = args;
+                args[c].cache = cache;
+                args[c].frame_cache = frame_cache;
 
                 if (PLUGIN_STAGE_INPUT == c) {
                     pipeline_add_inlet (pipe, exec_inlet_plugin, &args[c]);
@@ -482,6 +636,11 @@ int main (int argc, char** argv) {
     }
     /* } end unload plugins */
 
+    cache_free (cache);
+    cache_free (frame_cache);
+    free (cache_options);
+    free (frame_cache_options);
+
     lt_dlexit();
 
     pthread_mutex_destroy (&nframes_lock);
@@ -71,6 +71,15 @@ typedef struct plugin_info {
     int (*exit) (plugin_context* ctx, int thread_id);
     int (*exec) (plugin_context* ctx, int thread_id, image_t** src_data, image_t** dst_data);
     int (*query)(char* args, void* info);
+
+    /* optional: fill info with the shape of the frame exec would decode from
+     * src_data, reading only its header. called from the input threads
+     * before the frame is queued */
+    int (*probe) (plugin_context* ctx, image_t* src_data, image_t* info);
+
+    /* optional: get ready for frames shaped like info ahead of exec, then
+     * update info to the shape of the frames this stage will produce */
+    int (*prepare) (plugin_context* ctx, image_t* info);
 } plugin_info;
 
 #endif
@@ -32,7 +32,10 @@
  * }
  *****************************************************************************/
 
+#include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
 #include <math.h>
 
 /* fft stuff */
@@ -41,6 +44,7 @@
 
 #include "image.h"
 #include "plugin.h"
+#include "workpool.h"
 
 #ifndef M_PI
 #define M_PI 3.1415926536
@@ -59,6 +63,8 @@ int artistic_proc_exec (plugin_context* ctx,
                         image_t**       dst_data);
 int artistic_proc_exit (plugin_context* ctx,
                         int             thread_id);
+int artistic_proc_prepare (plugin_context* ctx,
+                           image_t*        info);
 
 /* process plugin configuration */
 static const data_fmt supported_fmt[] = {FMT_RGB24};
@@ -69,7 +75,8 @@ static plugin_info pi_artistic_proc = {.stage=PLUGIN_STAGE_PROCESS,
                                        .name="artistic_process",
                                        .init=artistic_proc_init,
                                        .exit=artistic_proc_exit,
-                                       .exec=artistic_proc_exec};
+                                       .exec=artistic_proc_exec,
+                                       .prepare=artistic_proc_prepare};
 
 int artistic_query (plugin_stage stage, plugin_info** pi)
 {
@@ -84,207 +91,220 @@ int artistic_query (plugin_stage stage, plugin_info** pi)
     return 0;
 }
 
-typedef struct fft_plans {
-    fftw_plan forward;
-    fftw_plan backward;
-} fft_plans_t;
-
-typedef struct artistic_buf {
-    fftw_complex** g;
-
-    fftw_complex** src1;
-    fftw_complex** src2;
-    fftw_complex** s;
-    fftw_complex** m;
-
-    double** num;
-    double* den;
-} artistic_buf_t;
-
-fftw_complex* gen_sec (const int nx, const int ny,
-                       fft_plans_t* f, const double a, const double wd,
-                       const double* g1, const fftw_complex* g2) {
-    int i, j, x, y;
-    double total = 0;
-    double* out;
-
-    double* sec_d = fftw_malloc (sizeof(double)*ny*2*(nx/2+1));
-    if (NULL == sec_d) {
-      return NULL;
-    }
-    fftw_complex* sec = (fftw_complex*)sec_d;
-    memset(sec_d, 0, sizeof(double)*ny*2*(nx/2+1));
-    for (j = 0; j < ny; j++) {
-        for (i = 0; i < nx; i++) {
-            register double x_val = -nx/2.0 + (i) * (double)nx/(double)(nx-1);
-            register double y_val =  ny/2.0 - (j) * (double)ny/(double)(ny-1);
-
-            sec_d[i+j*2*(nx/2+1)] = (x_val*cos(a-wd+M_PI/2.0) + y_val*sin(a-wd+M_PI/2.0) >  0 ? 1 : 0) *
-                                    (x_val*cos(a+wd+M_PI/2.0) + y_val*sin(a+wd+M_PI/2.0) <= 0 ? 1 : 0);
-        }
-    }
-    fftw_execute_dft_r2c (f->forward, sec_d, sec);
-
-    for (i = 0; i < ny*(nx/2+1); i++) {
-        sec[i] *= g2[i];
-    }
-
-    fftw_execute_dft_c2r (f->backward, sec, sec_d);
+/* run the tasks of a frame, on the pool when there is one */
+static void artistic_tasks (workpool* pool, workpool_fn fn, void* arg,
+                            int ntasks)
+{
+    int i;
 
-    if (NULL == (out = fftw_malloc (sizeof(double)*ny*2*(nx/2+1)))) {
-      return NULL;
-    }
-    x = nx/2;
-    y = ny/2;
-    for (j = 0; j < ny; j++) {
-        int k = (j - y) % ny;
-        k = k < 0 ? ny + k : k;
-        for (i = 0; i < nx; i++) {
-            int h = (i - x) % nx;
-            h = h < 0 ? nx + h : h;
-            out[i+j*2*(nx/2+1)] = sec_d[h+k*2*(nx/2+1)] / (nx*ny) * g1[i+j*nx];
-            total += out[i+j*2*(nx/2+1)];
+    if (NULL == pool || 1 == ntasks) {
+        for (i = 0; i < ntasks; i++) {
+            fn (arg, i);
         }
+    } else {
+        workpool_run (pool, fn, arg, ntasks);
     }
+}
 
-    for (i = 0; i < ny*2*(nx/2+1); i++) {
-        out[i] /= total;
-    }
-
-    fftw_execute_dft_r2c (f->forward, out, (fftw_complex*)out);
+#define ARTISTIC_REAL   double
+#define ARTISTIC_X(name) fftw_##name
+#define ARTISTIC_S(name) name##_d
+#include "artistic_fft.h"
+
+/* precision:float runs the same code on single precision plans, which halves
+ * the memory traffic of the sector loop */
+#ifdef HAVE_FFTW3F
+#define ARTISTIC_REAL   float
+#define ARTISTIC_X(name) fftwf_##name
+#define ARTISTIC_S(name) name##_f
+#include "artistic_fft.h"
+#endif
 
-    fftw_free (sec);
-    return (fftw_complex*)out;
-}
+/* the paths a frame is smoothed on */
+#define ARTISTIC_DOUBLE 1
+#define ARTISTIC_FLOAT  2
+
+/* plans, sector kernels and buffers for one frame size, in each precision
+ * that is smoothed on. the kernels are built once by the first thread to
+ * need them and only read after that, each thread gets its own scratch
+ * buffers the first time it smooths a frame of this size */
+typedef struct artistic_geom {
+    int                     width;
+    int                     height;
+    pthread_mutex_t         lock;
+    artistic_fft_d*         d;
+#ifdef HAVE_FFTW3F
+    artistic_fft_f*         f;
+#endif
+    size_t                  bytes;
+    unsigned long           used;
+    int                     users;
+    struct artistic_geom*   next;
+} artistic_geom_t;
 
 typedef struct artistic_proc_context {
     char*               args;
-    fft_plans_t*        p;
-    artistic_buf_t**    b;
-    int                 width;
-    int                 height;
+    artistic_geom_t*    geoms;
+    unsigned long       tick;
+    size_t              bytes;
+    size_t              limit;
     double              sgm;
     int                 ns;
+    unsigned            planner;
+    char*               wisdom;
+    int                 precision;
+    int                 paths;
+    workpool*           pool;
+    int                 workers;
+    int                 dev_max;
+    double              dev_sum;
+    unsigned long       dev_samples;
+    unsigned long       dev_frames;
+    int                 references;
 } artistic_proc_context;
 
-static double g_sgm = 3.8;
+/* geometries are kept while their buffers fit in this many bytes */
+#define ARTISTIC_CACHE_BYTES ((size_t) 2 << 30)
 
-int init_global_bufs (plugin_context* ctx, int width, int height, double sgm, int ns)
+/* called with the context mutex held */
+static void free_geom (plugin_context* ctx, artistic_geom_t* g, int ns)
 {
-    artistic_proc_context* c;
-    int nx = width;
-    int ny = height;
-    fft_plans_t* f;
-    fftw_complex* in;
+    fft_free_d (g->d, ctx->num_threads, ns);
+#ifdef HAVE_FFTW3F
+    fft_free_f (g->f, ctx->num_threads, ns);
+#endif
+    pthread_mutex_destroy (&g->lock);
+    free (g);
+}
 
-    if (nx <= 0 || ny <= 0) {
-        return -1;
-    }
+/* called with the context mutex held, the fftw planner is not reentrant */
+static artistic_geom_t* new_geom (plugin_context* ctx, int width, int height)
+{
+    artistic_proc_context* c = ctx->data;
+    artistic_geom_t* g;
 
-    if (NULL == (f = malloc (sizeof(fft_plans_t)))) {
-      return -1;
-    }
-    if (NULL == (in = fftw_malloc (sizeof(fftw_complex)*ny*(nx/2+1)))) {
-      return -1;
+    if (width <= 0 || height <= 0) {
+        return NULL;
     }
-    f->forward  = fftw_plan_dft_r2c_2d (ny, nx, (double*)in, in, FFTW_ESTIMATE);
-    f->backward = fftw_plan_dft_c2r_2d (ny, nx, in, (double*)in, FFTW_ESTIMATE);
-    fftw_free (in);
 
-    if (NULL == (c = malloc (sizeof(artistic_proc_context)))) {
-        return -1;
+    if (NULL == (g = calloc (1, sizeof(artistic_geom_t)))) {
+        return NULL;
     }
+    g->width = width;
+    g->height = height;
+    pthread_mutex_init (&g->lock, NULL);
 
-    if (NULL == (c->b = calloc (ctx->num_threads, sizeof(artistic_buf_t*)))) {
-        return -1;
+    if ((c->paths & ARTISTIC_DOUBLE) &&
+        NULL == (g->d = fft_new_d (width, height, c->planner,
+                                   ctx->num_threads)))
+    {
+        free_geom (ctx, g, c->ns);
+        return NULL;
     }
+#ifdef HAVE_FFTW3F
+    if ((c->paths & ARTISTIC_FLOAT) &&
+        NULL == (g->f = fft_new_f (width, height, c->planner,
+                                   ctx->num_threads)))
+    {
+        free_geom (ctx, g, c->ns);
+        return NULL;
+    }
+#endif
 
-    c->width = width;
-    c->height = height;
-    c->sgm = sgm;
-    c->ns = ns;
-    c->p = f;
-    ctx->data = c;
+    return g;
+}
 
-    return 0;
+/* drop the least recently used sizes no thread is smoothing until the
+ * buffers fit under the limit again. called with the context mutex held */
+static void evict_geoms (plugin_context* ctx, artistic_proc_context* c)
+{
+    while (c->bytes > c->limit) {
+        artistic_geom_t** lru = NULL;
+        artistic_geom_t** g;
+        artistic_geom_t* victim;
+
+        for (g = &c->geoms; NULL != *g; g = &(*g)->next) {
+            if (0 == (*g)->users && (NULL == lru || (*g)->used < (*lru)->used)) {
+                lru = g;
+            }
+        }
+        if (NULL == lru) {
+            return;
+        }
+
+        victim = *lru;
+        *lru = victim->next;
+        c->bytes -= victim->bytes;
+        free_geom (ctx, victim, c->ns);
+    }
 }
 
-int init_thread_bufs (plugin_context* ctx, int thread_id)
+/* find or plan the geometry for a frame size and mark it recently used.
+ * called with the context mutex held */
+static artistic_geom_t* get_geom (plugin_context* ctx, int width, int height)
 {
     artistic_proc_context* c = ctx->data;
-    const int nx = c->width;
-    const int ny = c->height;
-    const int nxny = nx*ny;
-    const double sgm = c->sgm;
-    const int ns = c->ns;
-    fft_plans_t* p = c->p;
+    artistic_geom_t* g;
 
-    {
-        int i;
-        double* g1;
-        double* g;
-        fftw_complex* g2;
-        double* g2_d;
-        fftw_complex** gc;
-
-        artistic_buf_t* f = c->b[thread_id];
-        f->g    = fftw_malloc (sizeof(fftw_complex*)*ns);
-        f->src1 = fftw_malloc (sizeof(fftw_complex*)*3);
-        f->src2 = fftw_malloc (sizeof(fftw_complex*)*3);
-        f->s    = fftw_malloc (sizeof(fftw_complex*)*3);
-        f->m    = fftw_malloc (sizeof(fftw_complex*)*3);
-        f->num  = fftw_malloc (sizeof(double*)*3);
-        f->den  = fftw_malloc (sizeof(double)*ny*2*(nx/2+1));
-        if (NULL == f->g || NULL == f->src1 || NULL == f->src2 || NULL == f->s
-         || NULL == f->m || NULL == f->num || NULL == f->den) {
-          return -1;
+    for (g = c->geoms; NULL != g; g = g->next) {
+        if (g->width == width && g->height == height) {
+            break;
         }
+    }
 
-        for (i = 0; i < 3; i++) {
-            f->src1[i]  = fftw_malloc (sizeof(fftw_complex)*ny*(nx/2+1));
-            f->src2[i]  = fftw_malloc (sizeof(fftw_complex)*ny*(nx/2+1));
-            f->s[i]     = fftw_malloc (sizeof(fftw_complex)*ny*(nx/2+1));
-            f->m[i]     = fftw_malloc (sizeof(fftw_complex)*ny*(nx/2+1));
-            f->num[i]   = fftw_malloc (sizeof(double)*ny*2*(nx/2+1));
-            if (NULL == f->src1[i] || NULL == f->src2[i] || NULL == f->s[i]
-              || NULL == f->m[i] || NULL == f->num[i]) {
-              return -1;
-            }
+    if (NULL == g) {
+        if (NULL == (g = new_geom (ctx, width, height))) {
+            return NULL;
         }
+        g->next = c->geoms;
+        c->geoms = g;
+    }
 
-        if (NULL == (g1 = malloc (sizeof(double)*nxny))) {
-          return -1;
-        }
-        i = nxny;
-        g = g1 + nxny - 1;
-        while (i--) {
-            register double x_val = -nx/2.0 + (i%nx) * nx/(nx-1);
-            register double y_val =  ny/2.0 - (i/nx) * ny/(ny-1);
-            *g-- = exp(-(x_val*x_val+y_val*y_val)/(2.0*sgm*sgm));
-        }
+    g->used = ++c->tick;
+    return g;
+}
 
-        g2 = fftw_malloc (sizeof(fftw_complex)*ny*(nx/2+1));
-        g2_d = (double*)g2;
-        memset(g2, 0, sizeof(fftw_complex)*ny*(nx/2+1));
-        g = g2_d + ny*2*(nx/2+1) - 1;
-        i = ny*2*(nx/2+1);
-        while (i--) {
-            register const int y = (i / (2*(nx/2+1))) - ny/2.0;
-            register const int x = (i % (2*(nx/2+1))) - nx/2.0;
-            *g-- = exp(-0.5*(x*x+y*y));
-        }
-        fftw_execute_dft_r2c (((fft_plans_t*)(p))->forward, g2_d, g2);
+static int artistic_import_wisdom (int precision, const char* path)
+{
+#ifdef HAVE_FFTW3F
+    if (ARTISTIC_FLOAT == precision) {
+        return fftwf_import_wisdom_from_filename (path);
+    }
+#endif
+    (void) precision;
+    return fftw_import_wisdom_from_filename (path);
+}
 
-        gc = f->g + ns - 1;
-        i = ns;
-        while (i--) {
-            *gc-- = gen_sec(nx, ny, (fft_plans_t*)(p), i*2.0*M_PI/ns, M_PI/ns, g1, g2);
-        }
+static int artistic_export_wisdom (int precision, const char* path)
+{
+#ifdef HAVE_FFTW3F
+    if (ARTISTIC_FLOAT == precision) {
+        return fftwf_export_wisdom_to_filename (path);
+    }
+#endif
+    (void) precision;
+    return fftw_export_wisdom_to_filename (path);
+}
 
-        fftw_free (g2);
-        free (g1);
+/* sizes may be suffixed with K, M or G */
+static size_t parse_size (const char* str)
+{
+    char* end;
+    double size = strtod (str, &end);
+
+    switch (*end) {
+        case 'g': case 'G':
+            size *= 1024;
+            /* fall through */
+        case 'm': case 'M':
+            size *= 1024;
+            /* fall through */
+        case 'k': case 'K':
+            size *= 1024;
+        default:
+            break;
     }
-    return 0;
+    return size < 0 ? 0 : size;
 }
 
 int artistic_proc_init (plugin_context* ctx,
@@ -292,10 +312,9 @@ int artistic_proc_init (plugin_context* ctx,
                         char*           args)
 {
     artistic_proc_context* c;
-    const int ns = 8;
-    int nx;
-    int ny;
-    fft_plans_t* p;
+    int ret_val = -1;
+
+    (void) thread_id;
 
     if (NULL == ctx) {
         return -1;    
@@ -305,114 +324,205 @@ int artistic_proc_init (plugin_context* ctx,
 
     if (NULL == ctx->data) {
         char* str = NULL;
+        int nx = 0;
+        int ny = 0;
+
+        if (NULL == (c = calloc (1, sizeof(artistic_proc_context)))) {
+            error_exit ("Out of memory");
+        }
+        c->sgm = 3.8;
+        c->ns = 8;
+        c->limit = ARTISTIC_CACHE_BYTES;
+        c->planner = FFTW_ESTIMATE;
 
         parse_args(args, 0, "sgm", &str);
         if (NULL != str) {
-          g_sgm = strtod(str, NULL);
+          c->sgm = strtod(str, NULL);
           free (str);
           str = NULL;
         }
 
-        parse_args (args, 0, "width", &str);
-        if (NULL == str) {
-            ctx->data = NULL;
-            pthread_mutex_unlock (&ctx->mutex);
-            return 0;
+        /* frames of mixed sizes are smoothed with plans and buffers kept per
+         * size, up to cache:<bytes> of buffers */
+        parse_args (args, 0, "cache", &str);
+        if (NULL != str) {
+          c->limit = parse_size (str);
+          free (str);
+          str = NULL;
+        }
+
+        /* measured plans are faster but take a while to find, wisdom:<path>
+         * keeps them from one run to the next */
+        parse_args (args, 0, "planner", &str);
+        if (NULL == str || 0 == strcasecmp (str, "estimate")) {
+            c->planner = FFTW_ESTIMATE;
+        } else if (0 == strcasecmp (str, "measure")) {
+            c->planner = FFTW_MEASURE;
+        } else if (0 == strcasecmp (str, "patient")) {
+            c->planner = FFTW_PATIENT;
+        } else {
+            free (str);
+            free (c);
+            error_exit ("Invalid ``planner'' option, try estimate, measure "
+                        "or patient");
+        }
+        free (str);
+        str = NULL;
+
+        parse_args (args, 0, "precision", &str);
+        if (NULL == str || 0 == strcasecmp (str, "double")) {
+            c->precision = ARTISTIC_DOUBLE;
+        } else if (0 == strcasecmp (str, "float")) {
+#ifdef HAVE_FFTW3F
+            c->precision = ARTISTIC_FLOAT;
+#else
+            free (str);
+            free (c);
+            error_exit ("``precision:float'' needs fftw3f, which this build "
+                        "does not have");
+#endif
         } else {
+            free (str);
+            free (c);
+            error_exit ("Invalid ``precision'' option, try double or float");
+        }
+        free (str);
+        str = NULL;
+        c->paths = c->precision;
+
+        /* validate:1 smooths every frame in both precisions and reports how
+         * far the float output strays from the double one */
+        parse_args (args, 0, "validate", &str);
+        if (NULL != str && atoi (str)) {
+#ifdef HAVE_FFTW3F
+            c->paths = ARTISTIC_DOUBLE | ARTISTIC_FLOAT;
+#else
+            free (str);
+            free (c);
+            error_exit ("``validate'' needs fftw3f, which this build does "
+                        "not have");
+#endif
+        }
+        free (str);
+        str = NULL;
+
+        /* wisdom is kept for the precision whose output is used */
+        parse_args (args, 0, "wisdom", &c->wisdom);
+        if (NULL != c->wisdom &&
+            !artistic_import_wisdom (c->precision, c->wisdom) &&
+            0 == access (c->wisdom, F_OK))
+        {
+            fprintf (stderr, "artistic: unable to import wisdom from %s\n",
+                     c->wisdom);
+        }
+
+        /* threads:<n> spreads the sectors of each frame over a pool, 0 for
+         * one thread per cpu. every worker keeps its own sums, so each one
+         * adds ten frame sized buffers per pipeline thread */
+        c->workers = 1;
+        parse_args (args, 0, "threads", &str);
+        if (NULL != str && 1 != atoi (str)) {
+            if (NULL == (c->pool = workpool_new (atoi (str)))) {
+                free (str);
+                free (c->wisdom);
+                free (c);
+                error_exit ("Unable to start sector threads");
+            }
+            c->workers = workpool_threads (c->pool);
+            c->workers = c->workers < c->ns ? c->workers : c->ns;
+        }
+        free (str);
+        str = NULL;
+
+        ctx->data = c;
+
+        /* a size given up front is planned for now */
+        parse_args (args, 0, "width", &str);
+        if (NULL != str) {
           nx = atoi (str);
           free (str);
           str = NULL;
         }
 
         parse_args (args, 0, "height", &str);
-        if (NULL == str) {
-            ctx->data = NULL;
-            pthread_mutex_unlock (&ctx->mutex);
-            return 0;
-        } else {
+        if (NULL != str) {
           ny = atoi (str);
           free (str);
           str = NULL;
         }
 
-        if (init_global_bufs (ctx, nx, ny, g_sgm, ns)) {
-            return -1;
+        if (0 < nx && 0 < ny && NULL == get_geom (ctx, nx, ny)) {
+            error_exit ("Unable to plan for %dx%d frames", nx, ny);
         }
     }
 
-    pthread_mutex_unlock (&ctx->mutex);
-
-    if (NULL == (c = (artistic_proc_context*) ctx->data) ||
-        NULL == (p = (fft_plans_t*) c->p) ||
-        NULL == (c->b[thread_id] = malloc (sizeof(artistic_buf_t))))
-    {
-        return -1;
-    }
-
-    if (init_thread_bufs (ctx, thread_id)) {
-        return -1;
-    }
+    c = (artistic_proc_context*) ctx->data;
+    c->references++;
+    ret_val = 0;
 
-    return 0;
+exit:
+    pthread_mutex_unlock (&ctx->mutex);
+    return ret_val;
 }
 
 int artistic_proc_exit (plugin_context* ctx,
                         int             thread_id)
 {
     artistic_proc_context* c;
-    int ns = 8;
-    int i;
+    artistic_geom_t* g;
 
-    if (NULL == (c = (artistic_proc_context*) ctx->data) ||
-        NULL == c->b[thread_id])
-    {
+    pthread_mutex_lock (&ctx->mutex);
+
+    if (NULL == (c = (artistic_proc_context*) ctx->data)) {
+        pthread_mutex_unlock (&ctx->mutex);
         return -1;
     }
 
-    {
-        artistic_buf_t* f = c->b[thread_id];
-        int i;
-        for (i = 0; i < ns; i++) {
-            fftw_free (f->g[i]);
+    for (g = c->geoms; NULL != g; g = g->next) {
+        if (NULL != g->d && NULL != g->d->b[thread_id]) {
+            free_thread_bufs_d (g->d, thread_id);
+            g->bytes -= artistic_buf_bytes_d (g->width, g->height,
+                                               c->workers);
+            c->bytes -= artistic_buf_bytes_d (g->width, g->height,
+                                               c->workers);
         }
-        fftw_free (f->g);
-
-        for (i = 0; i < 3; i++) {
-            fftw_free (f->src1[i]);
-            fftw_free (f->src2[i]);
-            fftw_free (f->s[i]);
-            fftw_free (f->m[i]);
-            fftw_free (f->num[i]);
+#ifdef HAVE_FFTW3F
+        if (NULL != g->f && NULL != g->f->b[thread_id]) {
+            free_thread_bufs_f (g->f, thread_id);
+            g->bytes -= artistic_buf_bytes_f (g->width, g->height,
+                                               c->workers);
+            c->bytes -= artistic_buf_bytes_f (g->width, g->height,
+                                               c->workers);
         }
-
-        fftw_free (f->src1);
-        fftw_free (f->src2);
-        fftw_free (f->s);
-        fftw_free (f->m);
-        fftw_free (f->num);
-        fftw_free (f->den);
-        free (f);
-
-        c->b[thread_id] = NULL;
+#endif
     }
 
-    pthread_mutex_lock (&ctx->mutex);
-
-    for (i = 0; i < ctx->num_threads; i++) {
-        if (c->b[i] != NULL) {
-            pthread_mutex_unlock (&ctx->mutex);
-            return 0;
+    if (0 == --c->references) {
+        if (0 < c->dev_frames) {
+            fprintf (stderr, "artistic: float vs double over %lu frames: "
+                     "max deviation %d, mean deviation %.4f\n",
+                     c->dev_frames, c->dev_max,
+                     c->dev_sum / c->dev_samples);
         }
-    }
 
-    {
-        fft_plans_t* f = c->p;
-        fftw_destroy_plan (f->forward);
-        fftw_destroy_plan (f->backward);
-        free (f);
-        free (c->b);
+        /* the plans made this run join the wisdom before fftw forgets it */
+        if (NULL != c->wisdom &&
+            !artistic_export_wisdom (c->precision, c->wisdom))
+        {
+            fprintf (stderr, "artistic: unable to export wisdom to %s\n",
+                     c->wisdom);
+        }
+        while (NULL != (g = c->geoms)) {
+            c->geoms = g->next;
+            free_geom (ctx, g, c->ns);
+        }
+        workpool_free (c->pool);
+        free (c->wisdom);
         free (c);
         fftw_cleanup ();
+#ifdef HAVE_FFTW3F
+        fftwf_cleanup ();
+#endif
         ctx->data = NULL;
     }
 
@@ -421,195 +531,102 @@ int artistic_proc_exit (plugin_context* ctx,
     return 0;
 }
 
-#define MULTIPLY_6_C_INNER \
-*d1++ = *s1++ * *m; *d2++ = *s2++ * *m;\
-*d3++ = *s3++ * *m; *d4++ = *s4++ * *m;\
-*d5++ = *s5++ * *m; *d6++ = *s6++ * *m++;
-
-static void multiply_6_c(fftw_complex* d1, const fftw_complex* s1,
-                                fftw_complex* d2, const fftw_complex* s2,
-                                fftw_complex* d3, const fftw_complex* s3,
-                                fftw_complex* d4, const fftw_complex* s4,
-                                fftw_complex* d5, const fftw_complex* s5,
-                                fftw_complex* d6, const fftw_complex* s6,
-                                const fftw_complex* m, const int n) {
-    register unsigned int i = n;
-    unsigned int correction = n % 8;
-    i -= correction;
-
-    while (i) {
-        MULTIPLY_6_C_INNER;
-        MULTIPLY_6_C_INNER;
-        MULTIPLY_6_C_INNER;
-        MULTIPLY_6_C_INNER;
-        MULTIPLY_6_C_INNER;
-        MULTIPLY_6_C_INNER;
-        MULTIPLY_6_C_INNER;
-        MULTIPLY_6_C_INNER;
-        i -= 8;
-    }
-
-    while (correction--) {
-        MULTIPLY_6_C_INNER;
-    }
-}
+/* plan as soon as the input threads have read the first header of each
+ * size instead of on its first exec */
+int artistic_proc_prepare (plugin_context* ctx,
+                           image_t*        info)
+{
+    int ret = 0;
 
-static void divide_mul_const_d(double* d, const double* s, const double c, const int n) {
-    register unsigned int i = n;
-    unsigned int correction = n % 8;
-    i -= correction;
-
-    while (i) {
-        *d++ /= *s++ * c;
-        *d++ /= *s++ * c;
-        *d++ /= *s++ * c;
-        *d++ /= *s++ * c;
-        *d++ /= *s++ * c;
-        *d++ /= *s++ * c;
-        *d++ /= *s++ * c;
-        *d++ /= *s++ * c;
-        i -= 8;
-    }
+    pthread_mutex_lock (&ctx->mutex);
 
-    while (correction--) {
-        *d++ /= *s++ * c;
+    if (NULL == ctx->data ||
+        NULL == get_geom (ctx, info->width, info->height))
+    {
+        ret = -1;
     }
-}
 
-#define MESH_D_INNER \
-rdst = ((*a++ + *b++ + *c++)/k - (*d * *d + *e * *e + *f * *f)/k2) + 0.0001;\
-rdst = 1 / (rdst * rdst * rdst * rdst);\
-*d1++ += *d++ * rdst;\
-*d2++ += *e++ * rdst;\
-*d3++ += *f++ * rdst;\
-*d4++ += rdst;
-
-static void mesh_d (const double* a, const double* b, const double* c,
-                           const double* d, const double* e, const double* f,
-                           const double k, const double k2,
-                           double* d1, double* d2, double* d3, double* d4, const int n) {
-
-    register unsigned int i = n;
-    register double rdst;
-    unsigned int correction = n % 8;
-    i -= correction;
-
-    while (i) {
-        MESH_D_INNER;
-        MESH_D_INNER;
-        MESH_D_INNER;
-        MESH_D_INNER;
-        MESH_D_INNER;
-        MESH_D_INNER;
-        MESH_D_INNER;
-        MESH_D_INNER;
-        i -= 8;
-    }
+    pthread_mutex_unlock (&ctx->mutex);
 
-    while (correction--) {
-        MESH_D_INNER;
-    }
+    return ret;
 }
 
-void artistic_smooth (uint8_t* src,
-                      uint8_t* dst,
-                      double ns,
-                      double q,
-                      int nx, int ny, int pitch,
-                      fft_plans_t* f,
-                      artistic_buf_t* ab)
+/* build what a thread needs to smooth frames of this geometry on the given
+ * paths: the shared kernels under the geometry lock, then its own buffers */
+static int artistic_ready (plugin_context* ctx, artistic_geom_t* g,
+                           int paths, int thread_id)
 {
-    int i, j, k, x, y;
-    const int width = 2*(nx/2+1);
-    const double nxny = nx*ny;
-    const double nxny2 = nxny*nxny;
-    const int n = ny*(nx/2+1);
-    const int n2 = n*2;
-
-    (void) q;
-
-    fftw_complex** src1_c = ab->src1;
-    fftw_complex** src2_c = ab->src2;
-    fftw_complex** s_c = ab->s;
-    fftw_complex** m_c = ab->m;
-
-    double** num = ab->num;
-    double* den = ab->den;
-
-    double* src1_d[3];
-    double* src2_d[3];
-    double* s_d[3];
-    double* m_d[3];
-
-    for (k = 0; k < 3; k++) {
-        src1_d[k]   = (double*) src1_c[k];
-        src2_d[k]   = (double*) src2_c[k];
-        s_d[k]      = (double*) s_c[k];
-        m_d[k]      = (double*) m_c[k];
-    }
-                     
-    for (j = 0; j < ny; j++) {
-        uint8_t* data = src + j*pitch;
-        double* src1_ptr[] = {src1_d[0]+j*width, src1_d[1]+j*width, src1_d[2]+j*width};
-        double* src2_ptr[] = {src2_d[0]+j*width, src2_d[1]+j*width, src2_d[2]+j*width};
-
-        for (i = 0; i < nx; i++) {
-            for (k = 0; k < 3; k++) {
-                register double temp = *src1_ptr[k]++ = *data++;
-                *src2_ptr[k]++ = temp*temp;
-            }
+    artistic_proc_context* c = ctx->data;
+    const int nx = g->width;
+    const int ny = g->height;
+    size_t kernels = 0;
+    size_t bufs = 0;
+    int failed = 0;
+
+    /* the first thread here builds the kernels, any others wait for them
+     * rather than building their own */
+    pthread_mutex_lock (&g->lock);
+    if ((paths & ARTISTIC_DOUBLE) && NULL == g->d->g) {
+        if (init_kernels_d (g->d, nx, ny, c->sgm, c->ns)) {
+            failed = 1;
+        } else {
+            kernels += artistic_kernel_bytes_d (nx, ny, c->ns);
         }
     }
-
-    for (k = 0; k < 3; k++) {
-        fftw_execute_dft_r2c (f->forward, src1_d[k], src1_c[k]);
-        fftw_execute_dft_r2c (f->forward, src2_d[k], src2_c[k]);
+#ifdef HAVE_FFTW3F
+    if ((paths & ARTISTIC_FLOAT) && NULL == g->f->g) {
+        if (init_kernels_f (g->f, nx, ny, c->sgm, c->ns)) {
+            failed = 1;
+        } else {
+            kernels += artistic_kernel_bytes_f (nx, ny, c->ns);
+        }
     }
+#endif
+    pthread_mutex_unlock (&g->lock);
 
-    for (k = 0; k < 3; k++) {
-        memset (num[k], 0, sizeof(double)*n2);
+    if (!failed && (paths & ARTISTIC_DOUBLE) && NULL == g->d->b[thread_id]) {
+        if (init_thread_bufs_d (g->d, nx, ny, thread_id, c->workers)) {
+            failed = 1;
+        } else {
+            bufs += artistic_buf_bytes_d (nx, ny, c->workers);
+        }
     }
-    memset (den, 0, sizeof(double)*n2);
-
-    for (i = 0; i < ns; i++) {
-        fftw_complex* g_fft = ab->g[i];
-
-        multiply_6_c(m_c[0], src1_c[0],
-                     m_c[1], src1_c[1],
-                     m_c[2], src1_c[2],
-                     s_c[0], src2_c[0],
-                     s_c[1], src2_c[1],
-                     s_c[2], src2_c[2],
-                     g_fft, n);
-
-        for (k = 0; k < 3; k++) {
-            fftw_execute_dft_c2r (f->backward, m_c[k], m_d[k]);
-            fftw_execute_dft_c2r (f->backward, s_c[k], s_d[k]);
+#ifdef HAVE_FFTW3F
+    if (!failed && (paths & ARTISTIC_FLOAT) && NULL == g->f->b[thread_id]) {
+        if (init_thread_bufs_f (g->f, nx, ny, thread_id, c->workers)) {
+            failed = 1;
+        } else {
+            bufs += artistic_buf_bytes_f (nx, ny, c->workers);
         }
-
-        mesh_d (s_d[0], s_d[1], s_d[2], m_d[0], m_d[1], m_d[2], nxny, nxny2,
-                num[0], num[1], num[2], den, n2);
     }
+#endif
 
-    for (k = 0; k < 3; k++) {
-        divide_mul_const_d(num[k], den, nxny, n2);
+    pthread_mutex_lock (&ctx->mutex);
+    g->bytes += kernels + bufs;
+    c->bytes += kernels + bufs;
+    if (0 < bufs) {
+        evict_geoms (ctx, c);
     }
+    pthread_mutex_unlock (&ctx->mutex);
 
-    x = nx/2.0;
-    y = ny/2.0;
-    for (j = 0; j < ny; j++) {
-        int k = (j - y) % ny;
-        k = (k < 0 ? ny + k : k) * 2*(nx/2+1);
-        uint8_t* d = dst + j*pitch;
-        for (i = 0; i < nx; i++) {
-            int z;
-            int h = (i - x) % nx;
-            h = (h < 0 ? nx + h : h) + k;
-            for (z = 0; z < 3; z++) {
-                *d++ = num[z][h];
-            }
-        }
+    return failed ? -1 : 0;
+}
+
+/* smooth src into dst on one path */
+static void artistic_run (artistic_proc_context* c, artistic_geom_t* g,
+                          int path, int thread_id,
+                          uint8_t* src, uint8_t* dst, int pitch)
+{
+#ifdef HAVE_FFTW3F
+    if (ARTISTIC_FLOAT == path) {
+        artistic_smooth_f (src, dst, c->ns, 8.0, g->width, g->height, pitch,
+                           g->f, g->f->b[thread_id], c->pool);
+        return;
     }
+#endif
+    (void) path;
+    artistic_smooth_d (src, dst, c->ns, 8.0, g->width, g->height, pitch,
+                       g->d, g->d->b[thread_id], c->pool);
 }
 
 int artistic_proc_exec (plugin_context* ctx,
@@ -618,54 +635,51 @@ int artistic_proc_exec (plugin_context* ctx,
                         image_t**       dst_data)
 {
     artistic_proc_context* c;
+    artistic_geom_t* g;
     int nx;
     int ny;
     int pitch;
-    int ns = 8;
     image_t* sim;
     image_t* dim;
+    uint8_t* ref = NULL;
 
-    if (NULL == (sim = *src_data) || NULL != *dst_data) {
+    if (NULL == (sim = *src_data) || NULL != *dst_data ||
+        NULL == (c = (artistic_proc_context*) ctx->data))
+    {
         return -1;
     }
 
+    /* prepare has usually planned for this size already. the geometry is
+     * held while in use so that it cannot be evicted */
     pthread_mutex_lock (&ctx->mutex);
-    if (NULL == ctx->data) {
-        if (init_global_bufs (ctx, sim->width, sim->height, g_sgm, ns)) {
-            return -1;
-        }
-    }
-    pthread_mutex_unlock (&ctx->mutex);
-
-    if (NULL == (c = (artistic_proc_context*) ctx->data) ||
-        NULL == c->p)
-    {
+    if (NULL == (g = get_geom (ctx, sim->width, sim->height))) {
+        pthread_mutex_unlock (&ctx->mutex);
         return -1;
     }
-
-    if (c->width != sim->width || c->height != sim->height)
-    {
-      printf("artistic: frame size mismatch\n");
-      return -1;
-    }
-
-    if (NULL == c->b[thread_id]) {
-        if (NULL == (c->b[thread_id] = malloc (sizeof(artistic_buf_t))))
-        {
-            return -1;
-        }
-        if (init_thread_bufs (ctx, thread_id)) {
-            return -1;
-        }
-    }
+    g->users++;
+    pthread_mutex_unlock (&ctx->mutex);
 
     nx = sim->width;
     ny = sim->height;
     pitch = sim->bpp/8 * nx;
 
-    if (NULL == (dim = calloc (1, sizeof(image_t))) ||
-        NULL == (dim->pix = malloc (sizeof(uint8_t)*ny*pitch)))
+    if (artistic_ready (ctx, g, c->paths, thread_id) ||
+        NULL == (dim = calloc (1, sizeof(image_t))))
+    {
+        pthread_mutex_lock (&ctx->mutex);
+        g->users--;
+        pthread_mutex_unlock (&ctx->mutex);
+        return -1;
+    }
+    if (NULL == (dim->pix = malloc (sizeof(uint8_t)*ny*pitch)) ||
+        (c->paths != c->precision &&
+         NULL == (ref = malloc (sizeof(uint8_t)*ny*pitch))))
     {
+        free (dim->pix);
+        free (dim);
+        pthread_mutex_lock (&ctx->mutex);
+        g->users--;
+        pthread_mutex_unlock (&ctx->mutex);
         return -1;
     }
 
@@ -675,7 +689,35 @@ int artistic_proc_exec (plugin_context* ctx,
     dim->fmt = FMT_RGB24;
     dim->frame = sim->frame;
 
-    artistic_smooth (sim->pix, dim->pix, ns, 8.0, nx, ny, pitch, c->p, c->b[thread_id]);
+    artistic_run (c, g, c->precision, thread_id, sim->pix, dim->pix, pitch);
+
+    /* the other precision is only run to be compared against */
+    if (NULL != ref) {
+        int max = 0;
+        double sum = 0;
+        int i;
+
+        artistic_run (c, g, c->paths & ~c->precision, thread_id,
+                      sim->pix, ref, pitch);
+        for (i = 0; i < ny*pitch; i++) {
+            int dev = abs (dim->pix[i] - ref[i]);
+            max = dev > max ? dev : max;
+            sum += dev;
+        }
+        free (ref);
+
+        pthread_mutex_lock (&ctx->mutex);
+        c->dev_max = max > c->dev_max ? max : c->dev_max;
+        c->dev_sum += sum;
+        c->dev_samples += ny*pitch;
+        c->dev_frames++;
+        pthread_mutex_unlock (&ctx->mutex);
+    }
+
+    pthread_mutex_lock (&ctx->mutex);
+    g->users--;
+    g->used = ++c->tick;
+    pthread_mutex_unlock (&ctx->mutex);
 
     *dst_data = dim;
     return 0;
@@ -0,0 +1,634 @@
+/******************************************************************************
+ * Copyright (c) 2010 Joey Degges
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *****************************************************************************/
+
+/* The precision dependent half of the artistic plugin: plans, kernels,
+ * scratch buffers and the smoothing itself. artistic.c includes it once for
+ * double and, when fftw3f is available, once more for float, defining
+ *
+ *   ARTISTIC_REAL       the real type
+ *   ARTISTIC_X (name)   the fftw type or function of that precision
+ *   ARTISTIC_S (name)   name with the suffix of that precision
+ *
+ * which are undefined again at the end. batches of tasks are run with
+ * artistic_tasks (), which artistic.c defines first. */
+
+#define REAL        ARTISTIC_REAL
+#define CPLX        ARTISTIC_X(complex)
+#define FFTW(name)  ARTISTIC_X(name)
+#define S(name)     ARTISTIC_S(name)
+
+#define MULTIPLY_6_C_INNER \
+*d1++ = *s1++ * *m; *d2++ = *s2++ * *m;\
+*d3++ = *s3++ * *m; *d4++ = *s4++ * *m;\
+*d5++ = *s5++ * *m; *d6++ = *s6++ * *m++;
+
+#define MESH_D_INNER \
+rdst = ((*a++ + *b++ + *c++)/k - (*d * *d + *e * *e + *f * *f)/k2) + (REAL) 0.0001;\
+rdst = 1 / (rdst * rdst * rdst * rdst);\
+*d1++ += *d++ * rdst;\
+*d2++ += *e++ * rdst;\
+*d3++ += *f++ * rdst;\
+*d4++ += rdst;
+
+/* the transformed channels are shared by the workers of a frame, each
+ * worker has three channels of s, m and num and one den of its own */
+typedef struct S(artistic_buf) {
+    CPLX** src1;
+    CPLX** src2;
+    CPLX** s;
+    CPLX** m;
+
+    REAL** num;
+    REAL** den;
+    int workers;
+} S(artistic_buf);
+
+/* plans and sector kernels for one frame size, shared by every thread, and
+ * the scratch buffers of each thread */
+typedef struct S(artistic_fft) {
+    FFTW(plan)              forward;
+    FFTW(plan)              backward;
+    CPLX**                  g;
+    S(artistic_buf)**       b;
+} S(artistic_fft);
+
+/* bytes of the buffers one thread allocates for an nx by ny frame */
+static size_t S(artistic_buf_bytes) (int nx, int ny, int workers)
+{
+    return sizeof(CPLX)*ny*(nx/2+1) * (2*3 + workers*(2*3 + 3 + 1));
+}
+
+/* bytes of the ns sector kernels of an nx by ny frame */
+static size_t S(artistic_kernel_bytes) (int nx, int ny, int ns)
+{
+    return sizeof(CPLX)*ny*(nx/2+1) * ns;
+}
+
+static CPLX* S(gen_sec) (const int nx, const int ny,
+                         S(artistic_fft)* f, const double a, const double wd,
+                         const REAL* g1, const CPLX* g2) {
+    int i, j, x, y;
+    double total = 0;
+    REAL* out;
+
+    REAL* sec_d = FFTW(malloc) (sizeof(REAL)*ny*2*(nx/2+1));
+    if (NULL == sec_d) {
+      return NULL;
+    }
+    CPLX* sec = (CPLX*)sec_d;
+    memset(sec_d, 0, sizeof(REAL)*ny*2*(nx/2+1));
+    for (j = 0; j < ny; j++) {
+        for (i = 0; i < nx; i++) {
+            register double x_val = -nx/2.0 + (i) * (double)nx/(double)(nx-1);
+            register double y_val =  ny/2.0 - (j) * (double)ny/(double)(ny-1);
+
+            sec_d[i+j*2*(nx/2+1)] = (x_val*cos(a-wd+M_PI/2.0) + y_val*sin(a-wd+M_PI/2.0) >  0 ? 1 : 0) *
+                                    (x_val*cos(a+wd+M_PI/2.0) + y_val*sin(a+wd+M_PI/2.0) <= 0 ? 1 : 0);
+        }
+    }
+    FFTW(execute_dft_r2c) (f->forward, sec_d, sec);
+
+    for (i = 0; i < ny*(nx/2+1); i++) {
+        sec[i] *= g2[i];
+    }
+
+    FFTW(execute_dft_c2r) (f->backward, sec, sec_d);
+
+    if (NULL == (out = FFTW(malloc) (sizeof(REAL)*ny*2*(nx/2+1)))) {
+      FFTW(free) (sec);
+      return NULL;
+    }
+    x = nx/2;
+    y = ny/2;
+    for (j = 0; j < ny; j++) {
+        int k = (j - y) % ny;
+        k = k < 0 ? ny + k : k;
+        for (i = 0; i < nx; i++) {
+            int h = (i - x) % nx;
+            h = h < 0 ? nx + h : h;
+            out[i+j*2*(nx/2+1)] = sec_d[h+k*2*(nx/2+1)] / (nx*ny) * g1[i+j*nx];
+            total += out[i+j*2*(nx/2+1)];
+        }
+    }
+
+    for (i = 0; i < ny*2*(nx/2+1); i++) {
+        out[i] /= total;
+    }
+
+    FFTW(execute_dft_r2c) (f->forward, out, (CPLX*)out);
+
+    FFTW(free) (sec);
+    return (CPLX*)out;
+}
+
+/* called with the context mutex held, the fftw planner is not reentrant */
+static S(artistic_fft)* S(fft_new) (int nx, int ny, unsigned flags,
+                                    int num_threads)
+{
+    S(artistic_fft)* f;
+    CPLX* in;
+
+    if (NULL == (f = calloc (1, sizeof(S(artistic_fft))))) {
+        return NULL;
+    }
+    if (NULL == (f->b = calloc (num_threads, sizeof(S(artistic_buf)*))) ||
+        NULL == (in = FFTW(malloc) (sizeof(CPLX)*ny*(nx/2+1))))
+    {
+        free (f->b);
+        free (f);
+        return NULL;
+    }
+    f->forward  = FFTW(plan_dft_r2c_2d) (ny, nx, (REAL*)in, in, flags);
+    f->backward = FFTW(plan_dft_c2r_2d) (ny, nx, in, (REAL*)in, flags);
+    FFTW(free) (in);
+
+    if (NULL == f->forward || NULL == f->backward) {
+        if (f->forward) FFTW(destroy_plan) (f->forward);
+        if (f->backward) FFTW(destroy_plan) (f->backward);
+        free (f->b);
+        free (f);
+        return NULL;
+    }
+    return f;
+}
+
+static void S(free_thread_bufs) (S(artistic_fft)* fft, int thread_id)
+{
+    S(artistic_buf)* f = fft->b[thread_id];
+    int i;
+
+    if (NULL == f) {
+        return;
+    }
+
+    for (i = 0; i < 3; i++) {
+        if (NULL != f->src1) FFTW(free) (f->src1[i]);
+        if (NULL != f->src2) FFTW(free) (f->src2[i]);
+    }
+    for (i = 0; i < 3*f->workers; i++) {
+        if (NULL != f->s)    FFTW(free) (f->s[i]);
+        if (NULL != f->m)    FFTW(free) (f->m[i]);
+        if (NULL != f->num)  FFTW(free) (f->num[i]);
+    }
+    for (i = 0; i < f->workers; i++) {
+        if (NULL != f->den)  FFTW(free) (f->den[i]);
+    }
+
+    FFTW(free) (f->src1);
+    FFTW(free) (f->src2);
+    FFTW(free) (f->s);
+    FFTW(free) (f->m);
+    FFTW(free) (f->num);
+    FFTW(free) (f->den);
+    free (f);
+
+    fft->b[thread_id] = NULL;
+}
+
+/* called with the context mutex held */
+static void S(fft_free) (S(artistic_fft)* f, int num_threads, int ns)
+{
+    int i;
+
+    if (NULL == f) {
+        return;
+    }
+    for (i = 0; i < num_threads; i++) {
+        S(free_thread_bufs) (f, i);
+    }
+    if (NULL != f->g) {
+        for (i = 0; i < ns; i++) {
+            FFTW(free) (f->g[i]);
+        }
+        FFTW(free) (f->g);
+    }
+    FFTW(destroy_plan) (f->forward);
+    FFTW(destroy_plan) (f->backward);
+    free (f->b);
+    free (f);
+}
+
+static int S(init_thread_bufs) (S(artistic_fft)* fft, int nx, int ny,
+                                int thread_id, int workers)
+{
+    int i;
+
+    S(artistic_buf)* f = calloc (1, sizeof(S(artistic_buf)));
+    if (NULL == f) {
+      return -1;
+    }
+    fft->b[thread_id] = f;
+
+    f->src1 = FFTW(malloc) (sizeof(CPLX*)*3);
+    f->src2 = FFTW(malloc) (sizeof(CPLX*)*3);
+    f->s    = FFTW(malloc) (sizeof(CPLX*)*3*workers);
+    f->m    = FFTW(malloc) (sizeof(CPLX*)*3*workers);
+    f->num  = FFTW(malloc) (sizeof(REAL*)*3*workers);
+    f->den  = FFTW(malloc) (sizeof(REAL*)*workers);
+    if (NULL == f->src1 || NULL == f->src2 || NULL == f->s
+     || NULL == f->m || NULL == f->num || NULL == f->den) {
+      FFTW(free) (f->src1);
+      FFTW(free) (f->src2);
+      FFTW(free) (f->s);
+      FFTW(free) (f->m);
+      FFTW(free) (f->num);
+      FFTW(free) (f->den);
+      free (f);
+      fft->b[thread_id] = NULL;
+      return -1;
+    }
+    f->workers = workers;
+
+    for (i = 0; i < 3; i++) {
+        f->src1[i]  = FFTW(malloc) (sizeof(CPLX)*ny*(nx/2+1));
+        f->src2[i]  = FFTW(malloc) (sizeof(CPLX)*ny*(nx/2+1));
+    }
+    for (i = 0; i < 3*workers; i++) {
+        f->s[i]     = FFTW(malloc) (sizeof(CPLX)*ny*(nx/2+1));
+        f->m[i]     = FFTW(malloc) (sizeof(CPLX)*ny*(nx/2+1));
+        f->num[i]   = FFTW(malloc) (sizeof(REAL)*ny*2*(nx/2+1));
+    }
+    for (i = 0; i < workers; i++) {
+        f->den[i]   = FFTW(malloc) (sizeof(REAL)*ny*2*(nx/2+1));
+    }
+    for (i = 0; i < 3; i++) {
+        if (NULL == f->src1[i] || NULL == f->src2[i]) {
+          S(free_thread_bufs) (fft, thread_id);
+          return -1;
+        }
+    }
+    for (i = 0; i < 3*workers; i++) {
+        if (NULL == f->s[i] || NULL == f->m[i] || NULL == f->num[i] ||
+            NULL == f->den[i/3]) {
+          S(free_thread_bufs) (fft, thread_id);
+          return -1;
+        }
+    }
+    return 0;
+}
+
+/* the gaussian weighted sector kernels in the frequency domain */
+static int S(init_kernels) (S(artistic_fft)* f, int nx, int ny, double sgm,
+                            int ns)
+{
+    const int nxny = nx*ny;
+    int i;
+    REAL* g1;
+    REAL* g;
+    CPLX* g2;
+    REAL* g2_d;
+    CPLX** gc;
+    CPLX** k;
+
+    if (NULL == (k = FFTW(malloc) (sizeof(CPLX*)*ns))) {
+      return -1;
+    }
+    memset (k, 0, sizeof(CPLX*)*ns);
+
+    g1 = malloc (sizeof(REAL)*nxny);
+    g2 = FFTW(malloc) (sizeof(CPLX)*ny*(nx/2+1));
+    if (NULL == g1 || NULL == g2) {
+      free (g1);
+      FFTW(free) (g2);
+      FFTW(free) (k);
+      return -1;
+    }
+
+    i = nxny;
+    g = g1 + nxny - 1;
+    while (i--) {
+        register double x_val = -nx/2.0 + (i%nx) * nx/(nx-1);
+        register double y_val =  ny/2.0 - (i/nx) * ny/(ny-1);
+        *g-- = exp(-(x_val*x_val+y_val*y_val)/(2.0*sgm*sgm));
+    }
+
+    g2_d = (REAL*)g2;
+    memset(g2, 0, sizeof(CPLX)*ny*(nx/2+1));
+    g = g2_d + ny*2*(nx/2+1) - 1;
+    i = ny*2*(nx/2+1);
+    while (i--) {
+        register const int y = (i / (2*(nx/2+1))) - ny/2.0;
+        register const int x = (i % (2*(nx/2+1))) - nx/2.0;
+        *g-- = exp(-0.5*(x*x+y*y));
+    }
+    FFTW(execute_dft_r2c) (f->forward, g2_d, g2);
+
+    gc = k + ns - 1;
+    i = ns;
+    while (i--) {
+        *gc-- = S(gen_sec)(nx, ny, f, i*2.0*M_PI/ns, M_PI/ns, g1, g2);
+    }
+
+    FFTW(free) (g2);
+    free (g1);
+
+    for (i = 0; i < ns; i++) {
+        if (NULL == k[i]) {
+            for (i = 0; i < ns; i++) {
+                FFTW(free) (k[i]);
+            }
+            FFTW(free) (k);
+            return -1;
+        }
+    }
+    f->g = k;
+    return 0;
+}
+
+static void S(multiply_6_c)(CPLX* d1, const CPLX* s1,
+                            CPLX* d2, const CPLX* s2,
+                            CPLX* d3, const CPLX* s3,
+                            CPLX* d4, const CPLX* s4,
+                            CPLX* d5, const CPLX* s5,
+                            CPLX* d6, const CPLX* s6,
+                            const CPLX* m, const int n) {
+    register unsigned int i = n;
+    unsigned int correction = n % 8;
+    i -= correction;
+
+    while (i) {
+        MULTIPLY_6_C_INNER;
+        MULTIPLY_6_C_INNER;
+        MULTIPLY_6_C_INNER;
+        MULTIPLY_6_C_INNER;
+        MULTIPLY_6_C_INNER;
+        MULTIPLY_6_C_INNER;
+        MULTIPLY_6_C_INNER;
+        MULTIPLY_6_C_INNER;
+        i -= 8;
+    }
+
+    while (correction--) {
+        MULTIPLY_6_C_INNER;
+    }
+}
+
+static void S(divide_mul_const)(REAL* d, const REAL* s, const REAL c, const int n) {
+    register unsigned int i = n;
+    unsigned int correction = n % 8;
+    i -= correction;
+
+    while (i) {
+        *d++ /= *s++ * c;
+        *d++ /= *s++ * c;
+        *d++ /= *s++ * c;
+        *d++ /= *s++ * c;
+        *d++ /= *s++ * c;
+        *d++ /= *s++ * c;
+        *d++ /= *s++ * c;
+        *d++ /= *s++ * c;
+        i -= 8;
+    }
+
+    while (correction--) {
+        *d++ /= *s++ * c;
+    }
+}
+
+static void S(mesh) (const REAL* a, const REAL* b, const REAL* c,
+                     const REAL* d, const REAL* e, const REAL* f,
+                     const REAL k, const REAL k2,
+                     REAL* d1, REAL* d2, REAL* d3, REAL* d4, const int n) {
+
+    register unsigned int i = n;
+    register REAL rdst;
+    unsigned int correction = n % 8;
+    i -= correction;
+
+    while (i) {
+        MESH_D_INNER;
+        MESH_D_INNER;
+        MESH_D_INNER;
+        MESH_D_INNER;
+        MESH_D_INNER;
+        MESH_D_INNER;
+        MESH_D_INNER;
+        MESH_D_INNER;
+        i -= 8;
+    }
+
+    while (correction--) {
+        MESH_D_INNER;
+    }
+}
+
+/* one frame being smoothed, split into tasks that may run on a pool */
+typedef struct S(artistic_job) {
+    uint8_t*            src;
+    uint8_t*            dst;
+    int                 nx;
+    int                 ny;
+    int                 pitch;
+    int                 ns;
+    int                 workers;
+    int                 bands;
+    S(artistic_fft)*    f;
+    S(artistic_buf)*    ab;
+} S(artistic_job);
+
+/* fill and transform one channel of the frame, tasks 0-2, or of its
+ * square, tasks 3-5 */
+static void S(forward_task) (void* arg, int task)
+{
+    S(artistic_job)* job = arg;
+    const int k = task % 3;
+    const int width = 2*(job->nx/2+1);
+    CPLX* c = task < 3 ? job->ab->src1[k] : job->ab->src2[k];
+    REAL* d = (REAL*) c;
+    int i, j;
+
+    for (j = 0; j < job->ny; j++) {
+        uint8_t* data = job->src + j*job->pitch + k;
+        REAL* ptr = d + j*width;
+
+        if (task < 3) {
+            for (i = 0; i < job->nx; i++, data += 3) {
+                *ptr++ = *data;
+            }
+        } else {
+            for (i = 0; i < job->nx; i++, data += 3) {
+                register REAL temp = *data;
+                *ptr++ = temp*temp;
+            }
+        }
+    }
+
+    FFTW(execute_dft_r2c) (job->f->forward, d, c);
+}
+
+/* every workers'th sector starting at the task's own, summed into the
+ * task's num and den */
+static void S(sector_task) (void* arg, int task)
+{
+    S(artistic_job)* job = arg;
+    S(artistic_buf)* ab = job->ab;
+    S(artistic_fft)* f = job->f;
+    const REAL nxny = job->nx*job->ny;
+    const REAL nxny2 = nxny*nxny;
+    const int n = job->ny*(job->nx/2+1);
+    const int n2 = n*2;
+    int i, k;
+
+    CPLX** src1_c = ab->src1;
+    CPLX** src2_c = ab->src2;
+    CPLX** s_c = ab->s + 3*task;
+    CPLX** m_c = ab->m + 3*task;
+
+    REAL** num = ab->num + 3*task;
+    REAL* den = ab->den[task];
+
+    REAL* s_d[3];
+    REAL* m_d[3];
+
+    for (k = 0; k < 3; k++) {
+        s_d[k]      = (REAL*) s_c[k];
+        m_d[k]      = (REAL*) m_c[k];
+    }
+
+    for (k = 0; k < 3; k++) {
+        memset (num[k], 0, sizeof(REAL)*n2);
+    }
+    memset (den, 0, sizeof(REAL)*n2);
+
+    for (i = task; i < job->ns; i += job->workers) {
+        CPLX* g_fft = f->g[i];
+
+        S(multiply_6_c)(m_c[0], src1_c[0],
+                        m_c[1], src1_c[1],
+                        m_c[2], src1_c[2],
+                        s_c[0], src2_c[0],
+                        s_c[1], src2_c[1],
+                        s_c[2], src2_c[2],
+                        g_fft, n);
+
+        for (k = 0; k < 3; k++) {
+            FFTW(execute_dft_c2r) (f->backward, m_c[k], m_d[k]);
+            FFTW(execute_dft_c2r) (f->backward, s_c[k], s_d[k]);
+        }
+
+        S(mesh) (s_d[0], s_d[1], s_d[2], m_d[0], m_d[1], m_d[2], nxny, nxny2,
+                 num[0], num[1], num[2], den, n2);
+    }
+}
+
+/* add the other workers' num and den into the first's and normalise, over
+ * one band of the buffers */
+static void S(reduce_task) (void* arg, int task)
+{
+    S(artistic_job)* job = arg;
+    S(artistic_buf)* ab = job->ab;
+    const REAL nxny = job->nx*job->ny;
+    const int n2 = 2*job->ny*(job->nx/2+1);
+    const int start = (int64_t) n2*task / job->bands;
+    const int end = (int64_t) n2*(task+1) / job->bands;
+    REAL** num = ab->num;
+    REAL** den = ab->den;
+    int i, k, w;
+
+    for (w = 1; w < job->workers; w++) {
+        for (k = 0; k < 3; k++) {
+            for (i = start; i < end; i++) {
+                num[k][i] += num[3*w+k][i];
+            }
+        }
+        for (i = start; i < end; i++) {
+            den[0][i] += den[w][i];
+        }
+    }
+
+    for (k = 0; k < 3; k++) {
+        S(divide_mul_const)(num[k] + start, den[0] + start, nxny, end - start);
+    }
+}
+
+/* undo the kernels' shift into one band of rows of the output */
+static void S(output_task) (void* arg, int task)
+{
+    S(artistic_job)* job = arg;
+    REAL** num = job->ab->num;
+    const int nx = job->nx;
+    const int ny = job->ny;
+    const int start = ny*task / job->bands;
+    const int end = ny*(task+1) / job->bands;
+    int i, j, x, y;
+
+    x = nx/2.0;
+    y = ny/2.0;
+    for (j = start; j < end; j++) {
+        int k = (j - y) % ny;
+        k = (k < 0 ? ny + k : k) * 2*(nx/2+1);
+        uint8_t* d = job->dst + j*job->pitch;
+        for (i = 0; i < nx; i++) {
+            int z;
+            int h = (i - x) % nx;
+            h = (h < 0 ? nx + h : h) + k;
+            for (z = 0; z < 3; z++) {
+                *d++ = num[z][h];
+            }
+        }
+    }
+}
+
+/* with a pool the six forward transforms, the sectors of each worker, the
+ * reduction and the output each run as one batch. without one the tasks
+ * run in turn on the calling thread */
+static void S(artistic_smooth) (uint8_t* src,
+                                uint8_t* dst,
+                                double ns,
+                                double q,
+                                int nx, int ny, int pitch,
+                                S(artistic_fft)* f,
+                                S(artistic_buf)* ab,
+                                workpool* pool)
+{
+    S(artistic_job) job;
+
+    (void) q;
+
+    job.src = src;
+    job.dst = dst;
+    job.nx = nx;
+    job.ny = ny;
+    job.pitch = pitch;
+    job.ns = ns;
+    job.workers = ab->workers < job.ns ? ab->workers : job.ns;
+    job.bands = NULL == pool ? 1 : workpool_threads (pool);
+    job.f = f;
+    job.ab = ab;
+
+    artistic_tasks (pool, S(forward_task), &job, 6);
+    artistic_tasks (pool, S(sector_task), &job, job.workers);
+    artistic_tasks (pool, S(reduce_task), &job, job.bands);
+    artistic_tasks (pool, S(output_task), &job, job.bands);
+}
+
+#undef MULTIPLY_6_C_INNER
+#undef MESH_D_INNER
+
+#undef REAL
+#undef CPLX
+#undef FFTW
+#undef S
+
+#undef ARTISTIC_REAL
+#undef ARTISTIC_X
+#undef ARTISTIC_S
@@ -0,0 +1,923 @@
+/******************************************************************************
+ * Copyright (c) 2010 Joey Degges
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CV_X86 1
+#include <immintrin.h>
+#endif
+
+#include "image.h"
+#include "plugin.h"
+#include "rbio.h"
+
+/* function definitions */
+int convert_query (plugin_stage   stage,
+                   plugin_info**  pi);
+
+int cv_convert_init (plugin_context* ctx,
+                     int             thread_id,
+                     char*           args);
+int cv_convert_exec (plugin_context* ctx,
+                     int             thread_id,
+                     image_t**       src_data,
+                     image_t**       dst_data);
+int cv_convert_exit (plugin_context* ctx,
+                     int             thread_id);
+int cv_convert_prepare (plugin_context* ctx,
+                        image_t*        info);
+
+/* the packed 32 bit formats are native endian words, name the two byte
+ * orders the kernels write */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CV_FMT_BGRA FMT_RGB32
+#define CV_FMT_RGBA FMT_BGR32
+#else
+#define CV_FMT_BGRA FMT_BGR32_1
+#define CV_FMT_RGBA FMT_RGB32_1
+#endif
+
+/* convert plugin configuration */
+static const char convert_name[] = "convert";
+static const data_fmt convert_fmt[] = {
+    FMT_YUYV,       FMT_UYVY,       FMT_NV12,
+    FMT_YUV420P,    FMT_RGB24,      FMT_BGR24,
+    CV_FMT_BGRA,    CV_FMT_RGBA,    -1};
+static plugin_info pi_convert = {.stage=PLUGIN_STAGE_CONVERT,
+                                 .type=PLUGIN_TYPE_ASYNC,
+                                 .src_fmt=convert_fmt,
+                                 .dst_fmt=convert_fmt,
+                                 .name=convert_name,
+                                 .init=cv_convert_init,
+                                 .exit=cv_convert_exit,
+                                 .exec=cv_convert_exec,
+                                 .prepare=cv_convert_prepare};
+
+int convert_query (plugin_stage stage, plugin_info** pi)
+{
+    *pi = NULL;
+    switch (stage) {
+        case PLUGIN_STAGE_CONVERT:
+            *pi = &pi_convert;
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+/* studio range colour matrices. yuv -> rgb coefficients are scaled by 2^14
+ * to suit 16 bit multiply-high arithmetic; blue's weight on u is 2 plus bu.
+ * rgb -> yuv coefficients are scaled by 2^8 */
+typedef struct cv_matrix {
+    int16_t y, rv, gu, gv, bu;
+    int yr, yg, yb;
+    int ur, ug, ub;
+    int vr, vg, vb;
+} cv_matrix;
+
+static const cv_matrix cv_bt601 = {
+    19071, 26149, 6406, 13320, 295,
+     66, 129,  25,
+    -38, -74, 112,
+    112, -94, -18};
+
+static const cv_matrix cv_bt709 = {
+    19071, 29377, 3490, 8733, 1835,
+     47, 157,  16,
+    -26, -87, 112,
+    112, -102, -10};
+
+/* byte offsets of each channel within an rgb pixel */
+typedef struct cv_layout {
+    int size;
+    int r, g, b;
+} cv_layout;
+
+static const cv_layout layout_rgb = {3, 0, 1, 2};
+static const cv_layout layout_bgr = {3, 2, 1, 0};
+static const cv_layout layout_rgba = {4, 0, 1, 2};
+static const cv_layout layout_bgra = {4, 2, 1, 0};
+
+static const cv_layout* cv_rgb_layout (data_fmt fmt)
+{
+    switch (fmt) {
+        case FMT_RGB24:     return &layout_rgb;
+        case FMT_BGR24:     return &layout_bgr;
+        case CV_FMT_RGBA:   return &layout_rgba;
+        case CV_FMT_BGRA:   return &layout_bgra;
+        default:            return NULL;
+    }
+}
+
+static int cv_is_yuv (data_fmt fmt)
+{
+    return FMT_YUYV == fmt || FMT_UYVY == fmt ||
+           FMT_NV12 == fmt || FMT_YUV420P == fmt;
+}
+
+/* bytes taken by a frame; the 4:2:0 formats round their chroma up so odd
+ * sizes keep their last row and column */
+static size_t cv_frame_size (data_fmt fmt, int64_t width, int64_t height)
+{
+    size_t cw = (width + 1) / 2;
+    size_t ch = (height + 1) / 2;
+
+    switch (fmt) {
+        case FMT_YUYV:
+        case FMT_UYVY:
+            return (size_t) width * height * 2;
+        case FMT_NV12:
+        case FMT_YUV420P:
+            return (size_t) width * height + 2 * cw * ch;
+        default:
+            return cv_rgb_layout (fmt)
+                ? (size_t) width * height * cv_rgb_layout (fmt)->size : 0;
+    }
+}
+
+
+/* yuv -> rgb rows. every kernel writes 4 byte pixels ordered b, g, r, a (or
+ * r, g, b, a when swap is set) from a row of luma and a row of horizontally
+ * subsampled chroma. the scalar kernel mirrors the saturating 16 bit steps
+ * of the vector ones so that every path gives the same bytes */
+typedef void (*cv_row_fn) (const uint8_t* y, const uint8_t* u,
+                           const uint8_t* v, uint8_t* dst, int width,
+                           const cv_matrix* m, int swap);
+
+/* drops the fourth byte of each pixel */
+typedef void (*cv_pack_fn) (const uint8_t* src, uint8_t* dst, int width);
+
+/* splits n interleaved pairs into two planes */
+typedef void (*cv_split_fn) (const uint8_t* src, uint8_t* a, uint8_t* b,
+                             int n);
+
+/* splits a row of packed 4:2:2 into planes, luma first or second */
+typedef void (*cv_unpack_fn) (const uint8_t* src, uint8_t* y, uint8_t* u,
+                              uint8_t* v, int width, int yfirst);
+
+typedef struct cv_simd {
+    const char*     name;
+    cv_row_fn       row;
+    cv_pack_fn      pack;
+    cv_split_fn     split;
+    cv_unpack_fn    unpack;
+} cv_simd;
+
+static inline int cv_sat (int x)
+{
+    return x < -32768 ? -32768 : 32767 < x ? 32767 : x;
+}
+
+static inline uint8_t cv_clamp (int x)
+{
+    return x < 0 ? 0 : 255 < x ? 255 : x;
+}
+
+static void cv_row_scalar (const uint8_t* y, const uint8_t* u,
+                           const uint8_t* v, uint8_t* dst, int width,
+                           const cv_matrix* m, int swap)
+{
+    int x;
+
+    for (x = 0; x < width; x++) {
+        int yy = (y[x] < 16 ? 0 : y[x] - 16) << 8;
+        int uu = (u[x / 2] - 128) * 256;
+        int vv = (v[x / 2] - 128) * 256;
+        int yt = ((yy * m->y) >> 16) + 32;
+        int r = cv_sat (yt + ((vv * m->rv) >> 16));
+        int g = cv_sat (cv_sat (yt - ((uu * m->gu) >> 16)) -
+                        ((vv * m->gv) >> 16));
+        int b = cv_sat (cv_sat (yt + (uu >> 1)) + ((uu * m->bu) >> 16));
+
+        dst[4 * x + (swap ? 2 : 0)] = cv_clamp (b >> 6);
+        dst[4 * x + 1] = cv_clamp (g >> 6);
+        dst[4 * x + (swap ? 0 : 2)] = cv_clamp (r >> 6);
+        dst[4 * x + 3] = 0xFF;
+    }
+}
+
+static void cv_pack_scalar (const uint8_t* src, uint8_t* dst, int width)
+{
+    int x;
+
+    for (x = 0; x < width; x++) {
+        dst[3 * x] = src[4 * x];
+        dst[3 * x + 1] = src[4 * x + 1];
+        dst[3 * x + 2] = src[4 * x + 2];
+    }
+}
+
+static void cv_split_scalar (const uint8_t* src, uint8_t* a, uint8_t* b,
+                             int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        a[i] = src[2 * i];
+        b[i] = src[2 * i + 1];
+    }
+}
+
+static void cv_unpack_scalar (const uint8_t* src, uint8_t* y, uint8_t* u,
+                              uint8_t* v, int width, int yfirst)
+{
+    int yo = yfirst ? 0 : 1;
+    int co = yfirst ? 1 : 0;
+    int x;
+
+    for (x = 0; x < width / 2; x++) {
+        y[2 * x] = src[4 * x + yo];
+        y[2 * x + 1] = src[4 * x + yo + 2];
+        u[x] = src[4 * x + co];
+        v[x] = src[4 * x + co + 2];
+    }
+}
+
+static const cv_simd cv_simd_scalar = {"scalar", cv_row_scalar,
+                                       cv_pack_scalar, cv_split_scalar,
+                                       cv_unpack_scalar};
+
+#ifdef CV_X86
+__attribute__ ((target ("sse2")))
+static void cv_row_sse2 (const uint8_t* y, const uint8_t* u,
+                         const uint8_t* v, uint8_t* dst, int width,
+                         const cv_matrix* m, int swap)
+{
+    const __m128i zero = _mm_setzero_si128 ();
+    const __m128i off16 = _mm_set1_epi8 (16);
+    const __m128i off128 = _mm_set1_epi8 ((char) 0x80);
+    const __m128i round = _mm_set1_epi16 (32);
+    const __m128i alpha = _mm_set1_epi8 ((char) 0xFF);
+    const __m128i cy = _mm_set1_epi16 (m->y);
+    const __m128i crv = _mm_set1_epi16 (m->rv);
+    const __m128i cgu = _mm_set1_epi16 (m->gu);
+    const __m128i cgv = _mm_set1_epi16 (m->gv);
+    const __m128i cbu = _mm_set1_epi16 (m->bu);
+    int x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        __m128i ys = _mm_subs_epu8 (_mm_loadu_si128 ((const __m128i*) (y + x)),
+                                    off16);
+        __m128i us = _mm_xor_si128 (_mm_loadl_epi64 ((const __m128i*)
+                                                     (u + x / 2)), off128);
+        __m128i vs = _mm_xor_si128 (_mm_loadl_epi64 ((const __m128i*)
+                                                     (v + x / 2)), off128);
+        __m128i r[2], g[2], b[2];
+        __m128i c0, c1, c2, lo, hi;
+        int h;
+
+        /* one chroma sample covers two pixels */
+        us = _mm_unpacklo_epi8 (us, us);
+        vs = _mm_unpacklo_epi8 (vs, vs);
+
+        for (h = 0; h < 2; h++) {
+            /* placing the byte in the high half gives value << 8 */
+            __m128i yy = h ? _mm_unpackhi_epi8 (zero, ys)
+                           : _mm_unpacklo_epi8 (zero, ys);
+            __m128i uu = h ? _mm_unpackhi_epi8 (zero, us)
+                           : _mm_unpacklo_epi8 (zero, us);
+            __m128i vv = h ? _mm_unpackhi_epi8 (zero, vs)
+                           : _mm_unpacklo_epi8 (zero, vs);
+            __m128i yt = _mm_adds_epi16 (_mm_mulhi_epu16 (yy, cy), round);
+
+            r[h] = _mm_adds_epi16 (yt, _mm_mulhi_epi16 (vv, crv));
+            g[h] = _mm_subs_epi16 (_mm_subs_epi16 (yt,
+                                       _mm_mulhi_epi16 (uu, cgu)),
+                                   _mm_mulhi_epi16 (vv, cgv));
+            b[h] = _mm_adds_epi16 (_mm_adds_epi16 (yt,
+                                       _mm_srai_epi16 (uu, 1)),
+                                   _mm_mulhi_epi16 (uu, cbu));
+
+            r[h] = _mm_srai_epi16 (r[h], 6);
+            g[h] = _mm_srai_epi16 (g[h], 6);
+            b[h] = _mm_srai_epi16 (b[h], 6);
+        }
+
+        c1 = _mm_packus_epi16 (g[0], g[1]);
+        if (swap) {
+            c0 = _mm_packus_epi16 (r[0], r[1]);
+            c2 = _mm_packus_epi16 (b[0], b[1]);
+        } else {
+            c0 = _mm_packus_epi16 (b[0], b[1]);
+            c2 = _mm_packus_epi16 (r[0], r[1]);
+        }
+
+        lo = _mm_unpacklo_epi8 (c0, c1);
+        hi = _mm_unpacklo_epi8 (c2, alpha);
+        _mm_storeu_si128 ((__m128i*) (dst + 4 * x),
+                          _mm_unpacklo_epi16 (lo, hi));
+        _mm_storeu_si128 ((__m128i*) (dst + 4 * x + 16),
+                          _mm_unpackhi_epi16 (lo, hi));
+        lo = _mm_unpackhi_epi8 (c0, c1);
+        hi = _mm_unpackhi_epi8 (c2, alpha);
+        _mm_storeu_si128 ((__m128i*) (dst + 4 * x + 32),
+                          _mm_unpacklo_epi16 (lo, hi));
+        _mm_storeu_si128 ((__m128i*) (dst + 4 * x + 48),
+                          _mm_unpackhi_epi16 (lo, hi));
+    }
+
+    cv_row_scalar (y + x, u + x / 2, v + x / 2, dst + 4 * x, width - x, m,
+                   swap);
+}
+
+__attribute__ ((target ("sse2")))
+static void cv_split_sse2 (const uint8_t* src, uint8_t* a, uint8_t* b, int n)
+{
+    const __m128i zero = _mm_setzero_si128 ();
+    const __m128i mask = _mm_set1_epi16 (0x00FF);
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m128i s = _mm_loadu_si128 ((const __m128i*) (src + 2 * i));
+
+        _mm_storel_epi64 ((__m128i*) (a + i),
+                          _mm_packus_epi16 (_mm_and_si128 (s, mask), zero));
+        _mm_storel_epi64 ((__m128i*) (b + i),
+                          _mm_packus_epi16 (_mm_srli_epi16 (s, 8), zero));
+    }
+
+    cv_split_scalar (src + 2 * i, a + i, b + i, n - i);
+}
+
+__attribute__ ((target ("sse2")))
+static void cv_unpack_sse2 (const uint8_t* src, uint8_t* y, uint8_t* u,
+                            uint8_t* v, int width, int yfirst)
+{
+    const __m128i zero = _mm_setzero_si128 ();
+    const __m128i mask = _mm_set1_epi16 (0x00FF);
+    int x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        __m128i s0 = _mm_loadu_si128 ((const __m128i*) (src + 2 * x));
+        __m128i s1 = _mm_loadu_si128 ((const __m128i*) (src + 2 * x + 16));
+        __m128i even = _mm_packus_epi16 (_mm_and_si128 (s0, mask),
+                                         _mm_and_si128 (s1, mask));
+        __m128i odd = _mm_packus_epi16 (_mm_srli_epi16 (s0, 8),
+                                        _mm_srli_epi16 (s1, 8));
+        __m128i c = yfirst ? odd : even;
+
+        _mm_storeu_si128 ((__m128i*) (y + x), yfirst ? even : odd);
+        _mm_storel_epi64 ((__m128i*) (u + x / 2),
+                          _mm_packus_epi16 (_mm_and_si128 (c, mask), zero));
+        _mm_storel_epi64 ((__m128i*) (v + x / 2),
+                          _mm_packus_epi16 (_mm_srli_epi16 (c, 8), zero));
+    }
+
+    cv_unpack_scalar (src + 2 * x, y + x, u + x / 2, v + x / 2, width - x,
+                      yfirst);
+}
+
+static const cv_simd cv_simd_sse2 = {"sse2", cv_row_sse2, cv_pack_scalar,
+                                     cv_split_sse2, cv_unpack_sse2};
+
+__attribute__ ((target ("avx2")))
+static void cv_row_avx2 (const uint8_t* y, const uint8_t* u,
+                         const uint8_t* v, uint8_t* dst, int width,
+                         const cv_matrix* m, int swap)
+{
+    const __m256i zero = _mm256_setzero_si256 ();
+    const __m256i off16 = _mm256_set1_epi8 (16);
+    const __m128i off128 = _mm_set1_epi8 ((char) 0x80);
+    const __m256i round = _mm256_set1_epi16 (32);
+    const __m256i alpha = _mm256_set1_epi8 ((char) 0xFF);
+    const __m256i cy = _mm256_set1_epi16 (m->y);
+    const __m256i crv = _mm256_set1_epi16 (m->rv);
+    const __m256i cgu = _mm256_set1_epi16 (m->gu);
+    const __m256i cgv = _mm256_set1_epi16 (m->gv);
+    const __m256i cbu = _mm256_set1_epi16 (m->bu);
+    int x;
+
+    for (x = 0; x + 32 <= width; x += 32) {
+        __m256i ys = _mm256_subs_epu8 (_mm256_loadu_si256 ((const __m256i*)
+                                                           (y + x)), off16);
+        __m128i u8 = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i*)
+                                                     (u + x / 2)), off128);
+        __m128i v8 = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i*)
+                                                     (v + x / 2)), off128);
+        __m256i us, vs;
+        __m256i r[2], g[2], b[2];
+        __m256i c0, c1, c2, lo, hi, p0, p1, p2, p3;
+        int h;
+
+        /* chroma doubled up in pixel order across both lanes, so the lane
+         * local unpacks below pair it with the right luma */
+        us = _mm256_inserti128_si256 (_mm256_castsi128_si256 (
+                                          _mm_unpacklo_epi8 (u8, u8)),
+                                      _mm_unpackhi_epi8 (u8, u8), 1);
+        vs = _mm256_inserti128_si256 (_mm256_castsi128_si256 (
+                                          _mm_unpacklo_epi8 (v8, v8)),
+                                      _mm_unpackhi_epi8 (v8, v8), 1);
+
+        for (h = 0; h < 2; h++) {
+            __m256i yy = h ? _mm256_unpackhi_epi8 (zero, ys)
+                           : _mm256_unpacklo_epi8 (zero, ys);
+            __m256i uu = h ? _mm256_unpackhi_epi8 (zero, us)
+                           : _mm256_unpacklo_epi8 (zero, us);
+            __m256i vv = h ? _mm256_unpackhi_epi8 (zero, vs)
+                           : _mm256_unpacklo_epi8 (zero, vs);
+            __m256i yt = _mm256_adds_epi16 (_mm256_mulhi_epu16 (yy, cy),
+                                            round);
+
+            r[h] = _mm256_adds_epi16 (yt, _mm256_mulhi_epi16 (vv, crv));
+            g[h] = _mm256_subs_epi16 (_mm256_subs_epi16 (yt,
+                                          _mm256_mulhi_epi16 (uu, cgu)),
+                                      _mm256_mulhi_epi16 (vv, cgv));
+            b[h] = _mm256_adds_epi16 (_mm256_adds_epi16 (yt,
+                                          _mm256_srai_epi16 (uu, 1)),
+                                      _mm256_mulhi_epi16 (uu, cbu));
+
+            r[h] = _mm256_srai_epi16 (r[h], 6);
+            g[h] = _mm256_srai_epi16 (g[h], 6);
+            b[h] = _mm256_srai_epi16 (b[h], 6);
+        }
+
+        /* the packs undo the lane split of the unpacks above */
+        c1 = _mm256_packus_epi16 (g[0], g[1]);
+        if (swap) {
+            c0 = _mm256_packus_epi16 (r[0], r[1]);
+            c2 = _mm256_packus_epi16 (b[0], b[1]);
+        } else {
+            c0 = _mm256_packus_epi16 (b[0], b[1]);
+            c2 = _mm256_packus_epi16 (r[0], r[1]);
+        }
+
+        lo = _mm256_unpacklo_epi8 (c0, c1);
+        hi = _mm256_unpacklo_epi8 (c2, alpha);
+        p0 = _mm256_unpacklo_epi16 (lo, hi);
+        p1 = _mm256_unpackhi_epi16 (lo, hi);
+        lo = _mm256_unpackhi_epi8 (c0, c1);
+        hi = _mm256_unpackhi_epi8 (c2, alpha);
+        p2 = _mm256_unpacklo_epi16 (lo, hi);
+        p3 = _mm256_unpackhi_epi16 (lo, hi);
+
+        _mm256_storeu_si256 ((__m256i*) (dst + 4 * x),
+                             _mm256_permute2x128_si256 (p0, p1, 0x20));
+        _mm256_storeu_si256 ((__m256i*) (dst + 4 * x + 32),
+                             _mm256_permute2x128_si256 (p2, p3, 0x20));
+        _mm256_storeu_si256 ((__m256i*) (dst + 4 * x + 64),
+                             _mm256_permute2x128_si256 (p0, p1, 0x31));
+        _mm256_storeu_si256 ((__m256i*) (dst + 4 * x + 96),
+                             _mm256_permute2x128_si256 (p2, p3, 0x31));
+    }
+
+    cv_row_sse2 (y + x, u + x / 2, v + x / 2, dst + 4 * x, width - x, m,
+                 swap);
+}
+
+__attribute__ ((target ("avx2")))
+static void cv_pack_avx2 (const uint8_t* src, uint8_t* dst, int width)
+{
+    const __m256i shuf = _mm256_setr_epi8 (0, 1, 2, 4, 5, 6, 8, 9,
+                                           10, 12, 13, 14, -1, -1, -1, -1,
+                                           0, 1, 2, 4, 5, 6, 8, 9,
+                                           10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256i perm = _mm256_setr_epi32 (0, 1, 2, 4, 5, 6, 3, 7);
+    int x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        __m256i s = _mm256_loadu_si256 ((const __m256i*) (src + 4 * x));
+
+        s = _mm256_permutevar8x32_epi32 (_mm256_shuffle_epi8 (s, shuf), perm);
+        _mm_storeu_si128 ((__m128i*) (dst + 3 * x),
+                          _mm256_castsi256_si128 (s));
+        _mm_storel_epi64 ((__m128i*) (dst + 3 * x + 16),
+                          _mm256_extracti128_si256 (s, 1));
+    }
+
+    cv_pack_scalar (src + 4 * x, dst + 3 * x, width - x);
+}
+
+static const cv_simd cv_simd_avx2 = {"avx2", cv_row_avx2, cv_pack_avx2,
+                                     cv_split_sse2, cv_unpack_sse2};
+#endif
+
+/* picks the widest kernels this cpu runs, or the ones named by the simd
+ * option so that the paths can be checked against each other */
+static const cv_simd* cv_simd_select (const char* name)
+{
+#ifdef CV_X86
+    __builtin_cpu_init ();
+    if (NULL != name && 0 == strcasecmp (name, "scalar")) {
+        return &cv_simd_scalar;
+    } else if (NULL != name && 0 == strcasecmp (name, "sse2")) {
+        return __builtin_cpu_supports ("sse2") ? &cv_simd_sse2 : NULL;
+    } else if (NULL != name && 0 == strcasecmp (name, "avx2")) {
+        return __builtin_cpu_supports ("avx2") ? &cv_simd_avx2 : NULL;
+    } else if (NULL != name) {
+        return NULL;
+    }
+
+    if (__builtin_cpu_supports ("avx2")) {
+        return &cv_simd_avx2;
+    } else if (__builtin_cpu_supports ("sse2")) {
+        return &cv_simd_sse2;
+    }
+    return &cv_simd_scalar;
+#else
+    if (NULL != name && strcasecmp (name, "scalar")) {
+        return NULL;
+    }
+    return &cv_simd_scalar;
+#endif
+}
+
+
+typedef struct cv_thread {
+    uint8_t*    buf;
+    size_t      size;
+} cv_thread;
+
+typedef struct cv_context {
+    data_fmt            fmt;
+    const cv_matrix*    matrix;
+    const cv_simd*      simd;
+    buf_pool*           pool;
+    cv_thread*          threads;
+    int                 references;
+} cv_context;
+
+int cv_convert_init (plugin_context* ctx,
+                     int             thread_id,
+                     char*           args)
+{
+    cv_context* c = NULL;
+    char* param;
+    int ret_val = -1;
+
+    (void) thread_id;
+
+    pthread_mutex_lock (&ctx->mutex);
+
+    if (NULL == ctx->data) {
+        if (NULL == (c = calloc (1, sizeof *c)) ||
+            NULL == (c->threads = calloc (ctx->num_threads,
+                                          sizeof *c->threads)) ||
+            NULL == (c->pool = buf_pool_new (64, 2 * ctx->num_threads)))
+        {
+            error_exit ("Out of memory");
+        }
+
+        parse_args (args, 0, "fmt", &param);
+        c->fmt = NULL != param ? image_fmt_from_str (param) : FMT_RGB24;
+        free (param);
+        if (NULL == cv_rgb_layout (c->fmt) && !cv_is_yuv (c->fmt)) {
+            error_exit ("Unsupported ``fmt'' option");
+        }
+
+        parse_args (args, 0, "matrix", &param);
+        if (NULL == param || 0 == strcasecmp (param, "bt601")) {
+            c->matrix = &cv_bt601;
+        } else if (0 == strcasecmp (param, "bt709")) {
+            c->matrix = &cv_bt709;
+        } else {
+            free (param);
+            error_exit ("Invalid ``matrix'' option, try bt601 or bt709");
+        }
+        free (param);
+
+        parse_args (args, 0, "simd", &param);
+        c->simd = cv_simd_select (param);
+        free (param);
+        if (NULL == c->simd) {
+            error_exit ("Unsupported ``simd'' option");
+        }
+
+        ctx->data = c;
+    }
+
+    if (NULL == (c = (cv_context*) ctx->data)) {
+        error_exit ("Invalid context");
+    }
+
+    c->references++;
+    ret_val = 0;
+
+exit:
+    /* a context that failed to set up was never handed to ctx */
+    if (0 != ret_val && NULL != c && c != ctx->data) {
+        buf_pool_free (c->pool);
+        free (c->threads);
+        free (c);
+    }
+    pthread_mutex_unlock (&ctx->mutex);
+    return ret_val;
+}
+
+/* scratch for one row of planar yuv and one row of 4 byte pixels */
+static uint8_t* cv_scratch (cv_thread* t, int64_t width)
+{
+    size_t size = 6 * ((width + 63) & ~63);
+
+    if (t->size < size) {
+        free (t->buf);
+        t->size = 0;
+        if (NULL == (t->buf = malloc (size))) {
+            return NULL;
+        }
+        t->size = size;
+    }
+    return t->buf;
+}
+
+/* converts one row at a time so that the unpacked planes and the 4 byte
+ * pixels stay in the first level cache between the steps */
+static void cv_yuv_to_rgb (cv_context* c, uint8_t* scratch,
+                           const image_t* sim, uint8_t* dst)
+{
+    const cv_simd* s = c->simd;
+    const cv_layout* l = cv_rgb_layout (c->fmt);
+    int width = sim->width;
+    int height = sim->height;
+    int cw = (width + 1) / 2;
+    int ch = (height + 1) / 2;
+    int pad = (width + 63) & ~63;
+    uint8_t* ty = scratch;
+    uint8_t* tu = scratch + pad;
+    uint8_t* tv = scratch + pad + pad / 2;
+    uint8_t* px = scratch + 2 * pad;
+    int swap = 0 == l->r;
+    int row;
+
+    for (row = 0; row < height; row++) {
+        const uint8_t* y = ty;
+        const uint8_t* u = tu;
+        const uint8_t* v = tv;
+        uint8_t* out = dst + (size_t) row * width * l->size;
+
+        switch (sim->fmt) {
+            case FMT_YUV420P:
+                y = sim->pix + (size_t) row * width;
+                u = sim->pix + (size_t) width * height +
+                    (size_t) (row / 2) * cw;
+                v = u + (size_t) cw * ch;
+                break;
+            case FMT_NV12:
+                y = sim->pix + (size_t) row * width;
+                if (0 == row % 2) {
+                    s->split (sim->pix + (size_t) width * height +
+                              (size_t) (row / 2) * 2 * cw, tu, tv, cw);
+                }
+                break;
+            default:
+                s->unpack (sim->pix + (size_t) row * width * 2, ty, tu, tv,
+                           width, FMT_YUYV == sim->fmt);
+                break;
+        }
+
+        if (4 == l->size) {
+            s->row (y, u, v, out, width, c->matrix, swap);
+        } else {
+            s->row (y, u, v, px, width, c->matrix, swap);
+            s->pack (px, out, width);
+        }
+    }
+}
+
+static inline uint8_t cv_luma (const cv_matrix* m, const uint8_t* p,
+                               const cv_layout* l)
+{
+    return ((m->yr * p[l->r] + m->yg * p[l->g] + m->yb * p[l->b] + 128)
+            >> 8) + 16;
+}
+
+/* chroma of the sums of n pixels */
+static inline void cv_chroma (const cv_matrix* m, int r, int g, int b, int n,
+                              uint8_t* u, uint8_t* v)
+{
+    *u = cv_clamp ((((m->ur * r + m->ug * g + m->ub * b) / n + 128) >> 8)
+                   + 128);
+    *v = cv_clamp ((((m->vr * r + m->vg * g + m->vb * b) / n + 128) >> 8)
+                   + 128);
+}
+
+/* rgb -> yuv has no vector path, it only feeds encoders that want yuv */
+static void cv_rgb_to_yuv (cv_context* c, const image_t* sim, uint8_t* dst)
+{
+    const cv_matrix* m = c->matrix;
+    const cv_layout* l = cv_rgb_layout (sim->fmt);
+    int width = sim->width;
+    int height = sim->height;
+    int cw = (width + 1) / 2;
+    int ch = (height + 1) / 2;
+    int row, x;
+
+    for (row = 0; row < height; row++) {
+        const uint8_t* p = sim->pix + (size_t) row * width * l->size;
+
+        if (FMT_YUYV == c->fmt || FMT_UYVY == c->fmt) {
+            uint8_t* out = dst + (size_t) row * width * 2;
+            int yo = FMT_YUYV == c->fmt ? 0 : 1;
+            int co = 1 - yo;
+
+            for (x = 0; x < width / 2; x++) {
+                const uint8_t* a = p + 2 * x * l->size;
+                const uint8_t* b = a + l->size;
+
+                out[4 * x + yo] = cv_luma (m, a, l);
+                out[4 * x + yo + 2] = cv_luma (m, b, l);
+                cv_chroma (m, a[l->r] + b[l->r], a[l->g] + b[l->g],
+                           a[l->b] + b[l->b], 2,
+                           &out[4 * x + co], &out[4 * x + co + 2]);
+            }
+            continue;
+        }
+
+        for (x = 0; x < width; x++) {
+            dst[(size_t) row * width + x] = cv_luma (m, p + x * l->size, l);
+        }
+
+        /* each chroma sample averages the pixels of a 2x2 block, clipped at
+         * the right and bottom edges */
+        if (0 == row % 2) {
+            const uint8_t* q = row + 1 < height ? p + (size_t) width * l->size
+                                                : p;
+            uint8_t* u = dst + (size_t) width * height;
+            uint8_t* v = u + (size_t) cw * ch;
+            int step = 1;
+
+            if (FMT_NV12 == c->fmt) {
+                v = u + 1;
+                step = 2;
+            }
+            u += (size_t) (row / 2) * cw * step;
+            v += (size_t) (row / 2) * cw * step;
+
+            for (x = 0; x < cw; x++) {
+                int x0 = 2 * x * l->size;
+                int x1 = 2 * x + 1 < width ? x0 + l->size : x0;
+
+                cv_chroma (m, p[x0 + l->r] + p[x1 + l->r] +
+                              q[x0 + l->r] + q[x1 + l->r],
+                           p[x0 + l->g] + p[x1 + l->g] +
+                              q[x0 + l->g] + q[x1 + l->g],
+                           p[x0 + l->b] + p[x1 + l->b] +
+                              q[x0 + l->b] + q[x1 + l->b],
+                           4, &u[x * step], &v[x * step]);
+            }
+        }
+    }
+}
+
+int cv_convert_exec (plugin_context* ctx,
+                     int             thread_id,
+                     image_t**       src_data,
+                     image_t**       dst_data)
+{
+    cv_context* c;
+    image_t* sim;
+    image_t* dim = NULL;
+    uint8_t* scratch;
+    size_t size;
+    int ret_val = -1;
+
+    if (NULL == (c = (cv_context*) ctx->data) ||
+        NULL == (sim = *src_data) ||
+        NULL != *dst_data)
+    {
+        error_exit ("Invalid context");
+    }
+
+    /* nothing to do, hand the frame on as it is */
+    if (sim->fmt == c->fmt) {
+        *dst_data = sim;
+        *src_data = NULL;
+        ret_val = 0;
+        goto exit;
+    }
+
+    if (!(cv_is_yuv (sim->fmt) && cv_rgb_layout (c->fmt)) &&
+        !(cv_rgb_layout (sim->fmt) && cv_is_yuv (c->fmt)))
+    {
+        error_exit ("Unsupported conversion from format %d to %d",
+                    sim->fmt, c->fmt);
+    }
+    if (sim->width <= 0 || sim->height <= 0 ||
+        sim->size < (int64_t) cv_frame_size (sim->fmt, sim->width,
+                                             sim->height))
+    {
+        error_exit ("Frame %ld is smaller than its geometry", sim->frame);
+    }
+    if ((FMT_YUYV == sim->fmt || FMT_UYVY == sim->fmt ||
+         FMT_YUYV == c->fmt || FMT_UYVY == c->fmt) && sim->width % 2)
+    {
+        error_exit ("Packed 4:2:2 needs an even width");
+    }
+
+    size = cv_frame_size (c->fmt, sim->width, sim->height);
+    if (NULL == (dim = calloc (1, sizeof *dim)) ||
+        buf_pool_attach (c->pool, dim, size))
+    {
+        free (dim);
+        dim = NULL;
+        error_exit ("Out of memory");
+    }
+
+    if (cv_is_yuv (sim->fmt)) {
+        if (NULL == (scratch = cv_scratch (&c->threads[thread_id],
+                                           sim->width)))
+        {
+            error_exit ("Out of memory");
+        }
+        cv_yuv_to_rgb (c, scratch, sim, dim->pix);
+    } else {
+        cv_rgb_to_yuv (c, sim, dim->pix);
+    }
+
+    dim->width = sim->width;
+    dim->height = sim->height;
+    dim->bpp = image_fmt_bpp (c->fmt);
+    dim->size = size;
+    dim->fmt = c->fmt;
+    dim->frame = sim->frame;
+
+    *dst_data = dim;
+    dim = NULL;
+    ret_val = 0;
+
+exit:
+    if (NULL != dim) {
+        image_close (dim);
+    }
+    return ret_val;
+}
+
+int cv_convert_prepare (plugin_context* ctx,
+                        image_t*        info)
+{
+    cv_context* c;
+
+    if (NULL == (c = (cv_context*) ctx->data)) {
+        return -1;
+    }
+
+    if (info->fmt != c->fmt &&
+        !(cv_is_yuv (info->fmt) && cv_rgb_layout (c->fmt)) &&
+        !(cv_rgb_layout (info->fmt) && cv_is_yuv (c->fmt)))
+    {
+        return -1;
+    }
+
+    info->fmt = c->fmt;
+    info->bpp = image_fmt_bpp (c->fmt);
+    info->size = cv_frame_size (c->fmt, info->width, info->height);
+    return 0;
+}
+
+int cv_convert_exit (plugin_context* ctx,
+                     int             thread_id)
+{
+    cv_context* c;
+    int ret_val = -1;
+
+    pthread_mutex_lock (&ctx->mutex);
+
+    if (NULL == (c = (cv_context*) ctx->data)) {
+        error_exit ("Invalid context");
+    }
+
+    free (c->threads[thread_id].buf);
+    c->threads[thread_id].buf = NULL;
+    c->threads[thread_id].size = 0;
+
+    if (--c->references) {
+        ret_val = 0;
+        goto exit;
+    }
+
+    buf_pool_free (c->pool);
+    free (c->threads);
+    free (c);
+
+    ctx->data = NULL;
+    ret_val = 0;
+
+exit:
+    pthread_mutex_unlock (&ctx->mutex);
+    return ret_val;
+}
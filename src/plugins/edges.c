@@ -20,30 +20,46 @@
  * THE SOFTWARE.
  *****************************************************************************/
 
+
+#include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <math.h>
 #include <stdlib.h>
 
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EDGES_X86 1
+#include <immintrin.h>
+#endif
+
 #include "image.h"
 #include "plugin.h"
+#include "workpool.h"
 
 /* start plugin interface */
 int edges_query (plugin_stage   stage,
                  plugin_info**  pi);
+int edges_proc_init (plugin_context*    ctx,
+                     int                thread_id,
+                     char*              args);
 int edges_proc_exec (plugin_context*    ctx,
                      int                thread_id,
                      image_t**          src_data,
                      image_t**          dst_data);
+int edges_proc_exit (plugin_context*    ctx,
+                     int                thread_id);
 
 static const char edges_name[] = "edges_process";
-static const data_fmt edges_fmts[] = {FMT_RGB24};
+static const data_fmt edges_fmts[] = {FMT_RGB24, FMT_GREY8, -1};
 static plugin_info pi_edges_proc = {.stage=PLUGIN_STAGE_PROCESS,
                                     .type=PLUGIN_TYPE_ASYNC,
                                     .src_fmt=edges_fmts,
                                     .dst_fmt=edges_fmts,
                                     .name=edges_name,
-                                    .init=NULL,
-                                    .exit=NULL,
+                                    .init=edges_proc_init,
+                                    .exit=edges_proc_exit,
                                     .exec=edges_proc_exec};
 
 /* returns the plugin_info struct to the system when queried for process
@@ -63,77 +79,905 @@ int edges_query (plugin_stage   stage,
 }
 /* end plugin interface */
 
-static int clip_uint8( int v )
+/* The gradient at byte k of row b, with a above and c below it, and step
+ * bytes between horizontally adjacent samples of a channel:
+ *
+ *   dx = a[k+step] + b[k+step] - a[k-step] - b[k-step]
+ *   dy = a[k-step] + a[k] - c[k-step] - c[k]
+ *
+ * Both fit in 16 bits and dx*dx + dy*dy in 32, so the kernels stay in
+ * integers up to the square root. That is taken in single precision, which
+ * is exact for these sums, and truncated like the clip of the double result
+ * always was. The l1 mode outputs |dx| + |dy| instead. */
+typedef void (*edges_row_fn) (const uint8_t* a, const uint8_t* b,
+                              const uint8_t* c, uint8_t* dst, int n,
+                              int step);
+
+typedef struct edges_simd {
+    const char*     name;
+    edges_row_fn    l2;
+    edges_row_fn    l1;
+} edges_simd;
+
+static void edges_l2_scalar (const uint8_t* a, const uint8_t* b,
+                             const uint8_t* c, uint8_t* dst, int n, int step)
+{
+    int k;
+
+    for (k = 0; k < n; k++) {
+        int dx = a[k + step] + b[k + step] - a[k - step] - b[k - step];
+        int dy = a[k - step] + a[k] - c[k - step] - c[k];
+        int m = (int) sqrtf ((float) (dx * dx + dy * dy));
+
+        dst[k] = 255 < m ? 255 : m;
+    }
+}
+
+static void edges_l1_scalar (const uint8_t* a, const uint8_t* b,
+                             const uint8_t* c, uint8_t* dst, int n, int step)
+{
+    int k;
+
+    for (k = 0; k < n; k++) {
+        int dx = a[k + step] + b[k + step] - a[k - step] - b[k - step];
+        int dy = a[k - step] + a[k] - c[k - step] - c[k];
+        int m = abs (dx) + abs (dy);
+
+        dst[k] = 255 < m ? 255 : m;
+    }
+}
+
+static const edges_simd edges_simd_scalar = {"scalar", edges_l2_scalar,
+                                             edges_l1_scalar};
+
+#ifdef EDGES_X86
+/* dx and dy of the 8 bytes in the low (hi = 0) or high half of 16 */
+#define EDGES_GRADIENT_SSE2(unpack)                                           \
+    {                                                                         \
+        __m128i al = unpack (_mm_loadu_si128 ((const __m128i*)                \
+                                              (a + k - step)), z);            \
+        __m128i ac = unpack (_mm_loadu_si128 ((const __m128i*) (a + k)), z);  \
+        __m128i ar = unpack (_mm_loadu_si128 ((const __m128i*)                \
+                                              (a + k + step)), z);            \
+        __m128i bl = unpack (_mm_loadu_si128 ((const __m128i*)                \
+                                              (b + k - step)), z);            \
+        __m128i br = unpack (_mm_loadu_si128 ((const __m128i*)                \
+                                              (b + k + step)), z);            \
+        __m128i cl = unpack (_mm_loadu_si128 ((const __m128i*)                \
+                                              (c + k - step)), z);            \
+        __m128i cc = unpack (_mm_loadu_si128 ((const __m128i*) (c + k)), z);  \
+        dx = _mm_sub_epi16 (_mm_add_epi16 (ar, br), _mm_add_epi16 (al, bl));  \
+        dy = _mm_sub_epi16 (_mm_add_epi16 (al, ac), _mm_add_epi16 (cl, cc));  \
+    }
+
+/* square root of the 4 sums of squares in pairs of dx, dy */
+__attribute__ ((target ("sse2")))
+static inline __m128i edges_hypot_sse2 (__m128i p)
+{
+    __m128 s = _mm_cvtepi32_ps (_mm_madd_epi16 (p, p));
+    return _mm_cvttps_epi32 (_mm_sqrt_ps (s));
+}
+
+__attribute__ ((target ("sse2")))
+static void edges_l2_sse2 (const uint8_t* a, const uint8_t* b,
+                           const uint8_t* c, uint8_t* dst, int n, int step)
+{
+    const __m128i z = _mm_setzero_si128 ();
+    __m128i dx, dy, lo, hi;
+    int k;
+
+    for (k = 0; k + 16 <= n; k += 16) {
+        EDGES_GRADIENT_SSE2 (_mm_unpacklo_epi8);
+        lo = _mm_packs_epi32 (edges_hypot_sse2 (_mm_unpacklo_epi16 (dx, dy)),
+                              edges_hypot_sse2 (_mm_unpackhi_epi16 (dx, dy)));
+        EDGES_GRADIENT_SSE2 (_mm_unpackhi_epi8);
+        hi = _mm_packs_epi32 (edges_hypot_sse2 (_mm_unpacklo_epi16 (dx, dy)),
+                              edges_hypot_sse2 (_mm_unpackhi_epi16 (dx, dy)));
+        _mm_storeu_si128 ((__m128i*) (dst + k), _mm_packus_epi16 (lo, hi));
+    }
+    edges_l2_scalar (a + k, b + k, c + k, dst + k, n - k, step);
+}
+
+__attribute__ ((target ("sse2")))
+static inline __m128i edges_abs_sse2 (__m128i x)
+{
+    return _mm_max_epi16 (x, _mm_sub_epi16 (_mm_setzero_si128 (), x));
+}
+
+__attribute__ ((target ("sse2")))
+static void edges_l1_sse2 (const uint8_t* a, const uint8_t* b,
+                           const uint8_t* c, uint8_t* dst, int n, int step)
+{
+    const __m128i z = _mm_setzero_si128 ();
+    __m128i dx, dy, lo, hi;
+    int k;
+
+    for (k = 0; k + 16 <= n; k += 16) {
+        EDGES_GRADIENT_SSE2 (_mm_unpacklo_epi8);
+        lo = _mm_add_epi16 (edges_abs_sse2 (dx), edges_abs_sse2 (dy));
+        EDGES_GRADIENT_SSE2 (_mm_unpackhi_epi8);
+        hi = _mm_add_epi16 (edges_abs_sse2 (dx), edges_abs_sse2 (dy));
+        _mm_storeu_si128 ((__m128i*) (dst + k), _mm_packus_epi16 (lo, hi));
+    }
+    edges_l1_scalar (a + k, b + k, c + k, dst + k, n - k, step);
+}
+
+static const edges_simd edges_simd_sse2 = {"sse2", edges_l2_sse2,
+                                           edges_l1_sse2};
+
+/* the unpacks and packs all work within 128 bit lanes, so pixels come out
+ * in the order they went in without any permutes */
+#define EDGES_GRADIENT_AVX2(unpack)                                           \
+    {                                                                         \
+        __m256i al = unpack (_mm256_loadu_si256 ((const __m256i*)             \
+                                                 (a + k - step)), z);         \
+        __m256i ac = unpack (_mm256_loadu_si256 ((const __m256i*)             \
+                                                 (a + k)), z);                \
+        __m256i ar = unpack (_mm256_loadu_si256 ((const __m256i*)             \
+                                                 (a + k + step)), z);         \
+        __m256i bl = unpack (_mm256_loadu_si256 ((const __m256i*)             \
+                                                 (b + k - step)), z);         \
+        __m256i br = unpack (_mm256_loadu_si256 ((const __m256i*)             \
+                                                 (b + k + step)), z);         \
+        __m256i cl = unpack (_mm256_loadu_si256 ((const __m256i*)             \
+                                                 (c + k - step)), z);         \
+        __m256i cc = unpack (_mm256_loadu_si256 ((const __m256i*)             \
+                                                 (c + k)), z);                \
+        dx = _mm256_sub_epi16 (_mm256_add_epi16 (ar, br),                     \
+                               _mm256_add_epi16 (al, bl));                    \
+        dy = _mm256_sub_epi16 (_mm256_add_epi16 (al, ac),                     \
+                               _mm256_add_epi16 (cl, cc));                    \
+    }
+
+__attribute__ ((target ("avx2")))
+static inline __m256i edges_hypot_avx2 (__m256i p)
+{
+    __m256 s = _mm256_cvtepi32_ps (_mm256_madd_epi16 (p, p));
+    return _mm256_cvttps_epi32 (_mm256_sqrt_ps (s));
+}
+
+__attribute__ ((target ("avx2")))
+static void edges_l2_avx2 (const uint8_t* a, const uint8_t* b,
+                           const uint8_t* c, uint8_t* dst, int n, int step)
+{
+    const __m256i z = _mm256_setzero_si256 ();
+    __m256i dx, dy, lo, hi;
+    int k;
+
+    for (k = 0; k + 32 <= n; k += 32) {
+        EDGES_GRADIENT_AVX2 (_mm256_unpacklo_epi8);
+        lo = _mm256_packs_epi32 (
+                edges_hypot_avx2 (_mm256_unpacklo_epi16 (dx, dy)),
+                edges_hypot_avx2 (_mm256_unpackhi_epi16 (dx, dy)));
+        EDGES_GRADIENT_AVX2 (_mm256_unpackhi_epi8);
+        hi = _mm256_packs_epi32 (
+                edges_hypot_avx2 (_mm256_unpacklo_epi16 (dx, dy)),
+                edges_hypot_avx2 (_mm256_unpackhi_epi16 (dx, dy)));
+        _mm256_storeu_si256 ((__m256i*) (dst + k),
+                             _mm256_packus_epi16 (lo, hi));
+    }
+    edges_l2_sse2 (a + k, b + k, c + k, dst + k, n - k, step);
+}
+
+__attribute__ ((target ("avx2")))
+static void edges_l1_avx2 (const uint8_t* a, const uint8_t* b,
+                           const uint8_t* c, uint8_t* dst, int n, int step)
+{
+    const __m256i z = _mm256_setzero_si256 ();
+    __m256i dx, dy, lo, hi;
+    int k;
+
+    for (k = 0; k + 32 <= n; k += 32) {
+        EDGES_GRADIENT_AVX2 (_mm256_unpacklo_epi8);
+        lo = _mm256_add_epi16 (_mm256_abs_epi16 (dx), _mm256_abs_epi16 (dy));
+        EDGES_GRADIENT_AVX2 (_mm256_unpackhi_epi8);
+        hi = _mm256_add_epi16 (_mm256_abs_epi16 (dx), _mm256_abs_epi16 (dy));
+        _mm256_storeu_si256 ((__m256i*) (dst + k),
+                             _mm256_packus_epi16 (lo, hi));
+    }
+    edges_l1_sse2 (a + k, b + k, c + k, dst + k, n - k, step);
+}
+
+static const edges_simd edges_simd_avx2 = {"avx2", edges_l2_avx2,
+                                           edges_l1_avx2};
+#endif
+
+/* picks the widest kernels this cpu runs, or the ones named by the simd
+ * option so that the paths can be checked against each other */
+static const edges_simd* edges_simd_select (const char* name)
+{
+#ifdef EDGES_X86
+    __builtin_cpu_init ();
+    if (NULL != name && 0 == strcasecmp (name, "scalar")) {
+        return &edges_simd_scalar;
+    } else if (NULL != name && 0 == strcasecmp (name, "sse2")) {
+        return __builtin_cpu_supports ("sse2") ? &edges_simd_sse2 : NULL;
+    } else if (NULL != name && 0 == strcasecmp (name, "avx2")) {
+        return __builtin_cpu_supports ("avx2") ? &edges_simd_avx2 : NULL;
+    } else if (NULL != name) {
+        return NULL;
+    }
+
+    if (__builtin_cpu_supports ("avx2")) {
+        return &edges_simd_avx2;
+    } else if (__builtin_cpu_supports ("sse2")) {
+        return &edges_simd_sse2;
+    }
+    return &edges_simd_scalar;
+#else
+    if (NULL != name && strcasecmp (name, "scalar")) {
+        return NULL;
+    }
+    return &edges_simd_scalar;
+#endif
+}
+
+/* frames are cut into bands of rows about this many bytes in size, so that
+ * the three source rows and the output row of a band stay in cache */
+#define EDGES_BAND_BYTES (256 << 10)
+
+/* widest gaussian the canny mode blurs with, in pixels either side */
+#define EDGES_MAX_RADIUS 16
+
+/* bytes of canny scratch per pixel of a band, for sizing the bands */
+#define EDGES_CANNY_BYTES 10
+
+/* a growable buffer */
+typedef struct edges_buf {
+    uint8_t*            buf;
+    size_t              size;
+} edges_buf;
+
+/* per pipeline thread buffers. the luma plane of an rgb frame being reduced
+ * to a single gradient plane, and for canny the frame's edge labels, the
+ * stack of the hysteresis pass and the scratch of each band task */
+typedef struct edges_thread {
+    uint8_t*            buf;
+    size_t              size;
+    edges_buf           map;
+    edges_buf           stack;
+    edges_buf*          scratch;
+    int                 nscratch;
+} edges_thread;
+
+typedef struct edges_context {
+    const edges_simd*   simd;
+    edges_row_fn        row;
+    data_fmt            fmt;
+    workpool*           pool;
+    int64_t             band_bytes;
+    edges_thread*       threads;
+    int                 references;
+
+    /* mode:canny */
+    int                 canny;
+    int                 radius;
+    int                 gauss[2 * EDGES_MAX_RADIUS + 1];
+    int                 low;
+    int                 high;
+} edges_context;
+
+/* one frame being filtered in bands of rows. a band writes only its own
+ * rows but reads one halo row above and below them from the source */
+typedef struct edges_job {
+    edges_row_fn        row;
+    const uint8_t*      src;
+    uint8_t*            dst;
+    int                 pitch;
+    int                 step;
+    int                 height;
+    int                 band_rows;
+
+    /* rgb input for the luma pass */
+    const uint8_t*      rgb;
+    int                 width;
+} edges_job;
+
+/* bt601 luma of the rows of a band, full range */
+static void edges_luma_task (void* arg, int band)
 {
-    return ( (v < 0) ? 0 : (v > 255) ? 255 : v );
+    edges_job* e = arg;
+    int j0 = band * e->band_rows;
+    int j1 = j0 + e->band_rows < e->height ? j0 + e->band_rows : e->height;
+    int i, j;
+
+    for (j = j0; j < j1; j++) {
+        const uint8_t* p = e->rgb + (size_t) 3 * e->width * j;
+        uint8_t* y = (uint8_t*) e->src + (size_t) e->width * j;
+
+        for (i = 0; i < e->width; i++, p += 3) {
+            y[i] = (77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8;
+        }
+    }
 }
 
-#define o(x,y,p) (pitch*(y)+(x)*3+p)
+static void edges_band_task (void* arg, int band)
+{
+    edges_job* e = arg;
+    int j0 = 1 + band * e->band_rows;
+    int j1 = j0 + e->band_rows < e->height - 1 ? j0 + e->band_rows
+                                               : e->height - 1;
+    int j;
+
+    for (j = j0; j < j1; j++) {
+        const uint8_t* row = e->src + (size_t) e->pitch * j + e->step;
+
+        e->row (row - e->pitch, row, row + e->pitch,
+                e->dst + (size_t) e->pitch * j + e->step,
+                e->pitch - 2 * e->step, e->step);
+    }
+}
+
+static void* edges_reserve (edges_buf* b, size_t size)
+{
+    if (b->size < size) {
+        free (b->buf);
+        b->size = 0;
+        if (NULL == (b->buf = malloc (size))) {
+            return NULL;
+        }
+        b->size = size;
+    }
+    return b->buf;
+}
+
+/* The canny mode works on luma, or on the grey input, in bands of rows. A
+ * band task blurs, differentiates and thins its rows in one go, keeping the
+ * intermediate rows, halos included, in scratch that is reused for every
+ * band it takes:
+ *
+ *   H  horizontal gaussian of the source rows, 8.8 fixed point
+ *   B  vertical gaussian of H, 8 bit
+ *   M  sobel magnitude of B, D its direction quantised to 4 sectors
+ *
+ * and writes the rows it owns to the frame's label map as 0, 1 for weak
+ * edges over the low threshold or 2 for strong ones over the high. Joining
+ * weak edges to strong ones is not local to a band, so hysteresis follows
+ * as one pass over the map. */
+typedef struct edges_canny_job {
+    edges_context*      c;
+    edges_buf*          scratch;
+    const uint8_t*      src;
+    int                 channels;
+    uint8_t*            map;
+    int                 width;
+    int                 height;
+    int                 band_rows;
+    int                 bands;
+    int                 tasks;
+} edges_canny_job;
+
+enum {EDGES_DIR_H, EDGES_DIR_V, EDGES_DIR_DOWN, EDGES_DIR_UP};
+
+static void edges_canny_band (edges_canny_job* e, uint8_t* scratch, int band)
+{
+    const edges_context* c = e->c;
+    const int* g = c->gauss + EDGES_MAX_RADIUS;
+    int r = c->radius;
+    int w = e->width;
+    int h = e->height;
+    int j0 = band * e->band_rows;
+    int j1 = j0 + e->band_rows < h ? j0 + e->band_rows : h;
+    int mlo = 0 < j0 ? j0 - 1 : 0;
+    int mhi = j1 < h ? j1 + 1 : h;
+    int blo = 0 < mlo ? mlo - 1 : 0;
+    int bhi = mhi < h ? mhi + 1 : h;
+    int hlo = 0 < blo - r ? blo - r : 0;
+    int hhi = bhi + r < h ? bhi + r : h;
+    int32_t* acc = (int32_t*) scratch;
+    uint16_t* hr = (uint16_t*) (acc + w);
+    uint16_t* mr = hr + (size_t) (hhi - hlo) * w;
+    uint8_t* br = (uint8_t*) (mr + (size_t) (mhi - mlo) * w);
+    uint8_t* dr = br + (size_t) (bhi - blo) * w;
+    uint8_t* luma = dr + (size_t) (mhi - mlo) * w;
+    int i, j, k;
+
+    for (j = hlo; j < hhi; j++) {
+        const uint8_t* p = e->src + (size_t) e->channels * w * j;
+        uint16_t* out = hr + (size_t) (j - hlo) * w;
+
+        if (3 == e->channels) {
+            for (i = 0; i < w; i++, p += 3) {
+                luma[i] = (77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8;
+            }
+            p = luma;
+        }
+
+        /* the frame's edges are extended for the taps that fall outside */
+        for (i = 0; i < w; i++) {
+            int32_t sum = 0;
+
+            if (r <= i && i + r < w) {
+                for (k = -r; k <= r; k++) {
+                    sum += g[k] * p[i + k];
+                }
+            } else {
+                for (k = -r; k <= r; k++) {
+                    int x = i + k < 0 ? 0 : w <= i + k ? w - 1 : i + k;
+                    sum += g[k] * p[x];
+                }
+            }
+            out[i] = (sum + 32) >> 6;
+        }
+    }
+
+    for (j = blo; j < bhi; j++) {
+        uint8_t* out = br + (size_t) (j - blo) * w;
+
+        memset (acc, 0, (size_t) 4 * w);
+        for (k = -r; k <= r; k++) {
+            int y = j + k < 0 ? 0 : h <= j + k ? h - 1 : j + k;
+            const uint16_t* in = hr + (size_t) (y - hlo) * w;
+
+            for (i = 0; i < w; i++) {
+                acc[i] += g[k] * in[i];
+            }
+        }
+        for (i = 0; i < w; i++) {
+            out[i] = (acc[i] + (1 << 21)) >> 22;
+        }
+    }
+
+    /* the outermost pixels get no magnitude and so never become edges */
+    for (j = mlo; j < mhi; j++) {
+        uint16_t* m = mr + (size_t) (j - mlo) * w;
+        uint8_t* d = dr + (size_t) (j - mlo) * w;
+        const uint8_t* b0 = br + (size_t) (j - 1 - blo) * w;
+        const uint8_t* b1 = b0 + w;
+        const uint8_t* b2 = b1 + w;
+
+        memset (m, 0, (size_t) 2 * w);
+        if (0 == j || h - 1 == j) {
+            continue;
+        }
+        for (i = 1; i < w - 1; i++) {
+            int gx = b0[i + 1] + 2 * b1[i + 1] + b2[i + 1]
+                   - b0[i - 1] - 2 * b1[i - 1] - b2[i - 1];
+            int gy = b2[i - 1] + 2 * b2[i] + b2[i + 1]
+                   - b0[i - 1] - 2 * b0[i] - b0[i + 1];
+            int ax = abs (gx);
+            int ay = abs (gy);
+
+            m[i] = (int) sqrtf ((float) (gx * gx + gy * gy));
+
+            /* tan (22.5) = 0.4142 ~ 13573 / 2^15 */
+            if (ay << 15 <= ax * 13573) {
+                d[i] = EDGES_DIR_H;
+            } else if (ax << 15 <= ay * 13573) {
+                d[i] = EDGES_DIR_V;
+            } else {
+                d[i] = (0 < gx) == (0 < gy) ? EDGES_DIR_DOWN : EDGES_DIR_UP;
+            }
+        }
+    }
+
+    /* keep only the peaks across the gradient, ties go to the later pixel */
+    for (j = j0; j < j1; j++) {
+        const uint16_t* m = mr + (size_t) (j - mlo) * w;
+        const uint8_t* d = dr + (size_t) (j - mlo) * w;
+        uint8_t* out = e->map + (size_t) w * j;
+
+        for (i = 0; i < w; i++) {
+            int a, b;
+
+            out[i] = 0;
+            if (m[i] <= c->low) {
+                continue;
+            }
+            switch (d[i]) {
+                case EDGES_DIR_H:
+                    a = m[i - 1];       b = m[i + 1];           break;
+                case EDGES_DIR_V:
+                    a = m[i - w];       b = m[i + w];           break;
+                case EDGES_DIR_DOWN:
+                    a = m[i - w - 1];   b = m[i + w + 1];       break;
+                default:
+                    a = m[i - w + 1];   b = m[i + w - 1];       break;
+            }
+            if (m[i] > a && m[i] >= b) {
+                out[i] = m[i] > c->high ? 2 : 1;
+            }
+        }
+    }
+}
+
+static void edges_canny_task (void* arg, int task)
+{
+    edges_canny_job* e = arg;
+    int band;
+
+    for (band = task; band < e->bands; band += e->tasks) {
+        edges_canny_band (e, e->scratch[task].buf, band);
+    }
+}
+
+/* grow every strong edge into the weak pixels it touches, marking the
+ * pixels it reaches 3. labels of the outermost pixels are always 0, so the
+ * neighbours of an edge are in the frame */
+static int edges_hysteresis (edges_buf* stack, uint8_t* map, int w, int h)
+{
+    size_t n = (size_t) w * h;
+    size_t top = 0;
+    size_t i;
+    int32_t* s;
+
+    if (NULL == (s = edges_reserve (stack, 4096))) {
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (2 != map[i]) {
+            continue;
+        }
+        map[i] = 3;
+        s[top++] = i;
+
+        while (top) {
+            int32_t p = s[--top];
+            const int32_t nb[8] = {p - w - 1, p - w, p - w + 1, p - 1,
+                                   p + 1, p + w - 1, p + w, p + w + 1};
+            int k;
+
+            for (k = 0; k < 8; k++) {
+                if (1 != map[nb[k]]) {
+                    continue;
+                }
+                map[nb[k]] = 3;
+
+                /* the stack only grows, keeping what it holds */
+                if (stack->size < 4 * (top + 1)) {
+                    edges_buf grown = {NULL, 0};
+
+                    if (NULL == edges_reserve (&grown, 2 * stack->size)) {
+                        return -1;
+                    }
+                    memcpy (grown.buf, s, 4 * top);
+                    free (stack->buf);
+                    *stack = grown;
+                    s = (int32_t*) stack->buf;
+                }
+                s[top++] = nb[k];
+            }
+        }
+    }
+    return 0;
+}
+
+static int edges_canny (edges_context* c, edges_thread* t, const image_t* im,
+                        image_t* dim)
+{
+    edges_canny_job e;
+    int w = im->width;
+    int h = im->height;
+    int channels = dim->bpp / 8;
+    size_t scratch;
+    size_t i;
+    int k;
+
+    e.c = c;
+    e.src = im->pix;
+    e.channels = FMT_RGB24 == im->fmt ? 3 : 1;
+    e.width = w;
+    e.height = h;
+    e.band_rows = c->band_bytes / ((int64_t) w * EDGES_CANNY_BYTES);
+    e.band_rows = e.band_rows < 1 ? 1 : e.band_rows;
+    e.bands = (h + e.band_rows - 1) / e.band_rows;
+    e.tasks = NULL == c->pool ? 1 : workpool_threads (c->pool);
+    e.tasks = e.bands < e.tasks ? e.bands : e.tasks;
+
+    if (NULL == (e.map = edges_reserve (&t->map, (size_t) w * h))) {
+        return -1;
+    }
+
+    /* each task walks every tasks'th band with its own scratch */
+    if (t->nscratch < e.tasks) {
+        edges_buf* b = realloc (t->scratch, e.tasks * sizeof *b);
+
+        if (NULL == b) {
+            return -1;
+        }
+        memset (b + t->nscratch, 0, (e.tasks - t->nscratch) * sizeof *b);
+        t->scratch = b;
+        t->nscratch = e.tasks;
+    }
+    scratch = (size_t) w * (4 + 1 + 2 * (e.band_rows + 4 + 2 * c->radius) +
+                            (e.band_rows + 4) + 3 * (e.band_rows + 2));
+    for (k = 0; k < e.tasks; k++) {
+        if (NULL == edges_reserve (&t->scratch[k], scratch)) {
+            return -1;
+        }
+    }
+    e.scratch = t->scratch;
+
+    if (1 == e.tasks) {
+        edges_canny_task (&e, 0);
+    } else {
+        workpool_run (c->pool, edges_canny_task, &e, e.tasks);
+    }
+
+    if (edges_hysteresis (&t->stack, e.map, w, h) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < (size_t) w * h; i++) {
+        memset (dim->pix + i * channels, 3 == e.map[i] ? 255 : 0, channels);
+    }
+    return 0;
+}
+
+int edges_proc_init (plugin_context*    ctx,
+                     int                thread_id,
+                     char*              args)
+{
+    edges_context* c;
+    char* param;
+    int ret_val = -1;
+    int i;
+
+    (void) thread_id;
+
+    pthread_mutex_lock (&ctx->mutex);
+
+    if (NULL == ctx->data) {
+        if (NULL == (c = calloc (1, sizeof *c)) ||
+            NULL == (c->threads = calloc (ctx->num_threads,
+                                          sizeof *c->threads)))
+        {
+            free (c);
+            error_exit ("Out of memory");
+        }
+
+        /* fmt:GREY8 reduces rgb frames to the gradient of their luma.
+         * grey frames always give a grey gradient */
+        parse_args (args, 0, "fmt", &param);
+        c->fmt = NULL == param ? FMT_RGB24 : image_fmt_from_str (param);
+        free (param);
+        if (FMT_RGB24 != c->fmt && FMT_GREY8 != c->fmt) {
+            free (c->threads);
+            free (c);
+            error_exit ("Invalid ``fmt'' option, try RGB24 or GREY8");
+        }
+
+        parse_args (args, 0, "simd", &param);
+        c->simd = edges_simd_select (param);
+        free (param);
+        if (NULL == c->simd) {
+            free (c->threads);
+            free (c);
+            error_exit ("Unsupported ``simd'' option");
+        }
+
+        /* mode:l1 trades the exact magnitude for |dx| + |dy|, mode:canny
+         * outputs thinned and connected edges in white */
+        parse_args (args, 0, "mode", &param);
+        if (NULL == param || 0 == strcasecmp (param, "l2")) {
+            c->row = c->simd->l2;
+        } else if (0 == strcasecmp (param, "l1")) {
+            c->row = c->simd->l1;
+        } else if (0 == strcasecmp (param, "canny")) {
+            c->row = c->simd->l2;
+            c->canny = 1;
+        } else {
+            free (param);
+            free (c->threads);
+            free (c);
+            error_exit ("Invalid ``mode'' option, try l2, l1 or canny");
+        }
+        free (param);
+
+        /* canny takes the gaussian's sigma and thresholds on the sobel
+         * magnitude, which reaches 1020 across a black to white edge */
+        if (c->canny) {
+            double sigma;
+            int sum = 0;
+
+            parse_args (args, 0, "sigma", &param);
+            sigma = NULL == param ? 1.4 : atof (param);
+            free (param);
+
+            parse_args (args, 0, "low", &param);
+            c->low = NULL == param ? 40 : atoi (param);
+            free (param);
+
+            parse_args (args, 0, "high", &param);
+            c->high = NULL == param ? 100 : atoi (param);
+            free (param);
+
+            if (sigma < 0 || EDGES_MAX_RADIUS < ceil (3 * sigma) ||
+                c->low < 0 || c->high < c->low)
+            {
+                free (c->threads);
+                free (c);
+                error_exit ("Invalid ``sigma'', ``low'' or ``high'' option");
+            }
+
+            /* weights sum to 2^14, the rounding error goes to the centre */
+            c->radius = ceil (3 * sigma);
+            for (i = -c->radius; i <= c->radius; i++) {
+                c->gauss[EDGES_MAX_RADIUS + i] = 0 == sigma ? 1 << 14 :
+                    (1 << 14) * exp (-i * i / (2 * sigma * sigma)) + 0.5;
+                sum += c->gauss[EDGES_MAX_RADIUS + i];
+            }
+            for (i = -c->radius; i <= c->radius; i++) {
+                c->gauss[EDGES_MAX_RADIUS + i] =
+                    (int64_t) c->gauss[EDGES_MAX_RADIUS + i] * (1 << 14) / sum;
+            }
+            for (i = -c->radius, sum = 0; i <= c->radius; i++) {
+                sum += c->gauss[EDGES_MAX_RADIUS + i];
+            }
+            c->gauss[EDGES_MAX_RADIUS] += (1 << 14) - sum;
+        }
+
+        /* band:<bytes> sizes the row bands a frame is cut into and
+         * threads:<n> the pool they run on, 0 for one thread per cpu and 1
+         * to filter each frame on its pipeline thread alone */
+        parse_args (args, 0, "band", &param);
+        c->band_bytes = NULL == param ? EDGES_BAND_BYTES
+                                      : strtoll (param, NULL, 10);
+        free (param);
+        if (c->band_bytes <= 0) {
+            free (c->threads);
+            free (c);
+            error_exit ("Invalid ``band'' option");
+        }
+
+        parse_args (args, 0, "threads", &param);
+        i = NULL == param ? 0 : atoi (param);
+        free (param);
+        if (1 != i && NULL == (c->pool = workpool_new (i))) {
+            free (c->threads);
+            free (c);
+            error_exit ("Unable to start band threads");
+        }
+
+        ctx->data = c;
+    }
+
+    if (NULL == (c = (edges_context*) ctx->data) || NULL == c->row) {
+        error_exit ("Invalid context");
+    }
+
+    c->references++;
+    ret_val = 0;
+
+exit:
+    pthread_mutex_unlock (&ctx->mutex);
+    return ret_val;
+}
+
+int edges_proc_exit (plugin_context*    ctx,
+                     int                thread_id)
+{
+    edges_context* c;
+
+    pthread_mutex_lock (&ctx->mutex);
+
+    if (NULL != (c = (edges_context*) ctx->data)) {
+        edges_thread* t = &c->threads[thread_id];
+        int i;
+
+        for (i = 0; i < t->nscratch; i++) {
+            free (t->scratch[i].buf);
+        }
+        free (t->scratch);
+        free (t->stack.buf);
+        free (t->map.buf);
+        free (t->buf);
+        memset (t, 0, sizeof *t);
+    }
+
+    if (NULL != c && !--c->references) {
+        workpool_free (c->pool);
+        free (c->threads);
+        free (c);
+        ctx->data = NULL;
+    }
+
+    pthread_mutex_unlock (&ctx->mutex);
+    return 0;
+}
+
+/* run the bands of a frame, on the pool when there is more than one */
+static void edges_run (edges_context* c, workpool_fn fn, edges_job* e,
+                       int bands)
+{
+    int i;
+
+    if (NULL == c->pool || 1 == bands) {
+        for (i = 0; i < bands; i++) {
+            fn (e, i);
+        }
+    } else {
+        workpool_run (c->pool, fn, e, bands);
+    }
+}
 
 int edges_proc_exec (plugin_context*    ctx,
                      int                thread_id,
                      image_t**          src_data,
                      image_t**          dst_data)
 {
+    edges_context* c;
+    edges_thread* t;
     image_t* im;
     image_t* dim;
 /*    const double op = 255/sqrt(pow(255*3,2)*2); //  = max / (lmax - lmin) */
-    int i, j;
-    int pitch;
-
-    (void) ctx;
-    (void) thread_id;
+    edges_job e;
+    int channels;
+    size_t size;
 
     /* make sure inputs are valid */
     if (
+        NULL == (c = (edges_context*) ctx->data) ||
         NULL == (im = *src_data) ||
         NULL != *dst_data ||
+        (FMT_RGB24 != im->fmt && FMT_GREY8 != im->fmt) ||
+        im->width <= 0 || im->height <= 0 ||
         NULL == (dim = calloc (1, sizeof(image_t))))
     {
         return -1;
     }
+    t = &c->threads[thread_id];
 
-    /* allocate output image */
-    dim->pix = calloc (im->height*im->width*im->bpp/8 * 3, sizeof(uint8_t));
+    /* allocate output image, one byte per channel of each pixel */
+    dim->fmt = FMT_GREY8 == im->fmt ? FMT_GREY8 : c->fmt;
+    dim->bpp = image_fmt_bpp (dim->fmt);
     dim->width = im->width;
     dim->height = im->height;
-    dim->bpp = im->bpp;
-    dim->fmt = FMT_RGB24;
+    dim->size = im->width*im->height*dim->bpp/8;
     dim->frame = im->frame;
 
-    pitch = im->width*im->bpp/8;
-
-    for( j = 0; j < im->height; j++ )
-    {
-        for( i = 1; i < im->width; i++ )
-        {
-            int ci, cj, pix;
-            double dx[3] = {0}; /* {r, g, b} */
-            double dy[3] = {0}; /* {r, g, b} */
-
-            if( i == 0 || j == 0 || i == im->width-1 || j == im->height-1 )
-                continue;
+    if (NULL == (dim->pix = calloc (dim->size, sizeof(uint8_t)))) {
+        free (dim);
+        return -1;
+    }
 
-            for( pix = 0; pix < 3; pix++ ) {
+    if (c->canny) {
+        if (edges_canny (c, t, im, dim) < 0) {
+            image_close (dim);
+            return -1;
+        }
+        *dst_data = dim;
+        return 0;
+    }
 
-                /* left and right */
-                for( cj = j-1; cj < j+1; cj++ ) {
-                    dx[pix] -= im->pix[o(i-1,cj,pix)]; /* left */
-                    dx[pix] += im->pix[o(i+1,cj,pix)]; /* right */
-                }
+    channels = dim->bpp/8;
 
-                /* top and bottom */
-                for( ci = i-1; ci < i+1; ci++ ) {
-                    dy[pix] += im->pix[o(ci,j-1,pix)]; /* top */
-                    dy[pix] -= im->pix[o(ci,j+1,pix)]; /* bottom */
-                }
+    e.row = c->row;
+    e.src = im->pix;
+    e.dst = dim->pix;
+    e.pitch = im->width*channels;
+    e.step = channels;
+    e.height = im->height;
+    e.band_rows = c->band_bytes / e.pitch < 1 ? 1 : c->band_bytes / e.pitch;
 
-                /* to scale the resultant pixel down to its appropriate value it
-                 * should be multiplied by op, but visually, it looks better to
-                 * clip it... this may change in the future. */
-                dim->pix[o(i,j,pix)] = clip_uint8( sqrt(pow(dx[pix],2)+pow(dy[pix],2)) );
+    /* rgb frames with a grey gradient are filtered on their luma, which is
+     * complete before any band reads its halo rows */
+    if (FMT_RGB24 == im->fmt && FMT_GREY8 == dim->fmt) {
+        size = (size_t) im->width*im->height;
+        if (t->size < size) {
+            free (t->buf);
+            t->size = 0;
+            if (NULL == (t->buf = malloc (size))) {
+                image_close (dim);
+                return -1;
             }
+            t->size = size;
         }
+        e.rgb = im->pix;
+        e.width = im->width;
+        e.src = t->buf;
+        edges_run (c, edges_luma_task, &e,
+                   (im->height + e.band_rows - 1) / e.band_rows);
+    }
+
+    /* the outermost pixels have no neighbours on one side and stay black.
+     * to scale the resultant pixel down to its appropriate value it should
+     * be multiplied by op, but visually, it looks better to clip it... this
+     * may change in the future. */
+    if (3 <= im->width && 3 <= im->height) {
+        edges_run (c, edges_band_task, &e,
+                   (im->height - 2 + e.band_rows - 1) / e.band_rows);
     }
 
     /* pass the output image along */
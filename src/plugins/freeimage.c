@@ -52,10 +52,89 @@ int fi_input_exec (plugin_context*  ctx,
 int fi_input_exit (plugin_context*  ctx,
                    int              thread_id);
 
+int fi_decode_init (plugin_context* ctx,
+                    int             thread_id,
+                    char*           args);
+/* rewrite a decoded bitmap in place into the frame layout image.h describes:
+ * FreeImage keeps rows bottom-up, padded to 4 bytes and, at 24 bits, in
+ * FI_RGBA byte order. the bitmap only owns the memory afterwards */
+static void fi_pack_rows (FIBITMAP* dib, data_fmt fmt)
+{
+    unsigned width = FreeImage_GetWidth (dib);
+    unsigned height = FreeImage_GetHeight (dib);
+    size_t pitch = FreeImage_GetPitch (dib);
+    size_t row = (size_t) width * FreeImage_GetBPP (dib) / 8;
+    BYTE* bits = FreeImage_GetBits (dib);
+    unsigned x, y;
+
+    FreeImage_FlipVertical (dib);
+
+    /* a packed row never starts past its padded source, so going front to
+     * back only overwrites bytes that were already read */
+    for (y = 0; y < height; y++) {
+        BYTE* src = bits + y * pitch;
+        BYTE* dst = bits + y * row;
+
+        if (FMT_RGB24 != fmt) {
+            memmove (dst, src, row);
+            continue;
+        }
+        for (x = 0; x < width; x++, src += 3, dst += 3) {
+            BYTE r = src[FI_RGBA_RED];
+            BYTE g = src[FI_RGBA_GREEN];
+            BYTE b = src[FI_RGBA_BLUE];
+            dst[0] = r;
+            dst[1] = g;
+            dst[2] = b;
+        }
+    }
+}
+
+/* the reverse of fi_pack_rows: copy a packed top-down frame into a freshly
+ * allocated bitmap */
+static FIBITMAP* fi_unpack_rows (const image_t* im)
+{
+    FIBITMAP* dib;
+    size_t row = (size_t) im->width * im->bpp / 8;
+    const uint8_t* src;
+    BYTE* dst;
+    int64_t x, y;
+
+    if (NULL == (dib = FreeImage_Allocate (im->width, im->height, im->bpp,
+                                           FI_RGBA_RED_MASK,
+                                           FI_RGBA_GREEN_MASK,
+                                           FI_RGBA_BLUE_MASK)))
+    {
+        return NULL;
+    }
+
+    for (y = 0; y < im->height; y++) {
+        src = im->pix + y * row;
+        dst = FreeImage_GetScanLine (dib, im->height - 1 - y);
+
+        if (FMT_RGB24 != im->fmt) {
+            memcpy (dst, src, row);
+            continue;
+        }
+        for (x = 0; x < im->width; x++, src += 3, dst += 3) {
+            dst[FI_RGBA_RED] = src[0];
+            dst[FI_RGBA_GREEN] = src[1];
+            dst[FI_RGBA_BLUE] = src[2];
+        }
+    }
+
+    return dib;
+}
+
 int fi_decode_exec (plugin_context* ctx,
                     int             thread_id,
                     image_t**       src_data,
                     image_t**       dst_data);
+int fi_decode_exit (plugin_context* ctx,
+                    int             thread_id);
+int fi_decode_probe (plugin_context* ctx,
+                     image_t*        src_data,
+                     image_t*        info);
 
 int fi_encode_init (plugin_context* ctx,
                     int             thread_id,
@@ -107,21 +186,22 @@ static plugin_info pi_freeimage_input = {.stage=PLUGIN_STAGE_INPUT,
 
 /* decode plugin configuration */
 static const char decode_name[] = "freeimage_decode";
-static const data_fmt decode_dst_fmt[] = {FMT_RGB24, -1};
+static const data_fmt native_dst_fmt[] = {FMT_RGB24, FMT_GREY8, FMT_RGB32, -1};
 static plugin_info pi_freeimage_decode = {.stage=PLUGIN_STAGE_DECODE,
                                           .type=PLUGIN_TYPE_ASYNC,
                                           .src_fmt=input_dst_fmt,
-                                          .dst_fmt=decode_dst_fmt,
+                                          .dst_fmt=native_dst_fmt,
                                           .name=decode_name,
-                                          .init=NULL,
-                                          .exit=NULL,
-                                          .exec=fi_decode_exec};
+                                          .init=fi_decode_init,
+                                          .exit=fi_decode_exit,
+                                          .exec=fi_decode_exec,
+                                          .probe=fi_decode_probe};
 
 /* output plugin configuration */
 static const char encode_name[] = "freeimage_encode";
 static plugin_info pi_freeimage_encode = {.stage=PLUGIN_STAGE_ENCODE,
                                           .type=PLUGIN_TYPE_ASYNC,
-                                          .src_fmt=decode_dst_fmt,
+                                          .src_fmt=native_dst_fmt,
                                           .dst_fmt=input_dst_fmt,
                                           .name=encode_name,
                                           .init=fi_encode_init,
@@ -343,22 +423,101 @@ exit:
     return ret_val;
 }
 
+typedef struct fi_decode_context {
+    int     native;
+    int*    threads;
+} fi_decode_context;
+
+int fi_decode_init (plugin_context* ctx,
+                    int             thread_id,
+                    char*           args)
+{
+    fi_decode_context* c;
+    char* str;
+    int ret_val = -1;
+
+    pthread_mutex_lock (&ctx->mutex);
+
+    if (NULL == ctx->data) {
+        if (NULL == (c = malloc (sizeof(fi_decode_context)))) {
+            error_exit ("Out of memory");
+        }
+
+        if (NULL == (c->threads = calloc (ctx->num_threads, sizeof(int)))) {
+            free (c);
+            error_exit ("Out of memory");
+        }
+
+        /* native:1 keeps 8 bit grey and 32 bit sources in their own layout
+         * instead of widening them to RGB24; only use it when the next stage
+         * accepts FMT_GREY8 and FMT_RGB32 */
+        c->native = 0;
+        parse_args (args, 0, "native", &str);
+        if (NULL != str) {
+            c->native = atoi (str);
+            free (str);
+        }
+        ctx->data = c;
+    }
+
+    c = (fi_decode_context*) ctx->data;
+
+    if (NULL == c->threads ||
+        0 != c->threads[thread_id])
+    {
+        error_exit ("Invalid context");
+    }
+    c->threads[thread_id] = 1;
+
+    ret_val = 0;
+
+exit:
+    pthread_mutex_unlock (&ctx->mutex);
+    return ret_val;
+}
+
+/* pick the native format a decoded bitmap can be handed out as without
+ * conversion, or FMT_NONE if it has to go through ConvertTo24Bits */
+static data_fmt fi_native_fmt (FIBITMAP* dib, int native)
+{
+    if (FIT_BITMAP != FreeImage_GetImageType (dib)) {
+        return FMT_NONE;
+    }
+
+    switch (FreeImage_GetBPP (dib)) {
+        case 24:
+            return FMT_RGB24;
+        case 32:
+            return native ? FMT_RGB32 : FMT_NONE;
+        case 8:
+            if (native && FIC_MINISBLACK == FreeImage_GetColorType (dib)) {
+                return FMT_GREY8;
+            }
+            return FMT_NONE;
+        default:
+            return FMT_NONE;
+    }
+}
+
 int fi_decode_exec (plugin_context* ctx,
                     int             thread_id,
                     image_t**       src_data,
                     image_t**       dst_data)
 {
+    fi_decode_context* c;
     image_t* sim;
     image_t* dim;
-    FIMEMORY* hmem;
+    FIMEMORY* hmem = NULL;
     FREE_IMAGE_FORMAT fif;
-    FIBITMAP *dib, *dib24;
+    FIBITMAP *dib, *out;
+    data_fmt fmt;
     int ret_val = -1;
 
-    (void) ctx;
     (void) thread_id;
 
-    if (NULL == (sim = *src_data) || NULL != *dst_data) {
+    if (NULL == (c = (fi_decode_context*) ctx->data) ||
+        NULL == (sim = *src_data) || NULL != *dst_data)
+    {
         error_exit ("Invalid I/O buffers");
     }
 
@@ -374,40 +533,295 @@ int fi_decode_exec (plugin_context* ctx,
         error_exit ("Unable to load image from memory (unable to decode)");
     }
 
+    /* hand the decoded bitmap straight out when its layout is already one
+     * we can describe; ConvertTo24Bits would only clone it */
+    if (FMT_NONE != (fmt = fi_native_fmt (dib, c->native))) {
+        out = dib;
+    } else {
+        out = FreeImage_ConvertTo24Bits (dib);
+        FreeImage_Unload (dib);
+        if (NULL == out) {
+            error_exit ("Unable to convert image to 24 bits");
+        }
+        fmt = FMT_RGB24;
+    }
+
     if (NULL == (dim = malloc (sizeof(image_t)))) {
+        FreeImage_Unload (out);
         error_exit ("Out of memory");
     }
 
-    dib24 = FreeImage_ConvertTo24Bits (dib);
+    fi_pack_rows (out, fmt);
 
     /* plug decoded data into new image */
-    dim->pix = FreeImage_GetBits (dib24);
-    dim->width = FreeImage_GetWidth (dib24);
-    dim->height = FreeImage_GetHeight (dib24);
-    dim->bpp = FreeImage_GetBPP (dib24);
-    dim->fmt = FMT_RGB24;
-    dim->ext_data = dib24;
+    dim->pix = FreeImage_GetBits (out);
+    dim->width = FreeImage_GetWidth (out);
+    dim->height = FreeImage_GetHeight (out);
+    dim->bpp = FreeImage_GetBPP (out);
+    dim->size = dim->width * dim->bpp / 8 * dim->height;
+    dim->fmt = fmt;
+    dim->ext_data = out;
     dim->ext_free = (void (*)(void *)) &FreeImage_Unload;
     dim->frame = sim->frame;
 
     *dst_data = dim;
+    ret_val = 0;
+
+exit:
+    if (NULL != hmem) {
+        FreeImage_CloseMemory (hmem);
+    }
+    return ret_val;
+}
 
-    /* free up intermediate structs */
+/* FIF_LOAD_NOPIXELS only parses the header for the formats that support it
+ * (jpeg, png, tiff, ...); the others would load fully, so they are left to
+ * the decode itself */
+int fi_decode_probe (plugin_context* ctx,
+                     image_t*        src_data,
+                     image_t*        info)
+{
+    fi_decode_context* c;
+    FIMEMORY* hmem = NULL;
+    FREE_IMAGE_FORMAT fif;
+    FIBITMAP* dib;
+    data_fmt fmt;
+    int ret_val = -1;
+
+    if (NULL == (c = (fi_decode_context*) ctx->data) ||
+        NULL == src_data || NULL == info)
+    {
+        error_exit ("Invalid context");
+    }
+
+    if (NULL == (hmem = FreeImage_OpenMemory (src_data->pix, src_data->size))) {
+        error_exit ("Unable to open memory");
+    }
+
+    if (FIF_UNKNOWN == (fif = FreeImage_GetFileTypeFromMemory (hmem, 0)) ||
+        !FreeImage_FIFSupportsNoPixels (fif))
+    {
+        goto exit;
+    }
+
+    if (NULL == (dib = FreeImage_LoadFromMemory (fif, hmem,
+                                                 FIF_LOAD_NOPIXELS)))
+    {
+        error_exit ("Unable to read image header");
+    }
+
+    if (FMT_NONE == (fmt = fi_native_fmt (dib, c->native))) {
+        fmt = FMT_RGB24;
+    }
+
+    info->width = FreeImage_GetWidth (dib);
+    info->height = FreeImage_GetHeight (dib);
+    info->bpp = image_fmt_bpp (fmt);
+    info->fmt = fmt;
     FreeImage_Unload (dib);
-    FreeImage_CloseMemory (hmem);
 
     ret_val = 0;
 
 exit:
+    if (NULL != hmem) {
+        FreeImage_CloseMemory (hmem);
+    }
     return ret_val;
 }
 
+int fi_decode_exit (plugin_context* ctx,
+                    int             thread_id)
+{
+    fi_decode_context* c;
+    int i;
+    int ret_val = -1;
+
+    pthread_mutex_lock (&ctx->mutex);
+
+    if (NULL == (c = (fi_decode_context*) ctx->data)) {
+        error_exit ("Invalid context");
+    }
+
+    c->threads[thread_id] = -1;
+
+    for (i = 0; i < ctx->num_threads; i++) {
+        if (0 <= c->threads[i]) {
+            pthread_mutex_unlock (&ctx->mutex);
+            return 0;
+        }
+    }
+
+    free (c->threads);
+    free (c);
+    ctx->data = NULL;
+
+    pthread_mutex_unlock (&ctx->mutex);
+    ret_val = 0;
+
+exit:
+    return ret_val;
+}
+
+/* encoded images point into their FIMEMORY until the output stage is done
+ * with them; the handles are then put back here and reused, keeping their
+ * already grown buffers */
+typedef struct fi_mem_pool fi_mem_pool;
+
+typedef struct fi_mem {
+    fi_mem_pool*    pool;
+    FIMEMORY*       hmem;
+    long            end;
+    struct fi_mem*  next;
+} fi_mem;
+
+struct fi_mem_pool {
+    pthread_mutex_t mutex;
+    fi_mem*         free_list;
+    int             nfree;
+    int             max_free;
+    int             outstanding;
+    int             closed;
+};
+
 typedef struct fi_encode_context {
     data_fmt            dst_fmt;
     FREE_IMAGE_FORMAT   dst_fif;
+    fi_mem_pool*        mem;
     int*                threads;
 } fi_encode_context;
 
+static fi_mem_pool* fi_mem_pool_new (int max_free)
+{
+    fi_mem_pool* p;
+
+    if (NULL == (p = calloc (1, sizeof *p))) {
+        return NULL;
+    }
+    pthread_mutex_init (&p->mutex, NULL);
+    p->max_free = max_free;
+    return p;
+}
+
+/* called locked, once the pool is closed and nothing is outstanding */
+static void fi_mem_pool_destroy (fi_mem_pool* p)
+{
+    fi_mem* m;
+
+    while (NULL != (m = p->free_list)) {
+        p->free_list = m->next;
+        FreeImage_CloseMemory (m->hmem);
+        free (m);
+    }
+    pthread_mutex_unlock (&p->mutex);
+    pthread_mutex_destroy (&p->mutex);
+    free (p);
+}
+
+/* encoded images may outlive the plugin, so the pool goes away with the
+ * last handle */
+static void fi_mem_pool_free (fi_mem_pool* p)
+{
+    pthread_mutex_lock (&p->mutex);
+    p->closed = 1;
+    if (0 == p->outstanding) {
+        fi_mem_pool_destroy (p);
+        return;
+    }
+    pthread_mutex_unlock (&p->mutex);
+}
+
+static fi_mem* fi_mem_get (fi_mem_pool* p)
+{
+    fi_mem* m;
+
+    pthread_mutex_lock (&p->mutex);
+    if (NULL != (m = p->free_list)) {
+        p->free_list = m->next;
+        p->nfree--;
+    }
+    p->outstanding++;
+    pthread_mutex_unlock (&p->mutex);
+
+    if (NULL == m) {
+        if (NULL == (m = malloc (sizeof *m)) ||
+            NULL == (m->hmem = FreeImage_OpenMemory (0, 0)))
+        {
+            free (m);
+            pthread_mutex_lock (&p->mutex);
+            p->outstanding--;
+            pthread_mutex_unlock (&p->mutex);
+            return NULL;
+        }
+        m->pool = p;
+    }
+
+    /* saves write from the current position */
+    FreeImage_SeekMemory (m->hmem, 0, SEEK_SET);
+    m->end = 0;
+    return m;
+}
+
+/* saves go through these so that the furthest byte written is known. a
+ * reused handle still holds the tail of larger earlier images, and savers
+ * that seek back to patch their headers (tiff) finish short of the end, so
+ * neither the stream length nor the final position is the image size */
+static unsigned DLL_CALLCONV fi_mem_read (void* buffer, unsigned size,
+                                          unsigned count, fi_handle handle)
+{
+    return FreeImage_ReadMemory (buffer, size, count, ((fi_mem*) handle)->hmem);
+}
+
+static unsigned DLL_CALLCONV fi_mem_write (void* buffer, unsigned size,
+                                           unsigned count, fi_handle handle)
+{
+    fi_mem* m = handle;
+    unsigned n = FreeImage_WriteMemory (buffer, size, count, m->hmem);
+    long pos = FreeImage_TellMemory (m->hmem);
+
+    if (pos > m->end) {
+        m->end = pos;
+    }
+    return n;
+}
+
+static int DLL_CALLCONV fi_mem_seek (fi_handle handle, long offset, int origin)
+{
+    return FreeImage_SeekMemory (((fi_mem*) handle)->hmem, offset, origin)
+           ? 0 : -1;
+}
+
+static long DLL_CALLCONV fi_mem_tell (fi_handle handle)
+{
+    return FreeImage_TellMemory (((fi_mem*) handle)->hmem);
+}
+
+static FreeImageIO fi_mem_io = {fi_mem_read, fi_mem_write,
+                                fi_mem_seek, fi_mem_tell};
+
+/* has the signature of image_t.ext_free */
+static void fi_mem_put (void* data)
+{
+    fi_mem* m = data;
+    fi_mem_pool* p = m->pool;
+
+    pthread_mutex_lock (&p->mutex);
+    p->outstanding--;
+    if (p->closed || p->nfree >= p->max_free) {
+        FreeImage_CloseMemory (m->hmem);
+        free (m);
+    } else {
+        m->next = p->free_list;
+        p->free_list = m;
+        p->nfree++;
+    }
+
+    if (p->closed && 0 == p->outstanding) {
+        fi_mem_pool_destroy (p);
+        return;
+    }
+    pthread_mutex_unlock (&p->mutex);
+}
+
 char* native_to_charfmt (data_fmt fmt)
 {
     int size = 11;
@@ -585,6 +999,12 @@ int fi_encode_init (plugin_context* ctx,
             free (c);
             error_exit ("Out of memory");
         }
+
+        if (NULL == (c->mem = fi_mem_pool_new (2 * ctx->num_threads))) {
+            free (c->threads);
+            free (c);
+            error_exit ("Out of memory");
+        }
         c->dst_fmt = dst_fmt;
         c->dst_fif = native_to_fif (dst_fmt);
         ctx->data = c;
@@ -613,12 +1033,11 @@ int fi_encode_exec (plugin_context* ctx,
 {
     fi_encode_context* c;
     image_t* sim;
-    image_t* dim;
-    FIMEMORY* hmem;
-    FREE_IMAGE_FORMAT fif;
-    FIBITMAP* dib;
-    uint32_t size = 0;
-    uint8_t* pix;
+    image_t* dim = NULL;
+    fi_mem* m = NULL;
+    FIBITMAP* dib = NULL;
+    BYTE* pix;
+    DWORD size;
     int ret_val = -1;
 
     (void) thread_id;
@@ -631,42 +1050,53 @@ int fi_encode_exec (plugin_context* ctx,
         error_exit ("Invalid context");
     }
 
-    if (sim->ext_free == (void (*)(void *)) &FreeImage_Unload) {
-        if (NULL == (dib = sim->ext_data)) {
-            error_exit ("ext_free was set but ext_data is NULL "
-                        "-- some other plugin messed up");
-        }
-    } else {
-        if (NULL == (dib = FreeImage_Allocate (sim->width, sim->height,
-                                               sim->bpp, 0, 0, 0)))
-        {
-            error_exit ("Out of memory");
-        }
+    /* decoded bitmaps were repacked by fi_pack_rows, so every frame goes
+     * back through a bitmap of FreeImage's own layout */
+    if (FMT_RGB24 != sim->fmt && FMT_GREY8 != sim->fmt &&
+        FMT_RGB32 != sim->fmt)
+    {
+        error_exit ("Unsupported frame format");
+    }
+    if (image_fmt_bpp (sim->fmt) != sim->bpp ||
+        sim->size < sim->width * sim->bpp / 8 * sim->height)
+    {
+        error_exit ("Frame is smaller than its shape");
     }
 
-    pix = FreeImage_GetBits (dib);
-    memcpy (pix, sim->pix, sim->width*sim->height*sim->bpp/8);
-    fif = c->dst_fif;
+    if (NULL == (dib = fi_unpack_rows (sim))) {
+        error_exit ("Out of memory");
+    }
 
-    if(NULL == (hmem = FreeImage_OpenMemory (0, 0)) ||
-       !FreeImage_SaveToMemory (fif, dib, hmem, 0) ||
-       !FreeImage_AcquireMemory (hmem, &dim->pix, &size))
-    {
-        error_exit ("Unable to decode image");
+    if (NULL == (m = fi_mem_get (c->mem))) {
+        error_exit ("Unable to open memory");
     }
 
-    dim->size = size;
-    FreeImage_Unload (dib);
+    if (!FreeImage_SaveToHandle (c->dst_fif, dib, &fi_mem_io, m, 0) ||
+        !FreeImage_AcquireMemory (m->hmem, &pix, &size))
+    {
+        error_exit ("Unable to encode image");
+    }
 
-    dim->ext_data = hmem;
-    dim->ext_free = (void (*)(void *)) &FreeImage_CloseMemory;
+    dim->pix = pix;
+    dim->size = m->end;
+    dim->ext_data = m;
+    dim->ext_free = fi_mem_put;
     dim->fmt = c->dst_fmt;
     dim->frame = sim->frame;
 
     *dst_data = dim;
+    dim = NULL;
+    m = NULL;
     ret_val = 0;
 
 exit:
+    if (NULL != dib) {
+        FreeImage_Unload (dib);
+    }
+    if (NULL != m) {
+        fi_mem_put (m);
+    }
+    free (dim);
     return ret_val;
 }
 
@@ -692,6 +1122,7 @@ int fi_encode_exit (plugin_context* ctx,
         }
     }
 
+    fi_mem_pool_free (c->mem);
     free (c->threads);
     free (c);
     ctx->data = NULL;
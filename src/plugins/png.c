@@ -0,0 +1,670 @@
+/******************************************************************************
+ * Copyright (c) 2010 Joey Degges
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <pthread.h>
+
+#include <zlib.h>
+
+#include "image.h"
+#include "plugin.h"
+#include "workpool.h"
+
+/* function definitions */
+int png_query (plugin_stage   stage,
+               plugin_info**  pi);
+
+int png_encode_init (plugin_context* ctx,
+                     int             thread_id,
+                     char*           args);
+int png_encode_exec (plugin_context* ctx,
+                     int             thread_id,
+                     image_t**       src_data,
+                     image_t**       dst_data);
+int png_encode_exit (plugin_context* ctx,
+                     int             thread_id);
+
+/* encode plugin configuration */
+static const char encode_name[] = "png_encode";
+static const data_fmt encode_src_fmt[] = {
+    FMT_RGB24,  FMT_BGR24,  FMT_RGB32,
+    FMT_BGR32,  FMT_GREY8,  -1};
+static const data_fmt encode_dst_fmt[] = {FMT_PNG, -1};
+static plugin_info pi_png_encode = {.stage=PLUGIN_STAGE_ENCODE,
+                                    .type=PLUGIN_TYPE_ASYNC,
+                                    .src_fmt=encode_src_fmt,
+                                    .dst_fmt=encode_dst_fmt,
+                                    .name=encode_name,
+                                    .init=png_encode_init,
+                                    .exit=png_encode_exit,
+                                    .exec=png_encode_exec};
+
+int png_query (plugin_stage stage, plugin_info** pi)
+{
+    *pi = NULL;
+    switch (stage) {
+        case PLUGIN_STAGE_ENCODE:
+            *pi = &pi_png_encode;
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+/* filtered bytes compressed per task; pigz uses the same block size */
+#define PNG_CHUNK (128 * 1024)
+
+/* deflate window, primed from the previous chunk */
+#define PNG_DICT (32 * 1024)
+
+enum {
+    PNG_FILTER_NONE,
+    PNG_FILTER_SUB,
+    PNG_FILTER_UP,
+    PNG_FILTER_AVG,
+    PNG_FILTER_PAETH,
+    PNG_FILTER_ADAPTIVE
+};
+
+static const char* png_filter_names[] = {
+    "none", "sub", "up", "avg", "paeth", "adaptive", NULL
+};
+
+typedef struct png_encode_context {
+    workpool*   pool;
+    size_t      chunk;
+    int         level;
+    int         filter;
+    int         references;
+} png_encode_context;
+
+/* one band of rows, filtered and then deflated independently */
+typedef struct png_chunk {
+    int         row0;
+    int         rows;
+    uint8_t*    out;
+    size_t      len;
+    uLong       adler;
+    uLong       crc;
+    int         err;
+} png_chunk;
+
+typedef struct png_job {
+    png_encode_context* c;
+    image_t*            im;
+    int                 channels;
+    const uint8_t*      perm;
+    size_t              src_stride;
+    size_t              rowbytes;
+    uint8_t*            filtered;
+    png_chunk*          chunks;
+    int                 nchunks;
+} png_job;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+static const uint8_t perm_rgb32[] = {2, 1, 0, 3};
+static const uint8_t perm_bgr32[] = {0, 1, 2, 3};
+#else
+static const uint8_t perm_rgb32[] = {1, 2, 3, 0};
+static const uint8_t perm_bgr32[] = {3, 2, 1, 0};
+#endif
+static const uint8_t perm_bgr24[] = {2, 1, 0};
+
+static void png_put32 (uint8_t* p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint8_t png_paeth (int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs (p - a);
+    int pb = abs (p - b);
+    int pc = abs (p - c);
+
+    if (pa <= pb && pa <= pc) {
+        return a;
+    }
+    return pb <= pc ? b : c;
+}
+
+/* apply one filter type to a row; prev is NULL for the first row */
+static void png_filter_row (int type, const uint8_t* cur, const uint8_t* prev,
+                            uint8_t* out, size_t n, int bpp)
+{
+    size_t i;
+
+    out[0] = type;
+    out++;
+
+    switch (type) {
+        case PNG_FILTER_NONE:
+            memcpy (out, cur, n);
+            break;
+        case PNG_FILTER_SUB:
+            for (i = 0; i < n; i++) {
+                out[i] = cur[i] - (i >= (size_t) bpp ? cur[i - bpp] : 0);
+            }
+            break;
+        case PNG_FILTER_UP:
+            for (i = 0; i < n; i++) {
+                out[i] = cur[i] - (prev ? prev[i] : 0);
+            }
+            break;
+        case PNG_FILTER_AVG:
+            for (i = 0; i < n; i++) {
+                out[i] = cur[i] - (((i >= (size_t) bpp ? cur[i - bpp] : 0) +
+                                    (prev ? prev[i] : 0)) >> 1);
+            }
+            break;
+        case PNG_FILTER_PAETH:
+            for (i = 0; i < n; i++) {
+                out[i] = cur[i] - png_paeth (
+                            i >= (size_t) bpp ? cur[i - bpp] : 0,
+                            prev ? prev[i] : 0,
+                            i >= (size_t) bpp && prev ? prev[i - bpp] : 0);
+            }
+            break;
+    }
+}
+
+/* libpng's heuristic: the filter whose output has the smallest sum of
+ * absolute signed bytes tends to compress best */
+static uint64_t png_filter_cost (const uint8_t* row, size_t n)
+{
+    uint64_t sum = 0;
+    size_t i;
+
+    for (i = 1; i <= n; i++) {
+        sum += row[i] < 128 ? row[i] : 256 - row[i];
+    }
+    return sum;
+}
+
+/* reorder a source row into PNG channel order */
+static void png_pack_row (const uint8_t* src, uint8_t* dst, int width,
+                          int channels, const uint8_t* perm)
+{
+    int x, k;
+
+    for (x = 0; x < width; x++) {
+        for (k = 0; k < channels; k++) {
+            dst[k] = src[perm[k]];
+        }
+        src += channels;
+        dst += channels;
+    }
+}
+
+static void png_filter_task (void* arg, int task)
+{
+    png_job* j = arg;
+    png_chunk* ch = &j->chunks[task];
+    const uint8_t* pix = j->im->pix;
+    size_t n = j->rowbytes;
+    uint8_t* rows[2] = {NULL, NULL};
+    uint8_t* trial = NULL;
+    const uint8_t* cur;
+    const uint8_t* prev;
+    uint8_t* out;
+    uint64_t cost, best;
+    int y, t, type;
+    int k = 0;
+
+    if (j->perm &&
+        (NULL == (rows[0] = malloc (n)) || NULL == (rows[1] = malloc (n))))
+    {
+        ch->err = 1;
+        goto exit;
+    }
+    if (PNG_FILTER_ADAPTIVE == j->c->filter &&
+        NULL == (trial = malloc (n + 1)))
+    {
+        ch->err = 1;
+        goto exit;
+    }
+
+    prev = NULL;
+    if (0 < ch->row0) {
+        prev = pix + (ch->row0 - 1) * j->src_stride;
+        if (j->perm) {
+            png_pack_row (prev, rows[1], j->im->width, j->channels, j->perm);
+            prev = rows[1];
+        }
+    }
+
+    for (y = ch->row0; y < ch->row0 + ch->rows; y++) {
+        cur = pix + y * j->src_stride;
+        if (j->perm) {
+            png_pack_row (cur, rows[k], j->im->width, j->channels, j->perm);
+            cur = rows[k];
+            k ^= 1;
+        }
+        out = j->filtered + y * (n + 1);
+
+        if (PNG_FILTER_ADAPTIVE != j->c->filter) {
+            png_filter_row (j->c->filter, cur, prev, out, n, j->channels);
+        } else {
+            png_filter_row (PNG_FILTER_NONE, cur, prev, out, n, j->channels);
+            best = png_filter_cost (out, n);
+            type = PNG_FILTER_NONE;
+            for (t = PNG_FILTER_SUB; t <= PNG_FILTER_PAETH; t++) {
+                png_filter_row (t, cur, prev, trial, n, j->channels);
+                if ((cost = png_filter_cost (trial, n)) < best) {
+                    best = cost;
+                    type = t;
+                }
+            }
+            if (PNG_FILTER_NONE != type) {
+                png_filter_row (type, cur, prev, out, n, j->channels);
+            }
+        }
+        prev = cur;
+    }
+
+exit:
+    free (trial);
+    free (rows[0]);
+    free (rows[1]);
+}
+
+/* deflate one chunk as a raw stream primed with the window that precedes
+ * it, so concatenating the chunks yields a single valid zlib stream */
+static void png_deflate_task (void* arg, int task)
+{
+    png_job* j = arg;
+    png_chunk* ch = &j->chunks[task];
+    int last = task == j->nchunks - 1;
+    uint8_t* in = j->filtered + ch->row0 * (j->rowbytes + 1);
+    size_t in_len = ch->rows * (j->rowbytes + 1);
+    size_t dict;
+    size_t cap;
+    z_stream zs;
+    int ret;
+
+    memset (&zs, 0, sizeof zs);
+    if (Z_OK != deflateInit2 (&zs, j->c->level, Z_DEFLATED, -15, 8,
+                              PNG_FILTER_NONE == j->c->filter ?
+                                Z_DEFAULT_STRATEGY : Z_FILTERED))
+    {
+        ch->err = 1;
+        return;
+    }
+
+    if (0 < task) {
+        dict = in - j->filtered < PNG_DICT ? in - j->filtered : PNG_DICT;
+        deflateSetDictionary (&zs, in - dict, dict);
+    }
+
+    /* room for the sync flush marker on top of the worst case */
+    cap = deflateBound (&zs, in_len) + 16;
+    if (NULL == (ch->out = malloc (cap))) {
+        ch->err = 1;
+        deflateEnd (&zs);
+        return;
+    }
+
+    zs.next_in = in;
+    zs.avail_in = in_len;
+    zs.next_out = ch->out;
+    zs.avail_out = cap;
+
+    /* every chunk but the last ends on a byte boundary without setting the
+     * final block bit */
+    ret = deflate (&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if ((last ? Z_STREAM_END : Z_OK) != ret || 0 != zs.avail_in) {
+        ch->err = 1;
+    }
+    ch->len = cap - zs.avail_out;
+    deflateEnd (&zs);
+
+    ch->adler = adler32 (adler32 (0, NULL, 0), in, in_len);
+    ch->crc = crc32 (crc32 (0, NULL, 0), ch->out, ch->len);
+}
+
+/* second zlib header byte: the FLEVEL hint for the level in use plus the
+ * FCHECK bits that make the header a multiple of 31 */
+static uint8_t png_zlib_flags (int level)
+{
+    if (0 <= level && level < 2) {
+        return 0x01;
+    } else if (2 <= level && level < 6) {
+        return 0x5e;
+    } else if (6 < level) {
+        return 0xda;
+    }
+    return 0x9c;
+}
+
+static int png_parse_filter (const char* str)
+{
+    int i;
+
+    for (i = 0; NULL != png_filter_names[i]; i++) {
+        if (0 == strcasecmp (str, png_filter_names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int png_encode_init (plugin_context* ctx,
+                     int             thread_id,
+                     char*           args)
+{
+    png_encode_context* c;
+    char* param;
+    int threads = 0;
+    int ret_val = -1;
+
+    (void) thread_id;
+
+    pthread_mutex_lock (&ctx->mutex);
+
+    if (NULL == ctx->data) {
+        if (NULL == (c = calloc (1, sizeof *c))) {
+            error_exit ("Out of memory");
+        }
+
+        c->level = Z_DEFAULT_COMPRESSION;
+        parse_args (args, 0, "level", &param);
+        if (NULL != param) {
+            c->level = atoi (param);
+            free (param);
+            if (c->level < 0 || c->level > 9) {
+                free (c);
+                error_exit ("Invalid ``level'' option, expected 0-9");
+            }
+        }
+
+        c->filter = PNG_FILTER_ADAPTIVE;
+        parse_args (args, 0, "filter", &param);
+        if (NULL != param) {
+            c->filter = png_parse_filter (param);
+            free (param);
+            if (-1 == c->filter) {
+                free (c);
+                error_exit ("Invalid ``filter'' option, expected none, sub, "
+                            "up, avg, paeth or adaptive");
+            }
+        }
+
+        c->chunk = PNG_CHUNK;
+        parse_args (args, 0, "chunk", &param);
+        if (NULL != param) {
+            c->chunk = strtoull (param, NULL, 10);
+            free (param);
+        }
+        if (c->chunk < PNG_DICT) {
+            c->chunk = PNG_DICT;
+        }
+
+        parse_args (args, 0, "threads", &param);
+        if (NULL != param) {
+            threads = atoi (param);
+            free (param);
+        }
+
+        if (NULL == (c->pool = workpool_new (threads))) {
+            free (c);
+            error_exit ("Unable to start encoder threads");
+        }
+
+        ctx->data = c;
+    }
+
+    if (NULL == (c = (png_encode_context*) ctx->data)) {
+        error_exit ("Invalid context");
+    }
+
+    c->references++;
+    ret_val = 0;
+
+exit:
+    pthread_mutex_unlock (&ctx->mutex);
+    return ret_val;
+}
+
+int png_encode_exec (plugin_context* ctx,
+                     int             thread_id,
+                     image_t**       src_data,
+                     image_t**       dst_data)
+{
+    static const uint8_t signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26,
+                                         '\n'};
+    png_encode_context* c;
+    png_job j;
+    image_t* sim;
+    image_t* dim = NULL;
+    uint8_t* p;
+    uint8_t zhdr[2];
+    uint8_t trailer[4];
+    uLong adler, crc;
+    size_t total;
+    int rows_per_chunk;
+    int i;
+    int ret_val = -1;
+
+    (void) thread_id;
+
+    memset (&j, 0, sizeof j);
+
+    if (NULL == (c = (png_encode_context*) ctx->data) ||
+        NULL == (sim = *src_data) ||
+        NULL != *dst_data)
+    {
+        error_exit ("Invalid context");
+    }
+
+    switch (sim->fmt) {
+        case FMT_GREY8:     j.channels = 1;                         break;
+        case FMT_RGB24:     j.channels = 3;                         break;
+        case FMT_BGR24:     j.channels = 3; j.perm = perm_bgr24;    break;
+        case FMT_RGB32:     j.channels = 4; j.perm = perm_rgb32;    break;
+        case FMT_BGR32:     j.channels = 4; j.perm = perm_bgr32;    break;
+        default:
+            error_exit ("Unsupported source format");
+    }
+
+    j.c = c;
+    j.im = sim;
+    j.rowbytes = (size_t) sim->width * j.channels;
+    j.src_stride = j.rowbytes;
+
+    if (0 >= sim->width || 0 >= sim->height) {
+        error_exit ("Invalid image dimensions");
+    }
+
+    /* frames are packed top-down rows, see image.h */
+    if (sim->bpp != 8 * j.channels ||
+        sim->size / (int64_t) j.rowbytes < sim->height)
+    {
+        error_exit ("Frame is smaller than its shape");
+    }
+
+    rows_per_chunk = c->chunk / (j.rowbytes + 1);
+    if (0 >= rows_per_chunk) {
+        rows_per_chunk = 1;
+    }
+    j.nchunks = (sim->height + rows_per_chunk - 1) / rows_per_chunk;
+
+    if (NULL == (j.filtered = malloc (sim->height * (j.rowbytes + 1))) ||
+        NULL == (j.chunks = calloc (j.nchunks, sizeof *j.chunks)))
+    {
+        error_exit ("Out of memory");
+    }
+
+    for (i = 0; i < j.nchunks; i++) {
+        j.chunks[i].row0 = i * rows_per_chunk;
+        j.chunks[i].rows = sim->height - j.chunks[i].row0 < rows_per_chunk ?
+                           sim->height - j.chunks[i].row0 : rows_per_chunk;
+    }
+
+    /* filtering has to finish everywhere before deflating, since each chunk
+     * is primed with the filtered tail of the one before it */
+    workpool_run (c->pool, png_filter_task, &j, j.nchunks);
+    for (i = 0; i < j.nchunks; i++) {
+        if (j.chunks[i].err) {
+            error_exit ("Out of memory");
+        }
+    }
+
+    workpool_run (c->pool, png_deflate_task, &j, j.nchunks);
+
+    /* stitch the chunk checksums together into the stream's adler32, which
+     * is defined over the whole stream */
+    zhdr[0] = 0x78;
+    zhdr[1] = png_zlib_flags (c->level);
+    adler = adler32 (0, NULL, 0);
+    total = sizeof signature + (12 + 13) + 2 + 4 + 12;
+    for (i = 0; i < j.nchunks; i++) {
+        png_chunk* ch = &j.chunks[i];
+
+        if (ch->err) {
+            error_exit ("Unable to compress image");
+        }
+        if (0x7fffffff - 6 < ch->len) {
+            error_exit ("Compressed band too large for an IDAT chunk, "
+                        "lower ``chunk''");
+        }
+        adler = adler32_combine (adler, ch->adler,
+                                 ch->rows * (j.rowbytes + 1));
+        total += 12 + ch->len;
+    }
+    png_put32 (trailer, adler);
+
+    if (NULL == (dim = calloc (1, sizeof *dim)) ||
+        NULL == (dim->pix = malloc (total)))
+    {
+        error_exit ("Out of memory");
+    }
+
+    p = dim->pix;
+    memcpy (p, signature, sizeof signature);
+    p += sizeof signature;
+
+    png_put32 (p, 13);
+    memcpy (p + 4, "IHDR", 4);
+    png_put32 (p + 8, sim->width);
+    png_put32 (p + 12, sim->height);
+    p[16] = 8;
+    p[17] = 1 == j.channels ? 0 : (3 == j.channels ? 2 : 6);
+    p[18] = 0;
+    p[19] = 0;
+    p[20] = 0;
+    png_put32 (p + 21, crc32 (crc32 (0, NULL, 0), p + 4, 17));
+    p += 25;
+
+    /* one IDAT per band keeps each chunk under png's 2^31-1 length limit
+     * however large the image gets; the zlib header rides in the first one
+     * and the adler32 trailer in the last */
+    for (i = 0; i < j.nchunks; i++) {
+        png_chunk* ch = &j.chunks[i];
+        int first = 0 == i;
+        int last = j.nchunks - 1 == i;
+
+        png_put32 (p, (first ? 2 : 0) + ch->len + (last ? 4 : 0));
+        memcpy (p + 4, "IDAT", 4);
+        crc = crc32 (crc32 (0, NULL, 0), (const Bytef*) "IDAT", 4);
+        p += 8;
+        if (first) {
+            memcpy (p, zhdr, 2);
+            crc = crc32 (crc, zhdr, 2);
+            p += 2;
+        }
+        memcpy (p, ch->out, ch->len);
+        crc = crc32_combine (crc, ch->crc, ch->len);
+        p += ch->len;
+        if (last) {
+            memcpy (p, trailer, 4);
+            crc = crc32 (crc, trailer, 4);
+            p += 4;
+        }
+        png_put32 (p, crc);
+        p += 4;
+    }
+
+    png_put32 (p, 0);
+    memcpy (p + 4, "IEND", 4);
+    png_put32 (p + 8, crc32 (crc32 (0, NULL, 0), p + 4, 4));
+
+    dim->width = sim->width;
+    dim->height = sim->height;
+    dim->size = total;
+    dim->fmt = FMT_PNG;
+    dim->frame = sim->frame;
+
+    *dst_data = dim;
+    dim = NULL;
+    ret_val = 0;
+
+exit:
+    if (NULL != j.chunks) {
+        for (i = 0; i < j.nchunks; i++) {
+            free (j.chunks[i].out);
+        }
+    }
+    free (j.chunks);
+    free (j.filtered);
+    image_close (dim);
+    return ret_val;
+}
+
+int png_encode_exit (plugin_context* ctx,
+                     int             thread_id)
+{
+    png_encode_context* c;
+    int ret_val = -1;
+
+    (void) thread_id;
+
+    pthread_mutex_lock (&ctx->mutex);
+
+    if (NULL == (c = (png_encode_context*) ctx->data)) {
+        error_exit ("Invalid context");
+    }
+
+    if (--c->references) {
+        ret_val = 0;
+        goto exit;
+    }
+
+    workpool_free (c->pool);
+    free (c);
+
+    ctx->data = NULL;
+    ret_val = 0;
+
+exit:
+    pthread_mutex_unlock (&ctx->mutex);
+    return ret_val;
+}
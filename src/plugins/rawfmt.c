@@ -0,0 +1,942 @@
+/******************************************************************************
+ * Copyright (c) 2010 Joey Degges
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <pthread.h>
+
+#include "image.h"
+#include "plugin.h"
+
+/* function definitions */
+int rawfmt_query (plugin_stage   stage,
+                  plugin_info**  pi);
+
+int rf_decode_exec (plugin_context* ctx,
+                    int             thread_id,
+                    image_t**       src_data,
+                    image_t**       dst_data);
+int rf_decode_probe (plugin_context* ctx,
+                     image_t*        src_data,
+                     image_t*        info);
+
+int rf_encode_init (plugin_context* ctx,
+                    int             thread_id,
+                    char*           args);
+int rf_encode_exec (plugin_context* ctx,
+                    int             thread_id,
+                    image_t**       src_data,
+                    image_t**       dst_data);
+int rf_encode_exit (plugin_context* ctx,
+                    int             thread_id);
+
+/* the packed 32 bit formats are native endian words, name the two byte
+ * orders the file formats use */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define RF_FMT_BGRA FMT_RGB32
+#define RF_FMT_RGBA FMT_BGR32
+#else
+#define RF_FMT_BGRA FMT_BGR32_1
+#define RF_FMT_RGBA FMT_RGB32_1
+#endif
+
+/* decode plugin configuration */
+static const char decode_name[] = "rawfmt_decode";
+static const data_fmt file_fmt[] = {
+    FMT_PPMRAW, FMT_PGMRAW, FMT_BMP,
+    FMT_QOI,    -1};
+static const data_fmt pixel_fmt[] = {
+    FMT_GREY8,      FMT_GREY16,     FMT_RGB24,
+    FMT_BGR24,      FMT_RGB48BE,    RF_FMT_BGRA,
+    RF_FMT_RGBA,    -1};
+static plugin_info pi_rawfmt_decode = {.stage=PLUGIN_STAGE_DECODE,
+                                       .type=PLUGIN_TYPE_ASYNC,
+                                       .src_fmt=file_fmt,
+                                       .dst_fmt=pixel_fmt,
+                                       .name=decode_name,
+                                       .init=NULL,
+                                       .exit=NULL,
+                                       .exec=rf_decode_exec,
+                                       .probe=rf_decode_probe};
+
+/* encode plugin configuration, 16 bit samples are read but not written */
+static const char encode_name[] = "rawfmt_encode";
+static const data_fmt encode_fmt[] = {
+    FMT_GREY8,      FMT_RGB24,      FMT_BGR24,
+    RF_FMT_BGRA,    RF_FMT_RGBA,    -1};
+static plugin_info pi_rawfmt_encode = {.stage=PLUGIN_STAGE_ENCODE,
+                                       .type=PLUGIN_TYPE_ASYNC,
+                                       .src_fmt=encode_fmt,
+                                       .dst_fmt=file_fmt,
+                                       .name=encode_name,
+                                       .init=rf_encode_init,
+                                       .exit=rf_encode_exit,
+                                       .exec=rf_encode_exec};
+
+int rawfmt_query (plugin_stage stage, plugin_info** pi)
+{
+    *pi = NULL;
+    switch (stage) {
+        case PLUGIN_STAGE_DECODE:
+            *pi = &pi_rawfmt_decode;
+            break;
+        case PLUGIN_STAGE_ENCODE:
+            *pi = &pi_rawfmt_encode;
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+/* byte offsets of each channel within a pixel, grey sources repeat the one
+ * channel and sources without alpha have a = -1 */
+typedef struct rf_layout {
+    int channels;
+    int r, g, b, a;
+} rf_layout;
+
+static const rf_layout layout_grey = {1, 0, 0, 0, -1};
+static const rf_layout layout_rgb = {3, 0, 1, 2, -1};
+static const rf_layout layout_bgr = {3, 2, 1, 0, -1};
+static const rf_layout layout_rgba = {4, 0, 1, 2, 3};
+static const rf_layout layout_bgra = {4, 2, 1, 0, 3};
+
+static const rf_layout* rf_fmt_layout (data_fmt fmt)
+{
+    switch (fmt) {
+        case FMT_GREY8:     return &layout_grey;
+        case FMT_RGB24:     return &layout_rgb;
+        case FMT_BGR24:     return &layout_bgr;
+        case RF_FMT_RGBA:   return &layout_rgba;
+        case RF_FMT_BGRA:   return &layout_bgra;
+        default:            return NULL;
+    }
+}
+
+/* convert n pixels between layouts; alpha defaults to opaque and colour
+ * folds down to grey with the BT.601 weights */
+static void rf_convert (uint8_t* dst, const rf_layout* dl,
+                        const uint8_t* src, const rf_layout* sl, size_t n)
+{
+    size_t i;
+
+    if (0 == memcmp (dl, sl, sizeof *dl)) {
+        memcpy (dst, src, n * sl->channels);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        uint8_t r = src[sl->r];
+        uint8_t g = src[sl->g];
+        uint8_t b = src[sl->b];
+
+        if (1 == dl->channels) {
+            dst[0] = (77 * r + 150 * g + 29 * b + 128) >> 8;
+        } else {
+            dst[dl->r] = r;
+            dst[dl->g] = g;
+            dst[dl->b] = b;
+            if (0 <= dl->a) {
+                dst[dl->a] = 0 <= sl->a ? src[sl->a] : 255;
+            }
+        }
+        src += sl->channels;
+        dst += dl->channels;
+    }
+}
+
+static uint32_t rf_be32 (const uint8_t* p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+           (uint32_t) p[2] << 8  | (uint32_t) p[3];
+}
+
+static uint32_t rf_le32 (const uint8_t* p)
+{
+    return (uint32_t) p[3] << 24 | (uint32_t) p[2] << 16 |
+           (uint32_t) p[1] << 8  | (uint32_t) p[0];
+}
+
+static void rf_put_be32 (uint8_t* p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void rf_put_le32 (uint8_t* p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void rf_put_le16 (uint8_t* p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+/* decoded images that point into their source keep it alive through this */
+static void rf_release (void* data)
+{
+    image_close (data);
+}
+
+static void rf_view (image_t* dim, image_t** src_data, size_t off)
+{
+    dim->pix = (*src_data)->pix + off;
+    dim->ext_data = *src_data;
+    dim->ext_free = rf_release;
+    *src_data = NULL;
+}
+
+/* binary portable any-maps: magic, width, height, maxval and a single
+ * whitespace character followed by the raster. returns the raster offset */
+static ssize_t rf_pnm_header (const uint8_t* p, size_t avail, int64_t val[3])
+{
+    size_t off = 2;
+    int n;
+
+    for (n = 0; n < 3; n++) {
+        while (off < avail) {
+            if ('#' == p[off]) {
+                while (off < avail && '\n' != p[off]) {
+                    off++;
+                }
+            } else if (' ' == p[off] || '\t' == p[off] ||
+                       '\r' == p[off] || '\n' == p[off])
+            {
+                off++;
+            } else {
+                break;
+            }
+        }
+
+        for (val[n] = 0; off < avail && '0' <= p[off] && p[off] <= '9' &&
+                         val[n] < (1 << 24); off++)
+        {
+            val[n] = val[n] * 10 + p[off] - '0';
+        }
+    }
+    off++;
+
+    if (off > avail || val[0] <= 0 || val[1] <= 0 || val[2] <= 0 ||
+        65535 < val[2])
+    {
+        return -1;
+    }
+    return off;
+}
+
+static int rf_decode_pnm (image_t** src_data, image_t* dim)
+{
+    image_t* sim = *src_data;
+    const uint8_t* p = sim->pix;
+    size_t avail = sim->size;
+    int channels = '6' == p[1] ? 3 : 1;
+    int64_t val[3];
+    size_t raster, i;
+    ssize_t off;
+
+    if ((off = rf_pnm_header (p, avail, val)) < 0) {
+        return -1;
+    }
+
+    dim->width = val[0];
+    dim->height = val[1];
+    dim->bpp = channels * (val[2] < 256 ? 8 : 16);
+    raster = val[0] * val[1] * dim->bpp / 8;
+    if (raster > avail - (size_t) off) {
+        return -1;
+    }
+    dim->size = raster;
+
+    if (val[2] < 256) {
+        dim->fmt = 3 == channels ? FMT_RGB24 : FMT_GREY8;
+        rf_view (dim, src_data, off);
+        return 0;
+    } else if (3 == channels) {
+        dim->fmt = FMT_RGB48BE;
+        rf_view (dim, src_data, off);
+        return 0;
+    }
+
+    /* 16 bit grey is only defined in native byte order */
+    dim->fmt = FMT_GREY16;
+    if (NULL == (dim->pix = malloc (raster))) {
+        return -1;
+    }
+    for (i = 0; i < raster; i += 2) {
+        uint16_t v = p[off + i] << 8 | p[off + i + 1];
+        memcpy (dim->pix + i, &v, 2);
+    }
+    return 0;
+}
+
+/* BI_BITFIELDS bitmaps are only taken when their masks spell out the usual
+ * b, g, r, a byte order. the masks follow a 40 byte header and sit inside
+ * the larger ones, alpha only from 56 bytes on */
+static int rf_bmp_masks_ok (const uint8_t* p, int64_t size, uint32_t hdr)
+{
+    uint32_t alpha;
+
+    if (size < 66 || 0x00ff0000 != rf_le32 (p + 54) ||
+        0x0000ff00 != rf_le32 (p + 58) || 0x000000ff != rf_le32 (p + 62))
+    {
+        return 0;
+    }
+    if (hdr < 56) {
+        return 1;
+    }
+    if (size < 70) {
+        return 0;
+    }
+    alpha = rf_le32 (p + 66);
+    return 0 == alpha || 0xff000000 == alpha;
+}
+
+/* uncompressed 8, 24 and 32 bit bitmaps. top-down bitmaps whose rows need
+ * no padding are used in place, everything else is unpadded and flipped */
+static int rf_decode_bmp (image_t** src_data, image_t* dim)
+{
+    image_t* sim = *src_data;
+    const uint8_t* p = sim->pix;
+    const uint8_t* pal;
+    const uint8_t* row;
+    uint32_t off, hdr, compression, colors;
+    int32_t height;
+    int64_t width, rows, stride, rowbytes, y, x;
+    int bitcount;
+    uint8_t* out;
+
+    if (sim->size < 54) {
+        return -1;
+    }
+
+    off = rf_le32 (p + 10);
+    hdr = rf_le32 (p + 14);
+    width = (int32_t) rf_le32 (p + 18);
+    height = (int32_t) rf_le32 (p + 22);
+    bitcount = p[28] | p[29] << 8;
+    compression = rf_le32 (p + 30);
+    colors = rf_le32 (p + 46);
+
+    if (hdr < 40 || width <= 0 || 0 == height ||
+        (0 != compression && !(3 == compression && 32 == bitcount)) ||
+        (8 != bitcount && 24 != bitcount && 32 != bitcount) ||
+        (3 == compression && !rf_bmp_masks_ok (p, sim->size, hdr)))
+    {
+        return -1;
+    }
+
+    rows = height < 0 ? -(int64_t) height : height;
+    stride = (width * bitcount + 31) / 32 * 4;
+    rowbytes = width * bitcount / 8;
+    if (off > sim->size || stride * rows > sim->size - off) {
+        return -1;
+    }
+
+    dim->width = width;
+    dim->height = rows;
+
+    /* palette entries are stored b, g, r, reserved */
+    if (8 == bitcount) {
+        colors = 0 == colors ? 256 : colors;
+        pal = p + 14 + hdr;
+        if (256 < colors || pal + colors * 4 > p + off) {
+            return -1;
+        }
+        dim->bpp = 24;
+        dim->fmt = FMT_BGR24;
+        dim->size = width * rows * 3;
+        if (NULL == (dim->pix = malloc (dim->size))) {
+            return -1;
+        }
+        for (y = 0; y < rows; y++) {
+            row = p + off + (height < 0 ? y : rows - 1 - y) * stride;
+            out = dim->pix + y * width * 3;
+            for (x = 0; x < width; x++) {
+                if (row[x] >= colors) {
+                    return -1;
+                }
+                memcpy (out + 3 * x, pal + 4 * row[x], 3);
+            }
+        }
+        return 0;
+    }
+
+    dim->bpp = bitcount;
+    dim->fmt = 24 == bitcount ? FMT_BGR24 : RF_FMT_BGRA;
+    dim->size = rowbytes * rows;
+
+    if (height < 0 && stride == rowbytes) {
+        rf_view (dim, src_data, off);
+        return 0;
+    }
+
+    if (NULL == (dim->pix = malloc (dim->size))) {
+        return -1;
+    }
+    for (y = 0; y < rows; y++) {
+        row = p + off + (height < 0 ? y : rows - 1 - y) * stride;
+        memcpy (dim->pix + y * rowbytes, row, rowbytes);
+    }
+    return 0;
+}
+
+#define QOI_OP_INDEX    0x00
+#define QOI_OP_DIFF     0x40
+#define QOI_OP_LUMA     0x80
+#define QOI_OP_RUN      0xc0
+#define QOI_OP_RGB      0xfe
+#define QOI_OP_RGBA     0xff
+#define QOI_MASK        0xc0
+#define QOI_HEADER      14
+#define QOI_PADDING     8
+
+#define QOI_HASH(px) (((px)[0] * 3 + (px)[1] * 5 + (px)[2] * 7 + \
+                       (px)[3] * 11) % 64)
+
+/* pixels are carried as r, g, b, a internally and written out with the
+ * stream's channel count */
+static int rf_decode_qoi (image_t** src_data, image_t* dim)
+{
+    image_t* sim = *src_data;
+    const uint8_t* p = sim->pix;
+    size_t len = sim->size;
+    size_t off = QOI_HEADER;
+    uint8_t index[64][4];
+    uint8_t px[4] = {0, 0, 0, 255};
+    uint64_t npix, i;
+    int channels, run = 0;
+    uint8_t* out;
+
+    if (len < QOI_HEADER + QOI_PADDING) {
+        return -1;
+    }
+
+    dim->width = rf_be32 (p + 4);
+    dim->height = rf_be32 (p + 8);
+    channels = p[12];
+    npix = (uint64_t) dim->width * dim->height;
+
+    if (0 == npix || (3 != channels && 4 != channels) ||
+        npix > ((uint64_t) 1 << 32))
+    {
+        return -1;
+    }
+
+    dim->bpp = 8 * channels;
+    dim->fmt = 3 == channels ? FMT_RGB24 : RF_FMT_RGBA;
+    dim->size = npix * channels;
+    if (NULL == (out = dim->pix = malloc (dim->size))) {
+        return -1;
+    }
+
+    memset (index, 0, sizeof index);
+    len -= QOI_PADDING;
+
+    for (i = 0; i < npix; i++) {
+        if (0 < run) {
+            run--;
+        } else if (off < len) {
+            uint8_t b1 = p[off++];
+
+            if (QOI_OP_RGB == b1) {
+                if (off + 3 > len) {
+                    return -1;
+                }
+                px[0] = p[off];
+                px[1] = p[off + 1];
+                px[2] = p[off + 2];
+                off += 3;
+            } else if (QOI_OP_RGBA == b1) {
+                if (off + 4 > len) {
+                    return -1;
+                }
+                memcpy (px, p + off, 4);
+                off += 4;
+            } else if (QOI_OP_INDEX == (b1 & QOI_MASK)) {
+                memcpy (px, index[b1], 4);
+            } else if (QOI_OP_DIFF == (b1 & QOI_MASK)) {
+                px[0] += ((b1 >> 4) & 0x03) - 2;
+                px[1] += ((b1 >> 2) & 0x03) - 2;
+                px[2] += (b1 & 0x03) - 2;
+            } else if (QOI_OP_LUMA == (b1 & QOI_MASK)) {
+                uint8_t b2;
+                int vg = (b1 & 0x3f) - 32;
+
+                if (off >= len) {
+                    return -1;
+                }
+                b2 = p[off++];
+                px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+                px[1] += vg;
+                px[2] += vg - 8 + (b2 & 0x0f);
+            } else {
+                run = b1 & 0x3f;
+            }
+
+            memcpy (index[QOI_HASH (px)], px, 4);
+        } else {
+            return -1;
+        }
+
+        memcpy (out, px, channels);
+        out += channels;
+    }
+
+    return 0;
+}
+
+int rf_decode_exec (plugin_context* ctx,
+                    int             thread_id,
+                    image_t**       src_data,
+                    image_t**       dst_data)
+{
+    image_t* sim;
+    image_t* dim = NULL;
+    const uint8_t* p;
+    int err;
+    int ret_val = -1;
+
+    (void) ctx;
+    (void) thread_id;
+
+    if (NULL == (sim = *src_data) || NULL != *dst_data ||
+        NULL == (dim = calloc (1, sizeof *dim)))
+    {
+        error_exit ("Invalid I/O buffers");
+    }
+
+    p = sim->pix;
+    dim->frame = sim->frame;
+
+    if (sim->size < 4) {
+        error_exit ("Truncated image");
+    } else if ('P' == p[0] && ('5' == p[1] || '6' == p[1])) {
+        err = rf_decode_pnm (src_data, dim);
+    } else if ('B' == p[0] && 'M' == p[1]) {
+        err = rf_decode_bmp (src_data, dim);
+    } else if (0 == memcmp (p, "qoif", 4)) {
+        err = rf_decode_qoi (src_data, dim);
+    } else {
+        error_exit ("Unsupported image format");
+    }
+
+    if (err) {
+        error_exit ("Unable to decode image");
+    }
+
+    *dst_data = dim;
+    dim = NULL;
+    ret_val = 0;
+
+exit:
+    /* a failed decode never took over the source */
+    if (NULL != dim) {
+        free (dim->pix);
+        free (dim);
+    }
+    return ret_val;
+}
+
+/* the same shapes rf_decode_exec produces, from the headers alone */
+int rf_decode_probe (plugin_context* ctx,
+                     image_t*        src_data,
+                     image_t*        info)
+{
+    const uint8_t* p;
+    int64_t val[3];
+    int channels;
+    int ret_val = -1;
+
+    (void) ctx;
+
+    if (NULL == src_data || NULL == info || src_data->size < 14) {
+        error_exit ("Invalid I/O buffers");
+    }
+    p = src_data->pix;
+
+    if ('P' == p[0] && ('5' == p[1] || '6' == p[1])) {
+        if (rf_pnm_header (p, src_data->size, val) < 0) {
+            error_exit ("Invalid pnm header");
+        }
+        channels = '6' == p[1] ? 3 : 1;
+        info->width = val[0];
+        info->height = val[1];
+        info->bpp = channels * (val[2] < 256 ? 8 : 16);
+        if (val[2] < 256) {
+            info->fmt = 3 == channels ? FMT_RGB24 : FMT_GREY8;
+        } else {
+            info->fmt = 3 == channels ? FMT_RGB48BE : FMT_GREY16;
+        }
+    } else if ('B' == p[0] && 'M' == p[1] && src_data->size >= 54) {
+        int32_t height = rf_le32 (p + 22);
+        int bitcount = p[28] | p[29] << 8;
+
+        info->width = (int32_t) rf_le32 (p + 18);
+        info->height = height < 0 ? -(int64_t) height : height;
+        info->bpp = 32 == bitcount ? 32 : 24;
+        info->fmt = 32 == bitcount ? RF_FMT_BGRA : FMT_BGR24;
+    } else if (0 == memcmp (p, "qoif", 4)) {
+        channels = p[12];
+        info->width = rf_be32 (p + 4);
+        info->height = rf_be32 (p + 8);
+        info->bpp = 8 * channels;
+        info->fmt = 4 == channels ? RF_FMT_RGBA : FMT_RGB24;
+    } else {
+        error_exit ("Unsupported image format");
+    }
+
+    ret_val = 0;
+
+exit:
+    return ret_val;
+}
+
+typedef struct rf_encode_context {
+    data_fmt    dst_fmt;
+    int         references;
+} rf_encode_context;
+
+int rf_encode_init (plugin_context* ctx,
+                    int             thread_id,
+                    char*           args)
+{
+    rf_encode_context* c;
+    data_fmt dst_fmt = FMT_NONE;
+    char* str;
+    int ret_val = -1;
+
+    (void) thread_id;
+
+    pthread_mutex_lock (&ctx->mutex);
+
+    if (NULL == ctx->data) {
+        if (-1 == parse_args (args, 0, "dst_fmt", &str)) {
+            error_exit ("Missing argument for option ``dst_fmt''");
+        }
+
+        if (0 == strcasecmp (str, "ppm")) {
+            dst_fmt = FMT_PPMRAW;
+        } else if (0 == strcasecmp (str, "pgm")) {
+            dst_fmt = FMT_PGMRAW;
+        } else if (0 == strcasecmp (str, "bmp")) {
+            dst_fmt = FMT_BMP;
+        } else if (0 == strcasecmp (str, "qoi")) {
+            dst_fmt = FMT_QOI;
+        }
+        free (str);
+
+        if (FMT_NONE == dst_fmt) {
+            error_exit ("Invalid ``dst_fmt'' option, expected ppm, pgm, bmp "
+                        "or qoi");
+        }
+
+        if (NULL == (c = calloc (1, sizeof *c))) {
+            error_exit ("Out of memory");
+        }
+        c->dst_fmt = dst_fmt;
+        ctx->data = c;
+    }
+
+    if (NULL == (c = (rf_encode_context*) ctx->data)) {
+        error_exit ("Invalid context");
+    }
+
+    c->references++;
+    ret_val = 0;
+
+exit:
+    pthread_mutex_unlock (&ctx->mutex);
+    return ret_val;
+}
+
+static int rf_encode_pnm (image_t* sim, const rf_layout* sl, image_t* dim,
+                          int grey)
+{
+    const rf_layout* dl = grey ? &layout_grey : &layout_rgb;
+    size_t raster = sim->width * sim->height * dl->channels;
+    char hdr[64];
+    int n;
+
+    n = snprintf (hdr, sizeof hdr, "P%c\n%" PRId64 " %" PRId64 "\n255\n",
+                  grey ? '5' : '6', sim->width, sim->height);
+
+    dim->size = n + raster;
+    if (NULL == (dim->pix = malloc (dim->size))) {
+        return -1;
+    }
+    memcpy (dim->pix, hdr, n);
+    rf_convert (dim->pix + n, dl, sim->pix, sl, sim->width * sim->height);
+    return 0;
+}
+
+/* written top-down so rows go out in source order; sources with alpha keep
+ * it as a 32 bit bitmap */
+static int rf_encode_bmp (image_t* sim, const rf_layout* sl, image_t* dim)
+{
+    const rf_layout* dl = 0 <= sl->a ? &layout_bgra : &layout_bgr;
+    int64_t rowbytes = sim->width * dl->channels;
+    int64_t stride = (rowbytes + 3) & ~3;
+    int64_t y;
+    uint8_t* p;
+
+    dim->size = 54 + stride * sim->height;
+    if (NULL == (p = dim->pix = calloc (1, dim->size))) {
+        return -1;
+    }
+
+    p[0] = 'B';
+    p[1] = 'M';
+    rf_put_le32 (p + 2, dim->size);
+    rf_put_le32 (p + 10, 54);
+    rf_put_le32 (p + 14, 40);
+    rf_put_le32 (p + 18, sim->width);
+    rf_put_le32 (p + 22, -sim->height);
+    rf_put_le16 (p + 26, 1);
+    rf_put_le16 (p + 28, 8 * dl->channels);
+    rf_put_le32 (p + 34, stride * sim->height);
+    rf_put_le32 (p + 38, 2835);
+    rf_put_le32 (p + 42, 2835);
+
+    if (stride == rowbytes) {
+        rf_convert (p + 54, dl, sim->pix, sl, sim->width * sim->height);
+        return 0;
+    }
+    for (y = 0; y < sim->height; y++) {
+        rf_convert (p + 54 + y * stride, dl,
+                    sim->pix + y * sim->width * sl->channels, sl,
+                    sim->width);
+    }
+    return 0;
+}
+
+static int rf_encode_qoi (image_t* sim, const rf_layout* sl, image_t* dim)
+{
+    static const uint8_t padding[QOI_PADDING] = {0, 0, 0, 0, 0, 0, 0, 1};
+    int channels = 0 <= sl->a ? 4 : 3;
+    uint64_t npix = (uint64_t) sim->width * sim->height;
+    uint8_t index[64][4];
+    uint8_t prev[4] = {0, 0, 0, 255};
+    uint8_t px[4];
+    const uint8_t* src = sim->pix;
+    uint8_t* p;
+    uint8_t* out;
+    uint64_t i;
+    int run = 0;
+
+    if (npix > ((uint64_t) 1 << 32)) {
+        return -1;
+    }
+
+    if (NULL == (p = malloc (QOI_HEADER + npix * (channels + 1) +
+                             QOI_PADDING)))
+    {
+        return -1;
+    }
+
+    memcpy (p, "qoif", 4);
+    rf_put_be32 (p + 4, sim->width);
+    rf_put_be32 (p + 8, sim->height);
+    p[12] = channels;
+    p[13] = 0;
+    out = p + QOI_HEADER;
+
+    memset (index, 0, sizeof index);
+
+    for (i = 0; i < npix; i++) {
+        px[0] = src[sl->r];
+        px[1] = src[sl->g];
+        px[2] = src[sl->b];
+        px[3] = 0 <= sl->a ? src[sl->a] : 255;
+        src += sl->channels;
+
+        if (0 == memcmp (px, prev, 4)) {
+            if (62 == ++run || npix - 1 == i) {
+                *out++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+            continue;
+        }
+
+        if (0 < run) {
+            *out++ = QOI_OP_RUN | (run - 1);
+            run = 0;
+        }
+
+        {
+            int h = QOI_HASH (px);
+
+            if (0 == memcmp (index[h], px, 4)) {
+                *out++ = QOI_OP_INDEX | h;
+            } else {
+                memcpy (index[h], px, 4);
+
+                if (px[3] == prev[3]) {
+                    int8_t vr = px[0] - prev[0];
+                    int8_t vg = px[1] - prev[1];
+                    int8_t vb = px[2] - prev[2];
+                    int8_t vg_r = vr - vg;
+                    int8_t vg_b = vb - vg;
+
+                    if (-3 < vr && vr < 2 && -3 < vg && vg < 2 &&
+                        -3 < vb && vb < 2)
+                    {
+                        *out++ = QOI_OP_DIFF | (vr + 2) << 4 |
+                                 (vg + 2) << 2 | (vb + 2);
+                    } else if (-9 < vg_r && vg_r < 8 && -33 < vg && vg < 32 &&
+                               -9 < vg_b && vg_b < 8)
+                    {
+                        *out++ = QOI_OP_LUMA | (vg + 32);
+                        *out++ = (vg_r + 8) << 4 | (vg_b + 8);
+                    } else {
+                        *out++ = QOI_OP_RGB;
+                        *out++ = px[0];
+                        *out++ = px[1];
+                        *out++ = px[2];
+                    }
+                } else {
+                    *out++ = QOI_OP_RGBA;
+                    memcpy (out, px, 4);
+                    out += 4;
+                }
+            }
+        }
+
+        memcpy (prev, px, 4);
+    }
+
+    memcpy (out, padding, QOI_PADDING);
+    out += QOI_PADDING;
+
+    dim->size = out - p;
+    dim->pix = realloc (p, dim->size);
+    if (NULL == dim->pix) {
+        dim->pix = p;
+    }
+    return 0;
+}
+
+int rf_encode_exec (plugin_context* ctx,
+                    int             thread_id,
+                    image_t**       src_data,
+                    image_t**       dst_data)
+{
+    rf_encode_context* c;
+    const rf_layout* sl;
+    image_t* sim;
+    image_t* dim = NULL;
+    int err = -1;
+    int ret_val = -1;
+
+    (void) thread_id;
+
+    if (NULL == (c = (rf_encode_context*) ctx->data) ||
+        NULL == (sim = *src_data) ||
+        NULL != *dst_data ||
+        NULL == (dim = calloc (1, sizeof *dim)))
+    {
+        error_exit ("Invalid context");
+    }
+
+    if (NULL == (sl = rf_fmt_layout (sim->fmt))) {
+        error_exit ("Unsupported source format");
+    }
+    if (0 >= sim->width || 0 >= sim->height ||
+        sim->width * sim->height * sl->channels > sim->size)
+    {
+        error_exit ("Invalid image dimensions");
+    }
+
+    switch (c->dst_fmt) {
+        case FMT_PPMRAW:
+            err = rf_encode_pnm (sim, sl, dim, 0);
+            break;
+        case FMT_PGMRAW:
+            err = rf_encode_pnm (sim, sl, dim, 1);
+            break;
+        case FMT_BMP:
+            err = rf_encode_bmp (sim, sl, dim);
+            break;
+        case FMT_QOI:
+            err = rf_encode_qoi (sim, sl, dim);
+            break;
+        default:
+            break;
+    }
+
+    if (err) {
+        error_exit ("Unable to encode image");
+    }
+
+    dim->width = sim->width;
+    dim->height = sim->height;
+    dim->fmt = c->dst_fmt;
+    dim->frame = sim->frame;
+
+    *dst_data = dim;
+    dim = NULL;
+    ret_val = 0;
+
+exit:
+    image_close (dim);
+    return ret_val;
+}
+
+int rf_encode_exit (plugin_context* ctx,
+                    int             thread_id)
+{
+    rf_encode_context* c;
+    int ret_val = -1;
+
+    (void) thread_id;
+
+    pthread_mutex_lock (&ctx->mutex);
+
+    if (NULL == (c = (rf_encode_context*) ctx->data)) {
+        error_exit ("Invalid context");
+    }
+
+    if (--c->references) {
+        ret_val = 0;
+        goto exit;
+    }
+
+    free (c);
+    ctx->data = NULL;
+    ret_val = 0;
+
+exit:
+    pthread_mutex_unlock (&ctx->mutex);
+    return ret_val;
+}
@@ -0,0 +1,779 @@
+/******************************************************************************
+ * Copyright (c) 2010 Joey Degges
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include "image.h"
+#include "plugin.h"
+#include "rbio.h"
+
+/* function definitions */
+int rawvideo_query (plugin_stage   stage,
+                    plugin_info**  pi);
+
+int rv_input_init (plugin_context* ctx,
+                   int             thread_id,
+                   char*           args);
+int rv_input_exec (plugin_context* ctx,
+                   int             thread_id,
+                   image_t**       src_data,
+                   image_t**       dst_data);
+int rv_input_exit (plugin_context* ctx,
+                   int             thread_id);
+
+int rv_output_init (plugin_context* ctx,
+                    int             thread_id,
+                    char*           args);
+int rv_output_exec (plugin_context* ctx,
+                    int             thread_id,
+                    image_t**       src_data,
+                    image_t**       dst_data);
+int rv_output_exit (plugin_context* ctx,
+                    int             thread_id);
+
+/* input plugin configuration */
+static const data_fmt stream_fmt[] = {-1};
+static const data_fmt frame_fmt[] = {
+    FMT_YUV420P,    FMT_YUV422P,    FMT_YUV444P,
+    FMT_GREY8,      FMT_RGB24,      FMT_BGR24,
+    FMT_RGB32,      FMT_BGR32,      FMT_YUYV,
+    FMT_UYVY,       FMT_NV12,       -1};
+static const char input_name[] = "rawvideo_input";
+static plugin_info pi_rawvideo_input = {.stage=PLUGIN_STAGE_INPUT,
+                                        .type=PLUGIN_TYPE_SYNC,
+                                        .src_fmt=stream_fmt,
+                                        .dst_fmt=frame_fmt,
+                                        .name=input_name,
+                                        .init=rv_input_init,
+                                        .exit=rv_input_exit,
+                                        .exec=rv_input_exec};
+
+/* output plugin configuration */
+static const char output_name[] = "rawvideo_output";
+static plugin_info pi_rawvideo_output = {.stage=PLUGIN_STAGE_OUTPUT,
+                                         .type=PLUGIN_TYPE_SYNC,
+                                         .src_fmt=frame_fmt,
+                                         .dst_fmt=stream_fmt,
+                                         .name=output_name,
+                                         .init=rv_output_init,
+                                         .exit=rv_output_exit,
+                                         .exec=rv_output_exec};
+
+int rawvideo_query (plugin_stage stage, plugin_info** pi)
+{
+    *pi = NULL;
+    switch (stage) {
+        case PLUGIN_STAGE_INPUT:
+            *pi = &pi_rawvideo_input;
+            break;
+        case PLUGIN_STAGE_OUTPUT:
+            *pi = &pi_rawvideo_output;
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+/* size of the reads issued against pipes */
+#define RV_CHUNK (1 << 20)
+
+#define Y4M_MAGIC "YUV4MPEG2 "
+#define Y4M_FRAME "FRAME\n"
+
+static const struct {
+    const char* tag;
+    data_fmt    fmt;
+} y4m_colorspaces[] = {
+    {"420jpeg",     FMT_YUV420P},   {"420paldv",    FMT_YUV420P},
+    {"420mpeg2",    FMT_YUV420P},   {"420",         FMT_YUV420P},
+    {"422",         FMT_YUV422P},   {"444",         FMT_YUV444P},
+    {"mono",        FMT_GREY8},     {NULL,          FMT_NONE}
+};
+
+static int64_t rv_frame_size (data_fmt fmt, int64_t width, int64_t height)
+{
+    int64_t cw = (width + 1) / 2;
+    int64_t ch = (height + 1) / 2;
+
+    switch (fmt) {
+        case FMT_YUV420P:
+        case FMT_NV12:
+            return width * height + 2 * cw * ch;
+        case FMT_YUV422P:
+            return width * height + 2 * cw * height;
+        case FMT_YUYV:
+        case FMT_UYVY:
+            return 4 * cw * height;
+        default:
+            return width * height * image_fmt_bpp (fmt) / 8;
+    }
+}
+
+/* a read-only input file mapped into memory. frames handed out by the input
+ * plugin point straight into the mapping and hold a reference on it */
+typedef struct rv_map {
+    pthread_mutex_t mutex;
+    uint8_t*        base;
+    size_t          length;
+    int             refs;
+} rv_map;
+
+static void rv_map_unref (void* data)
+{
+    rv_map* m = data;
+    int refs;
+
+    pthread_mutex_lock (&m->mutex);
+    refs = --m->refs;
+    pthread_mutex_unlock (&m->mutex);
+
+    if (0 == refs) {
+        munmap (m->base, m->length);
+        pthread_mutex_destroy (&m->mutex);
+        free (m);
+    }
+}
+
+static rv_map* rv_map_file (int fd)
+{
+    struct stat sbuf;
+    rv_map* m;
+
+    if (0 != fstat (fd, &sbuf) || !S_ISREG (sbuf.st_mode) ||
+        0 == sbuf.st_size || NULL == (m = calloc (1, sizeof *m)))
+    {
+        return NULL;
+    }
+
+    /* private and writable, so a plugin that works in place on its source
+     * frame gets its own copy of the pages it touches */
+    m->length = sbuf.st_size;
+    m->base = mmap (NULL, m->length, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    fd, 0);
+    if (MAP_FAILED == m->base) {
+        free (m);
+        return NULL;
+    }
+
+    madvise (m->base, m->length, MADV_SEQUENTIAL);
+    pthread_mutex_init (&m->mutex, NULL);
+    m->refs = 1;
+    return m;
+}
+
+typedef struct rv_input_context {
+    int         fd;
+    char*       filen;
+    int         y4m;
+    int64_t     width;
+    int64_t     height;
+    data_fmt    fmt;
+    int64_t     frame_size;
+    rv_map*     map;
+    size_t      offset;
+    rb_reader   reader;
+    buf_pool*   pool;
+    int64_t     frame;
+    int         done;
+    int         references;
+} rv_input_context;
+
+/* copy the next line of the stream (up to size-1 bytes) into line and
+ * consume it. returns the number of bytes consumed, 0 at the end of the
+ * stream and -1 if there is no complete line */
+static ssize_t rv_next_line (rv_input_context* c, char* line, size_t size)
+{
+    uint8_t* p;
+    uint8_t* nl;
+    ssize_t avail;
+
+    if (c->map) {
+        p = c->map->base + c->offset;
+        avail = c->map->length - c->offset;
+    } else {
+        avail = rb_reader_peek (&c->reader, size - 1, &p);
+    }
+
+    if (avail <= 0) {
+        return avail;
+    }
+
+    if (NULL == (nl = memchr (p, '\n', avail < (ssize_t) size - 1 ?
+                                       (size_t) avail : size - 1)))
+    {
+        return -1;
+    }
+
+    memcpy (line, p, nl - p);
+    line[nl - p] = '\0';
+
+    if (c->map) {
+        c->offset += nl - p + 1;
+    } else {
+        rb_reader_skip (&c->reader, nl - p + 1);
+    }
+    return nl - p + 1;
+}
+
+static int rv_parse_y4m_header (rv_input_context* c)
+{
+    char line[1024];
+    char* save;
+    char* tok;
+    int i;
+
+    if (rv_next_line (c, line, sizeof line) <= 0 ||
+        0 != strncmp (line, Y4M_MAGIC, strlen (Y4M_MAGIC)))
+    {
+        return -1;
+    }
+
+    c->fmt = FMT_YUV420P;
+    for (tok = strtok_r (line + strlen (Y4M_MAGIC), " ", &save); tok;
+         tok = strtok_r (NULL, " ", &save))
+    {
+        switch (*tok) {
+            case 'W':
+                c->width = strtoll (tok + 1, NULL, 10);
+                break;
+            case 'H':
+                c->height = strtoll (tok + 1, NULL, 10);
+                break;
+            case 'C':
+                for (i = 0; y4m_colorspaces[i].tag; i++) {
+                    if (0 == strcmp (tok + 1, y4m_colorspaces[i].tag)) {
+                        break;
+                    }
+                }
+                if (NULL == y4m_colorspaces[i].tag) {
+                    return -1;
+                }
+                c->fmt = y4m_colorspaces[i].fmt;
+                break;
+            default:
+                /* frame rate, interlacing, aspect and extensions don't
+                 * change the frame layout */
+                break;
+        }
+    }
+
+    return 0 < c->width && 0 < c->height ? 0 : -1;
+}
+
+int rv_input_init (plugin_context* ctx,
+                   int             thread_id,
+                   char*           args)
+{
+    rv_input_context* c;
+    char* param;
+    uint8_t* p;
+    int ret_val = -1;
+
+    (void) thread_id;
+
+    pthread_mutex_lock (&ctx->mutex);
+
+    if (NULL == ctx->data) {
+        if (NULL == (c = calloc (1, sizeof *c))) {
+            error_exit ("Out of memory");
+        }
+
+        parse_args (args, 0, "rsc", &c->filen);
+        if (NULL == c->filen || '-' == *c->filen) {
+            c->fd = STDIN_FILENO;
+        } else if (-1 == (c->fd = open (c->filen, O_RDONLY))) {
+            error_exit ("Unable to open %s for reading", c->filen);
+        }
+
+        /* regular files are mapped, anything else goes through a reader
+         * into page aligned frames that the output stage can splice */
+        if (NULL == (c->map = rv_map_file (c->fd))) {
+            if (rb_fd_is_pipe (c->fd)) {
+                rb_pipe_grow (c->fd);
+            }
+            if (rb_reader_init (&c->reader, c->fd, RV_CHUNK) ||
+                NULL == (c->pool = buf_pool_new (sysconf (_SC_PAGESIZE),
+                                                 2 * ctx->num_threads)))
+            {
+                error_exit ("Out of memory");
+            }
+        }
+
+        parse_args (args, 0, "container", &param);
+        if (NULL != param) {
+            c->y4m = 0 == strcasecmp (param, "y4m");
+        } else if (c->map) {
+            c->y4m = c->map->length >= strlen (Y4M_MAGIC) &&
+                     0 == memcmp (c->map->base, Y4M_MAGIC, strlen (Y4M_MAGIC));
+        } else {
+            c->y4m = (ssize_t) strlen (Y4M_MAGIC) ==
+                        rb_reader_peek (&c->reader, strlen (Y4M_MAGIC), &p) &&
+                     0 == memcmp (p, Y4M_MAGIC, strlen (Y4M_MAGIC));
+        }
+        free (param);
+
+        if (c->y4m) {
+            if (rv_parse_y4m_header (c)) {
+                error_exit ("Invalid YUV4MPEG2 stream header");
+            }
+        } else {
+            parse_args (args, 0, "width", &param);
+            c->width = NULL != param ? strtoll (param, NULL, 10) : -1;
+            free (param);
+
+            parse_args (args, 0, "height", &param);
+            c->height = NULL != param ? strtoll (param, NULL, 10) : -1;
+            free (param);
+
+            parse_args (args, 0, "fmt", &param);
+            c->fmt = image_fmt_from_str (param);
+            free (param);
+
+            if (c->width <= 0 || c->height <= 0 || FMT_NONE == c->fmt) {
+                error_exit ("Raw video needs ``width'', ``height'' and "
+                            "``fmt''");
+            }
+        }
+
+        if ((c->frame_size = rv_frame_size (c->fmt, c->width, c->height))
+            <= 0)
+        {
+            error_exit ("Unsupported frame format");
+        }
+
+        ctx->data = c;
+    }
+
+    if (NULL == (c = (rv_input_context*) ctx->data)) {
+        error_exit ("Invalid context");
+    }
+
+    c->references++;
+    ret_val = 0;
+
+exit:
+    pthread_mutex_unlock (&ctx->mutex);
+    return ret_val;
+}
+
+/* returns 1 if a frame was read, 0 at the end of the stream and -1 on
+ * errors */
+static int rv_next_frame (rv_input_context* c, image_t* im)
+{
+    char line[256];
+    ssize_t got;
+    uint8_t* p;
+
+    if (c->y4m) {
+        if ((got = rv_next_line (c, line, sizeof line)) <= 0) {
+            return got;
+        }
+        if (0 != strncmp (line, "FRAME", 5)) {
+            return -1;
+        }
+    }
+
+    if (c->map) {
+        if (c->offset == c->map->length) {
+            return 0;
+        }
+        if (c->offset + c->frame_size > c->map->length) {
+            return -1;
+        }
+
+        pthread_mutex_lock (&c->map->mutex);
+        c->map->refs++;
+        pthread_mutex_unlock (&c->map->mutex);
+
+        im->pix = c->map->base + c->offset;
+        im->ext_data = c->map;
+        im->ext_free = rv_map_unref;
+        c->offset += c->frame_size;
+        return 1;
+    }
+
+    if (0 == (got = rb_reader_peek (&c->reader, 1, &p))) {
+        return c->y4m ? -1 : 0;
+    }
+
+    if (got < 0 || buf_pool_attach (c->pool, im, c->frame_size) ||
+        c->frame_size != rb_reader_read (&c->reader, im->pix, c->frame_size))
+    {
+        return -1;
+    }
+    return 1;
+}
+
+int rv_input_exec (plugin_context* ctx,
+                   int             thread_id,
+                   image_t**       src_data,
+                   image_t**       dst_data)
+{
+    rv_input_context* c;
+    image_t* im = NULL;
+    int ret_val = -1;
+
+    (void) thread_id;
+    (void) src_data;
+
+    pthread_mutex_lock (&ctx->mutex);
+
+    if (NULL == (c = (rv_input_context*) ctx->data)) {
+        error_exit ("Invalid context");
+    }
+
+    /* a NULL frame marks the end of the stream */
+    *dst_data = NULL;
+    if (c->done) {
+        ret_val = 0;
+        goto exit;
+    }
+
+    if (NULL == (im = calloc (1, sizeof *im))) {
+        error_exit ("Out of memory");
+    }
+
+    im->width = c->width;
+    im->height = c->height;
+    im->bpp = image_fmt_bpp (c->fmt);
+    im->size = c->frame_size;
+    im->fmt = c->fmt;
+
+    switch (rv_next_frame (c, im)) {
+        case 1:
+            im->frame = c->frame++;
+            *dst_data = im;
+            im = NULL;
+            break;
+        case 0:
+            c->done = 1;
+            break;
+        default:
+            c->done = 1;
+            error_exit ("Error reading frame %ld from %s", c->frame,
+                        c->filen ? c->filen : "stdin");
+    }
+
+    ret_val = 0;
+
+exit:
+    image_close (im);
+    pthread_mutex_unlock (&ctx->mutex);
+    return ret_val;
+}
+
+int rv_input_exit (plugin_context* ctx,
+                   int             thread_id)
+{
+    rv_input_context* c;
+    int ret_val = -1;
+
+    (void) thread_id;
+
+    pthread_mutex_lock (&ctx->mutex);
+
+    if (NULL == (c = (rv_input_context*) ctx->data)) {
+        error_exit ("Invalid context");
+    }
+
+    if (--c->references) {
+        ret_val = 0;
+        goto exit;
+    }
+
+    if (c->map) {
+        rv_map_unref (c->map);
+    } else {
+        rb_reader_close (&c->reader);
+        buf_pool_free (c->pool);
+    }
+    if (STDIN_FILENO != c->fd) {
+        close (c->fd);
+    }
+    free (c->filen);
+    free (c);
+
+    ctx->data = NULL;
+    ret_val = 0;
+
+exit:
+    pthread_mutex_unlock (&ctx->mutex);
+    return ret_val;
+}
+
+
+/* frames can reach the output stage out of order, so they are held back
+ * until every frame before them has been written */
+typedef struct rv_pending {
+    image_t*            im;
+    struct rv_pending*  next;
+} rv_pending;
+
+typedef struct rv_output_context {
+    int         fd;
+    char*       filen;
+    rb_writer   writer;
+    int         y4m;
+    char*       fps;
+    int         header_done;
+    int64_t     width;
+    int64_t     height;
+    data_fmt    fmt;
+    int64_t     next_frame;
+    rv_pending* pending;
+    int         npending;
+    int         max_pending;
+    int         references;
+} rv_output_context;
+
+int rv_output_init (plugin_context* ctx,
+                    int             thread_id,
+                    char*           args)
+{
+    rv_output_context* c;
+    char* param;
+    int ret_val = -1;
+
+    (void) thread_id;
+
+    pthread_mutex_lock (&ctx->mutex);
+
+    if (NULL == ctx->data) {
+        if (NULL == (c = calloc (1, sizeof *c))) {
+            error_exit ("Out of memory");
+        }
+
+        parse_args (args, 0, "rsc", &c->filen);
+        if (NULL == c->filen || '-' == *c->filen) {
+            c->fd = STDOUT_FILENO;
+        } else if (-1 == (c->fd = open (c->filen,
+                                        O_WRONLY | O_CREAT | O_TRUNC, 0644)))
+        {
+            error_exit ("Unable to open %s for writing", c->filen);
+        }
+
+        parse_args (args, 0, "container", &param);
+        if (NULL != param) {
+            c->y4m = 0 == strcasecmp (param, "y4m");
+        } else if (NULL != c->filen) {
+            size_t len = strlen (c->filen);
+            c->y4m = 4 < len && 0 == strcasecmp (c->filen + len - 4, ".y4m");
+        }
+        free (param);
+
+        parse_args (args, 0, "fps", &c->fps);
+
+        /* frames are vmsplice'd into pipes unless splice:0 is given */
+        parse_args (args, 0, "splice", &param);
+        rb_writer_init (&c->writer, c->fd, NULL == param || atoi (param));
+        free (param);
+
+        c->max_pending = 4 * ctx->num_threads + 4;
+        ctx->data = c;
+    }
+
+    if (NULL == (c = (rv_output_context*) ctx->data)) {
+        error_exit ("Invalid context");
+    }
+
+    c->references++;
+    ret_val = 0;
+
+exit:
+    pthread_mutex_unlock (&ctx->mutex);
+    return ret_val;
+}
+
+/* writes the frame and hands it over to the writer */
+static int rv_write_frame (rv_output_context* c, image_t* im)
+{
+    char header[256];
+    struct iovec iov[3];
+    int64_t size;
+    int n = 0;
+    int i;
+
+    if (0 >= (size = rv_frame_size (im->fmt, im->width, im->height))) {
+        size = im->size;
+    }
+
+    if (c->y4m) {
+        if (!c->header_done) {
+            for (i = 0; y4m_colorspaces[i].tag; i++) {
+                if (im->fmt == y4m_colorspaces[i].fmt) {
+                    break;
+                }
+            }
+            if (NULL == y4m_colorspaces[i].tag) {
+                fprintf (stderr, "rawvideo: YUV4MPEG2 cannot carry frame "
+                                 "format %d\n", im->fmt);
+                image_close (im);
+                return -1;
+            }
+
+            c->width = im->width;
+            c->height = im->height;
+            c->fmt = im->fmt;
+
+            iov[n].iov_base = header;
+            iov[n++].iov_len = snprintf (header, sizeof header,
+                                         Y4M_MAGIC "W%ld H%ld F%s Ip A0:0 C%s\n",
+                                         im->width, im->height,
+                                         c->fps ? c->fps : "25:1",
+                                         y4m_colorspaces[i].tag);
+            c->header_done = 1;
+        } else if (im->width != c->width || im->height != c->height ||
+                   im->fmt != c->fmt)
+        {
+            fprintf (stderr, "rawvideo: frame %ld does not match the "
+                             "stream header\n", im->frame);
+            image_close (im);
+            return -1;
+        }
+
+        iov[n].iov_base = Y4M_FRAME;
+        iov[n++].iov_len = strlen (Y4M_FRAME);
+    }
+
+    iov[n].iov_base = im->pix;
+    iov[n++].iov_len = size;
+
+    return rb_writer_writev (&c->writer, iov, n, im);
+}
+
+/* write out the pending frames that are next in line. with force set the
+ * oldest frame is written even if some frame before it never showed up */
+static int rv_flush (rv_output_context* c, int force)
+{
+    int ret_val = 0;
+
+    while (c->pending &&
+           (force || c->pending->im->frame <= c->next_frame ||
+            c->max_pending < c->npending))
+    {
+        rv_pending* p = c->pending;
+        int64_t frame = p->im->frame;
+
+        c->pending = p->next;
+        c->npending--;
+
+        if (rv_write_frame (c, p->im)) {
+            fprintf (stderr, "rawvideo: error writing frame %ld to %s: %s\n",
+                     frame, c->filen ? c->filen : "stdout", strerror (errno));
+            ret_val = -1;
+        }
+
+        c->next_frame = frame + 1;
+        free (p);
+    }
+    return ret_val;
+}
+
+int rv_output_exec (plugin_context* ctx,
+                    int             thread_id,
+                    image_t**       src_data,
+                    image_t**       dst_data)
+{
+    rv_output_context* c;
+    rv_pending** pos;
+    rv_pending* p;
+    int ret_val = -1;
+
+    (void) thread_id;
+    (void) dst_data;
+
+    pthread_mutex_lock (&ctx->mutex);
+
+    if (NULL == (c = (rv_output_context*) ctx->data) || NULL == *src_data) {
+        error_exit ("Invalid context");
+    }
+
+    if (NULL == (p = malloc (sizeof *p))) {
+        error_exit ("Out of memory");
+    }
+
+    /* take ownership of the frame until it can be written in order */
+    p->im = *src_data;
+    *src_data = NULL;
+
+    for (pos = &c->pending; *pos && (*pos)->im->frame < p->im->frame;
+         pos = &(*pos)->next);
+    p->next = *pos;
+    *pos = p;
+    c->npending++;
+
+    ret_val = rv_flush (c, 0);
+
+exit:
+    pthread_mutex_unlock (&ctx->mutex);
+    return ret_val;
+}
+
+int rv_output_exit (plugin_context* ctx,
+                    int             thread_id)
+{
+    rv_output_context* c;
+    int ret_val = -1;
+
+    (void) thread_id;
+
+    pthread_mutex_lock (&ctx->mutex);
+
+    if (NULL == (c = (rv_output_context*) ctx->data)) {
+        error_exit ("Invalid context");
+    }
+
+    if (--c->references) {
+        ret_val = 0;
+        goto exit;
+    }
+
+    ret_val = rv_flush (c, 1);
+    rb_writer_close (&c->writer);
+
+    if (STDOUT_FILENO != c->fd) {
+        close (c->fd);
+    }
+    free (c->fps);
+    free (c->filen);
+    free (c);
+    ctx->data = NULL;
+
+exit:
+    pthread_mutex_unlock (&ctx->mutex);
+    return ret_val;
+}
@@ -29,12 +29,15 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
 
 #include "image.h"
 #include "plugin.h"
+#include "rbio.h"
 
 /* function definitions */
 int simpleio_query (plugin_stage   stage,
@@ -75,7 +78,7 @@ static const data_fmt input_dst_fmt[] = {
     FMT_PPMRAW, FMT_PSD,    FMT_RAS,
     FMT_RAW,    FMT_SGI,    FMT_TARGA,
     FMT_TIFF,   FMT_WBMP,   FMT_XBM,
-    FMT_XPM,    FMT_JPEG,   -1};
+    FMT_XPM,    FMT_JPEG,   FMT_QOI,    -1};
 static const char input_name[] = "simpleio_input";
 static plugin_info pi_simpleio_input = {.stage=PLUGIN_STAGE_INPUT,
                                         .type=PLUGIN_TYPE_ASYNC,
@@ -112,35 +115,114 @@ int simpleio_query (plugin_stage stage, plugin_info** pi)
     }
 }
 
+typedef enum {
+    SIO_SPLIT_NONE,     /* the whole stream is a single frame */
+    SIO_SPLIT_LEN,      /* each frame is prefixed by its 32-bit BE length */
+    SIO_SPLIT_FIXED,    /* raw frames of frame_size bytes */
+    SIO_SPLIT_IMAGE     /* concatenated image files */
+} sio_split;
+
+/* size of the reads issued against the input stream */
+#define SIO_CHUNK (1 << 20)
+
 typedef struct sio_input_context {
-    FILE* filep;
-    char* filen;
-    int   references;
+    int         fd;
+    char*       filen;
+    rb_reader   reader;
+    buf_pool*   pool;
+    sio_split   split;
+    size_t      frame_size;
+    int64_t     width;
+    int64_t     height;
+    int64_t     bpp;
+    data_fmt    fmt;
+    int64_t     frame;
+    int         done;
+    int         references;
 } sio_input_context;
 
+static int64_t atoi_arg (char* args, char* key, int64_t def)
+{
+    char* param;
+    int64_t val = def;
+
+    parse_args (args, 0, key, &param);
+    if (NULL != param) {
+        val = strtoll (param, NULL, 10);
+        free (param);
+    }
+    return val;
+}
+
 int sio_input_init (plugin_context* ctx,
                     int             thread_id,
                     char*           args)
 {
     sio_input_context* c;
+    char* param;
     int ret_val = -1;
 
+    (void) thread_id;
+
     pthread_mutex_lock (&ctx->mutex);
 
     if (ctx->data == NULL) {
-        if (NULL == (c = malloc (sizeof *c))) {
+        if (NULL == (c = calloc (1, sizeof *c))) {
             error_exit ("Out of memory");
         }
 
         parse_args (args, 0, "rsc", &c->filen);
         if (NULL == c->filen || '-' == *c->filen) {
-            c->filep = stdin;
+            c->fd = STDIN_FILENO;
         } else {
-            if (NULL == (c->filep = fopen(c->filen, "r"))) {
+            if (-1 == (c->fd = open (c->filen, O_RDONLY))) {
                 error_exit ("Unable to open %s for reading", c->filen);
             }
         }
 
+        parse_args (args, 0, "split", &param);
+        if (NULL == param || 0 == strcasecmp (param, "none")) {
+            c->split = SIO_SPLIT_NONE;
+        } else if (0 == strcasecmp (param, "len")) {
+            c->split = SIO_SPLIT_LEN;
+        } else if (0 == strcasecmp (param, "fixed")) {
+            c->split = SIO_SPLIT_FIXED;
+        } else if (0 == strcasecmp (param, "image")) {
+            c->split = SIO_SPLIT_IMAGE;
+        } else {
+            error_exit ("Invalid ``split'' option: %s", param);
+        }
+        free (param);
+
+        /* raw frames are described by their geometry, or just by their
+         * size if nothing downstream needs to know what is inside them */
+        c->width = atoi_arg (args, "width", -1);
+        c->height = atoi_arg (args, "height", -1);
+        parse_args (args, 0, "fmt", &param);
+        c->fmt = image_fmt_from_str (param);
+        c->bpp = image_fmt_bpp (c->fmt);
+        free (param);
+
+        c->frame_size = atoi_arg (args, "frame_size", 0);
+        if (0 == c->frame_size && 0 < c->width && 0 < c->height && c->bpp) {
+            c->frame_size = c->width * c->height * c->bpp / 8;
+        }
+        if (SIO_SPLIT_FIXED == c->split && 0 == c->frame_size) {
+            error_exit ("split:fixed needs ``frame_size'' or "
+                        "``width'', ``height'' and ``fmt''");
+        }
+
+        /* page aligned frames can be spliced by the output stage */
+        if (rb_fd_is_pipe (c->fd)) {
+            rb_pipe_grow (c->fd);
+        }
+        if (rb_reader_init (&c->reader, c->fd, SIO_CHUNK) ||
+            NULL == (c->pool = buf_pool_new (sysconf (_SC_PAGESIZE),
+                                             2 * ctx->num_threads)))
+        {
+            error_exit ("Out of memory");
+        }
+
         c->references = 0;
         ctx->data = c;
     }
@@ -157,25 +239,305 @@ exit:
     return ret_val;
 }
 
+static uint32_t be32 (const uint8_t* p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+           (uint32_t) p[2] << 8  | (uint32_t) p[3];
+}
+
+/* signature followed by chunks up to and including IEND */
+static ssize_t png_size (rb_reader* r)
+{
+    size_t off = 8;
+    uint8_t* p;
+
+    for (;;) {
+        size_t len;
+
+        if (rb_reader_peek (r, off + 8, &p) < (ssize_t) (off + 8)) {
+            return -1;
+        }
+        len = be32 (p + off);
+        if (0 == memcmp (p + off + 4, "IEND", 4)) {
+            return off + 12 + len;
+        }
+        off += 12 + len;
+    }
+}
+
+/* walk the marker segments; entropy coded data after each SOS is scanned
+ * for the next marker that is not a stuffed byte or a restart marker */
+static ssize_t jpeg_size (rb_reader* r)
+{
+    size_t off = 2;
+    ssize_t avail;
+    uint8_t* p;
+
+    for (;;) {
+        uint8_t marker;
+
+        if (rb_reader_peek (r, off + 4, &p) < (ssize_t) (off + 2)) {
+            return -1;
+        }
+        if (0xFF != p[off]) {
+            return -1;
+        }
+
+        marker = p[off + 1];
+        if (0xFF == marker) {
+            off++;
+            continue;
+        } else if (0xD9 == marker) {
+            return off + 2;
+        } else if (0x01 == marker || (0xD0 <= marker && marker <= 0xD7)) {
+            off += 2;
+            continue;
+        }
+
+        if (rb_reader_peek (r, off + 4, &p) < (ssize_t) (off + 4)) {
+            return -1;
+        }
+        off += 2 + ((size_t) p[off + 2] << 8 | p[off + 3]);
+
+        if (0xDA != marker) {
+            continue;
+        }
+
+        for (;;) {
+            uint8_t* ff;
+
+            if ((avail = rb_reader_peek (r, off + SIO_CHUNK, &p))
+                < (ssize_t) (off + 2))
+            {
+                return -1;
+            }
+
+            ff = memchr (p + off, 0xFF, avail - off - 1);
+            if (NULL == ff) {
+                off = avail - 1;
+                continue;
+            }
+
+            off = ff - p;
+            if (0x00 == ff[1] || (0xD0 <= ff[1] && ff[1] <= 0xD7)) {
+                off += 2;
+                continue;
+            }
+            break;
+        }
+    }
+}
+
+/* binary portable any-maps: magic, width, height, maxval and a single
+ * whitespace character followed by the raster */
+static ssize_t pnm_size (rb_reader* r, int channels)
+{
+    int64_t val[3];
+    ssize_t avail;
+    size_t off = 2;
+    uint8_t* p;
+    int i;
+
+    avail = rb_reader_peek (r, 1024, &p);
+
+    for (i = 0; i < 3; i++) {
+        while (off < (size_t) avail) {
+            if ('#' == p[off]) {
+                while (off < (size_t) avail && '\n' != p[off]) {
+                    off++;
+                }
+            } else if (' ' == p[off] || '\t' == p[off] ||
+                       '\r' == p[off] || '\n' == p[off])
+            {
+                off++;
+            } else {
+                break;
+            }
+        }
+
+        for (val[i] = 0; off < (size_t) avail &&
+                         '0' <= p[off] && p[off] <= '9'; off++)
+        {
+            val[i] = val[i] * 10 + p[off] - '0';
+        }
+    }
+
+    if (off >= (size_t) avail || val[0] <= 0 || val[1] <= 0 ||
+        val[2] <= 0 || 65535 < val[2])
+    {
+        return -1;
+    }
+
+    return off + 1 + val[0] * val[1] * channels * (val[2] < 256 ? 1 : 2);
+}
+
+/* qoi carries no length, so walk the ops until every pixel is accounted for
+ * and add the end marker */
+static ssize_t qoi_size (rb_reader* r)
+{
+    uint64_t npix, n = 0;
+    size_t off = 14;
+    ssize_t avail;
+    uint8_t* p;
+    uint8_t op;
+
+    if ((avail = rb_reader_peek (r, off, &p)) < (ssize_t) off) {
+        return -1;
+    }
+    npix = (uint64_t) be32 (p + 4) * be32 (p + 8);
+
+    while (n < npix) {
+        if (off >= (size_t) avail &&
+            (avail = rb_reader_peek (r, off + SIO_CHUNK, &p))
+                <= (ssize_t) off)
+        {
+            return -1;
+        }
+
+        op = p[off];
+        if (0xFE == op) {
+            off += 4;
+            n++;
+        } else if (0xFF == op) {
+            off += 5;
+            n++;
+        } else if (0xC0 == (op & 0xC0)) {
+            off += 1;
+            n += (op & 0x3F) + 1;
+        } else {
+            off += 0x80 == (op & 0xC0) ? 2 : 1;
+            n++;
+        }
+    }
+
+    return off + 8;
+}
+
+static ssize_t image_size (rb_reader* r, data_fmt* fmt)
+{
+    uint8_t* p;
+    ssize_t avail;
+
+    if ((avail = rb_reader_peek (r, 8, &p)) < 8) {
+        return -1;
+    }
+
+    if (0 == memcmp (p, "\x89PNG\r\n\x1a\n", 8)) {
+        *fmt = FMT_PNG;
+        return png_size (r);
+    } else if (0xFF == p[0] && 0xD8 == p[1]) {
+        *fmt = FMT_JPEG;
+        return jpeg_size (r);
+    } else if ('B' == p[0] && 'M' == p[1]) {
+        *fmt = FMT_BMP;
+        return p[2] | p[3] << 8 | p[4] << 16 | (uint32_t) p[5] << 24;
+    } else if ('P' == p[0] && '6' == p[1]) {
+        *fmt = FMT_PPMRAW;
+        return pnm_size (r, 3);
+    } else if ('P' == p[0] && '5' == p[1]) {
+        *fmt = FMT_PGMRAW;
+        return pnm_size (r, 1);
+    } else if (0 == memcmp (p, "qoif", 4)) {
+        *fmt = FMT_QOI;
+        return qoi_size (r);
+    }
+
+    return -1;
+}
+
+/* fills in the next frame of the stream. returns 1 if a frame was read, 0 at
+ * the end of the stream and -1 on errors */
+static int sio_next_frame (sio_input_context* c, image_t* im)
+{
+    rb_reader* r = &c->reader;
+    uint8_t* p;
+    ssize_t size;
+
+    switch (c->split) {
+        case SIO_SPLIT_NONE:
+            c->done = 1;
+            if ((size = rb_reader_slurp (r, &im->pix)) <= 0) {
+                free (im->pix);
+                im->pix = NULL;
+                return size;
+            }
+            im->size = size;
+            return 1;
+
+        case SIO_SPLIT_LEN:
+            if ((size = rb_reader_peek (r, 4, &p)) < 4) {
+                return 0 == size ? 0 : -1;
+            }
+            size = be32 (p);
+            rb_reader_skip (r, 4);
+            break;
+
+        case SIO_SPLIT_FIXED:
+            if ((size = rb_reader_peek (r, 1, &p)) < 1) {
+                return size;
+            }
+            size = c->frame_size;
+            im->width = c->width;
+            im->height = c->height;
+            im->bpp = c->bpp ? c->bpp : -1;
+            im->fmt = c->fmt;
+            break;
+
+        case SIO_SPLIT_IMAGE:
+            if ((size = rb_reader_peek (r, 1, &p)) < 1) {
+                return size;
+            }
+            if ((size = image_size (r, &im->fmt)) <= 0) {
+                return -1;
+            }
+
+            if (rb_reader_peek (r, size, &p) < size ||
+                buf_pool_attach (c->pool, im, size))
+            {
+                return -1;
+            }
+            memcpy (im->pix, p, size);
+            rb_reader_skip (r, size);
+            im->size = size;
+            return 1;
+
+        default:
+            return -1;
+    }
+
+    if (buf_pool_attach (c->pool, im, size)) {
+        return -1;
+    }
+    if (size != rb_reader_read (r, im->pix, size)) {
+        return -1;
+    }
+    im->size = size;
+    return 1;
+}
+
 int sio_input_exec (plugin_context* ctx,
                     int             thread_id,
                     image_t**       src_data,
                     image_t**       dst_data)
 {
     sio_input_context* c;
-    char* path;
-    image_t* im;
-    size_t size = 1031;
+    image_t* im = NULL;
     int ret_val = -1;
 
+    (void) thread_id;
+    (void) src_data;
+
     pthread_mutex_lock (&ctx->mutex);
 
     if (NULL == (c = (sio_input_context*) ctx->data)) {
         error_exit ("Invalid context");
     }
 
-    if (NULL == c->filep) {
-        error_exit ("Invalid file pointer");
+    /* a NULL frame marks the end of the stream */
+    *dst_data = NULL;
+    if (c->done) {
+        ret_val = 0;
+        goto exit;
     }
 
     if (NULL == (im = calloc (1, sizeof *im))) {
@@ -184,28 +546,25 @@ int sio_input_exec (plugin_context* ctx,
 
     im->width = im->height = im->bpp = -1;
 
-    im->size = 0;
-    if (NULL == (im->pix = malloc (size))) {
-        error_exit ("Out of memory");
-    }
-
-    while (size == fread (im->pix + im->size, 1, size, c->filep)) {
-        im->size += size;
-        if (NULL == (im->pix = realloc (im->pix, im->size + size))) {
-            error_exit ("Out of memory");
-        }
-    }
-    im->size += size;
-
-    if (0 != fclose (c->filep)) {
-        error_exit ("%s", strerror (errno));
+    switch (sio_next_frame (c, im)) {
+        case 1:
+            im->frame = c->frame++;
+            *dst_data = im;
+            im = NULL;
+            break;
+        case 0:
+            c->done = 1;
+            break;
+        default:
+            c->done = 1;
+            error_exit ("Error reading frame %ld from %s", c->frame,
+                        c->filen ? c->filen : "stdin");
     }
-    c->filep = NULL;
 
-    *dst_data = im;
     ret_val = 0;
 
 exit:
+    image_close (im);
     pthread_mutex_unlock (&ctx->mutex);
     return ret_val;
 }
@@ -214,9 +573,10 @@ int sio_input_exit (plugin_context* ctx,
                     int             thread_id)
 {
     sio_input_context* c;
-    int i;
     int ret_val = -1;
 
+    (void) thread_id;
+
     if (NULL == (c = (sio_input_context*) ctx->data)) {
         error_exit ("Invalid context");
     }
@@ -225,25 +585,33 @@ int sio_input_exit (plugin_context* ctx,
 
     if (--c->references) {
         ret_val = 0;
+        pthread_mutex_unlock (&ctx->mutex);
         goto exit;
     }
 
+    if (STDIN_FILENO != c->fd) {
+        close (c->fd);
+    }
+    rb_reader_close (&c->reader);
+    buf_pool_free (c->pool);
     free (c->filen);
     free (c);
 
     ctx->data = NULL;
     ret_val = 0;
 
-exit:
     pthread_mutex_unlock (&ctx->mutex);
+
+exit:
     return ret_val;
 }
 
 
 typedef struct sio_output_context {
-    FILE*   filep;
-    char*   filen;
-    int     references;
+    int         fd;
+    char*       filen;
+    rb_writer   writer;
+    int         references;
 } fi_output_context;
 
 int sio_output_init (plugin_context* ctx,
@@ -251,6 +619,7 @@ int sio_output_init (plugin_context* ctx,
                      char*           args)
 {
     fi_output_context* c;
+    char* param;
     int ret_val = -1;
 
     pthread_mutex_lock (&ctx->mutex);
@@ -262,13 +631,20 @@ int sio_output_init (plugin_context* ctx,
 
         parse_args (args, 0, "rsc", &c->filen);
         if (NULL == c->filen || '-' == *c->filen) {
-            c->filep = stdout;
+            c->fd = STDOUT_FILENO;
         } else {
-            if (NULL == (c->filep = fopen (c->filen, "w"))) {
+            if (-1 == (c->fd = open (c->filen, O_WRONLY | O_CREAT | O_TRUNC,
+                                     0644)))
+            {
                 error_exit ("Unable to open %s for writing\n", c->filen);
             }
         }
 
+        /* frames are vmsplice'd into pipes unless splice:0 is given */
+        parse_args (args, 0, "splice", &param);
+        rb_writer_init (&c->writer, c->fd, NULL == param || atoi (param));
+        free (param);
+
         c->references = 0;
         ctx->data = c;
     }
@@ -292,7 +668,7 @@ int sio_output_exec (plugin_context* ctx,
 {
     fi_output_context* c;
     image_t* im;
-    int size;
+    struct iovec iov;
     int ret_val = -1;
 
     pthread_mutex_lock (&ctx->mutex);
@@ -303,12 +679,13 @@ int sio_output_exec (plugin_context* ctx,
         error_exit ("Invalid context");
     }
 
-    if ((uintmax_t) im->size != (uintmax_t) fwrite (im->pix,
-                                                    sizeof(uint8_t),
-                                                    im->size,
-                                                    c->filep))
-    {
-        error_exit ("Error writing %ld bytes to %s", im->size, c->filen);
+    /* the writer owns the frame from here on */
+    *src_data = NULL;
+    iov.iov_base = im->pix;
+    iov.iov_len = im->size;
+    if (rb_writer_writev (&c->writer, &iov, 1, im)) {
+        error_exit ("Error writing %ld bytes to %s", iov.iov_len,
+                    c->filen ? c->filen : "stdout");
     }
 
     ret_val = 0;
@@ -322,7 +699,6 @@ int sio_output_exit (plugin_context* ctx,
                      int             thread_id)
 {
     fi_output_context* c;
-    int i;
     int ret_val = -1;
 
     pthread_mutex_lock (&ctx->mutex);
@@ -336,7 +712,10 @@ int sio_output_exit (plugin_context* ctx,
         goto exit;
     }
 
-    fclose (c->filep);
+    rb_writer_close (&c->writer);
+    if (STDOUT_FILENO != c->fd) {
+        close (c->fd);
+    }
     free (c->filen);
     free (c);
     ctx->data = NULL;
@@ -24,29 +24,137 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <assert.h>
 
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 
 #include <libswscale/swscale.h>
 #include <libavutil/pixfmt.h>
 #include <libavcodec/avcodec.h>
 
-#include <loomlib/async_queue.h>
-
 #include <image.h>
 #include <plugin.h>
+#include <workpool.h>
+#include <rbio.h>
+
+/* contexts kept by each thread, enough for a handful of input geometries */
+#define SWS_SLOTS 4
+
+typedef struct swscale_slot {
+    struct SwsContext* sws;
+    int src_width;
+    int src_height;
+    enum PixelFormat src_fmt;
+    int dst_width;
+    int dst_height;
+    enum PixelFormat dst_fmt;
+    int flags;
+    unsigned long used;
+} swscale_slot;
+
+/* most slices a large frame is cut into */
+#define SWS_MAX_SLICES 16
+
+/* frames of at least this many pixels are scaled in slices by default */
+#define SWS_SLICE_PIXELS (1 << 21)
+
+/* a slice scales a band of the frame with its own context into scratch,
+ * then keeps the rows that its neighbours' bands do not overlap */
+typedef struct swscale_slice {
+    struct SwsContext* sws;
+    uint8_t* scratch;
+    size_t size;
+    int failed;
+} swscale_slice;
+
+typedef struct swscale_thread {
+    swscale_slot slot[SWS_SLOTS];
+    unsigned long tick;
+    swscale_slice slice[SWS_MAX_SLICES];
+} swscale_thread;
+
+/* one frame being scaled in slices. the frame's height is cut into units,
+ * each unit spanning src_unit source rows and dst_unit destination rows,
+ * so that every slice keeps the scaling ratio and filter phase of the
+ * whole frame */
+typedef struct swscale_job {
+    swscale_thread* t;
+    const uint8_t* src;
+    int src_stride;
+    int src_width;
+    enum PixelFormat src_fmt;
+    uint8_t* dst;
+    int dst_stride;
+    int dst_width;
+    enum PixelFormat dst_fmt;
+    int flags;
+    int units;
+    int src_unit;
+    int dst_unit;
+    int margin;
+    int nslices;
+} swscale_job;
+
+/* scaler flags behind the quality option */
+typedef struct swscale_quality {
+    const char* name;
+    int flags;
+} swscale_quality;
+
+/* the presets, cheapest first. the adaptive mode walks this ladder */
+static const swscale_quality swscale_presets[] = {
+    {"preview",         SWS_FAST_BILINEAR},
+    {"balanced",        SWS_BICUBIC},
+    {"final",           SWS_LANCZOS | SWS_ACCURATE_RND | SWS_FULL_CHR_H_INT},
+    {NULL,              0}};
+
+#define SWS_PRESETS 3
+
+static const swscale_quality swscale_filters[] = {
+    {"point",           SWS_POINT},
+    {"fast_bilinear",   SWS_FAST_BILINEAR},
+    {"bilinear",        SWS_BILINEAR},
+    {"bicubic",         SWS_BICUBIC},
+    {"lanczos",         SWS_LANCZOS},
+    {NULL,              0}};
+
+/* frames to wait after an adaptive switch before judging the new preset */
+#define SWS_SETTLE 8
 
 typedef struct swscale_decode_context {
-    struct async_queue* sws_context_queue;
+    swscale_thread* threads;
     int references;
 
     int dst_width;
     int dst_height;
     data_fmt dst_native_fmt;
     enum PixelFormat dst_sws_fmt;
+    int flags;
+    const char* quality;
+
+    /* adaptive quality, guarded by the plugin context mutex */
+    int adaptive;
+    int level;
+    double budget;
+    double average;
+    int settle;
+    int switches;
+    int64_t frames[SWS_PRESETS + 1];
+
+    workpool* pool;
+    int64_t slice_pixels;
+
+    buf_pool* bufs;
+
+    /* the shapes prepare last got ready for, each with the context it built
+     * until the first thread to miss on that shape takes it. guarded by the
+     * mutex */
+    swscale_slot ready[SWS_SLOTS];
+    unsigned long ready_tick;
 } swscale_decode_context;
 
 static enum PixelFormat supported_fmt_table[FMT_LIST] = {-1};
@@ -65,6 +173,11 @@ int swscale_decode_exec (plugin_context*  ctx,
                          image_t**        dst_data);
 int swscale_decode_exit (plugin_context*  ctx,
                          int              thread_id);
+int swscale_decode_probe (plugin_context* ctx,
+                          image_t*        src_data,
+                          image_t*        info);
+int swscale_decode_prepare (plugin_context* ctx,
+                            image_t*        info);
 
 
 /* decode plugin configuration */
@@ -90,7 +203,9 @@ static plugin_info pi_swscale_decode = {.stage=PLUGIN_STAGE_INPUT,
                                         .name=decode_name,
                                         .init=swscale_decode_init,
                                         .exit=swscale_decode_exit,
-                                        .exec=swscale_decode_exec};
+                                        .exec=swscale_decode_exec,
+                                        .probe=swscale_decode_probe,
+                                        .prepare=swscale_decode_prepare};
 
 
 int swscale_query (plugin_stage stage, plugin_info** pi)
@@ -157,14 +272,18 @@ int swscale_decode_init (plugin_context*  ctx,
         enum PixelFormat sws_fmt;
         int dst_width;
         int dst_height;
+        int slices;
 
         /* set up state shared between all threads */
         if (NULL == (c = calloc (1, sizeof *c))) {
             error_exit ("Out of memory");
         }
 
-        if (NULL == (c->sws_context_queue = async_queue_new())) {
-            error_exit ("Failed to create async queue");
+        if (NULL == (c->threads = calloc (ctx->num_threads,
+                                          sizeof *c->threads)))
+        {
+            free (c);
+            error_exit ("Out of memory");
         }
 
         parse_args (args, 0, "width",  &param);
@@ -190,6 +309,65 @@ int swscale_decode_init (plugin_context*  ctx,
         c->dst_height = dst_height;
         c->dst_native_fmt = dst_fmt;
         c->dst_sws_fmt = sws_fmt;
+        /* quality is a preset, a filter name or adaptive, which starts at
+         * balanced and moves along the presets to keep each frame within
+         * budget milliseconds of scaling per pipeline thread */
+        c->flags = SWS_BICUBIC;
+        c->quality = "balanced";
+        parse_args (args, 0, "quality", &param);
+        if (NULL != param && 0 == strcasecmp (param, "adaptive")) {
+            c->adaptive = 1;
+            c->level = 1;
+            c->settle = SWS_SETTLE;
+            c->quality = "adaptive";
+        } else if (NULL != param) {
+            const swscale_quality* q = swscale_presets;
+
+            for (; NULL != q->name && strcasecmp (param, q->name); q++);
+            if (NULL == q->name) {
+                for (q = swscale_filters;
+                     NULL != q->name && strcasecmp (param, q->name); q++);
+            }
+            if (NULL == q->name) {
+                free (param);
+                free (c->threads);
+                free (c);
+                error_exit ("Unknown ``quality'' option");
+            }
+            c->flags = q->flags;
+            c->quality = q->name;
+        }
+        free (param);
+
+        parse_args (args, 0, "budget", &param);
+        c->budget = (NULL == param ? 40 : atof (param)) / 1000.0;
+        free (param);
+
+        /* large frames are cut into slices scaled on a shared pool.
+         * slices:1 turns that off */
+        parse_args (args, 0, "slices", &param);
+        slices = NULL == param ? 0 : atoi (param);
+        free (param);
+
+        parse_args (args, 0, "slice_pixels", &param);
+        c->slice_pixels = NULL == param ? SWS_SLICE_PIXELS
+                                        : strtoll (param, NULL, 10);
+        free (param);
+
+        if (1 != slices && NULL == (c->pool = workpool_new (slices))) {
+            free (c->threads);
+            free (c);
+            error_exit ("Unable to start slice threads");
+        }
+
+        /* output frames are recycled once the later stages release them */
+        if (NULL == (c->bufs = buf_pool_new (64, 2 * ctx->num_threads))) {
+            workpool_free (c->pool);
+            free (c->threads);
+            free (c);
+            error_exit ("Out of memory");
+        }
+
         ctx->data = c;
 
         supported_fmt_table[FMT_NONE] = PIX_FMT_NONE;
@@ -205,7 +383,7 @@ int swscale_decode_init (plugin_context*  ctx,
     }
 
     if (NULL == (c = (swscale_decode_context*) ctx->data) ||
-        NULL == c->sws_context_queue)
+        NULL == c->threads)
     {
         error_exit ("Context is not properly set");
     }
@@ -213,9 +391,8 @@ int swscale_decode_init (plugin_context*  ctx,
     c->references++;
     ret_val = 0;
 
-    pthread_mutex_unlock (&ctx->mutex);
-
 exit:
+    pthread_mutex_unlock (&ctx->mutex);
     return ret_val;
 }
 
@@ -224,22 +401,40 @@ int swscale_decode_exit (plugin_context*  ctx,
                          int              thread_id)
 {
     swscale_decode_context* c;
-
-    (void) thread_id;
+    int i;
 
     pthread_mutex_lock (&ctx->mutex);
 
     assert (NULL != (c = ctx->data));
 
+    /* each thread owns its slots */
+    for (i = 0; i < SWS_SLOTS; i++) {
+        sws_freeContext (c->threads[thread_id].slot[i].sws);
+        c->threads[thread_id].slot[i].sws = NULL;
+    }
+    for (i = 0; i < SWS_MAX_SLICES; i++) {
+        sws_freeContext (c->threads[thread_id].slice[i].sws);
+        free (c->threads[thread_id].slice[i].scratch);
+        memset (&c->threads[thread_id].slice[i], 0, sizeof (swscale_slice));
+    }
+
     if (!--c->references) {
-        struct SwsContext* sws_context;
-        while (NULL != (sws_context = async_queue_pop (c->sws_context_queue,
-                                                       false)))
-        {
-            sws_freeContext (sws_context);
+        if (c->adaptive) {
+            fprintf (stderr, "swscale: quality adaptive, %" PRId64 " preview, "
+                     "%" PRId64 " balanced, %" PRId64 " final frames, "
+                     "%d switches\n", c->frames[0], c->frames[1],
+                     c->frames[2], c->switches);
+        } else {
+            fprintf (stderr, "swscale: quality %s, %" PRId64 " frames\n",
+                     c->quality, c->frames[SWS_PRESETS]);
         }
 
-        async_queue_free (c->sws_context_queue);
+        for (i = 0; i < SWS_SLOTS; i++) {
+            sws_freeContext (c->ready[i].sws);
+        }
+        workpool_free (c->pool);
+        buf_pool_free (c->bufs);
+        free (c->threads);
         free (c);
         ctx->data = NULL;
     }
@@ -253,6 +448,301 @@ static enum PixelFormat native_to_sws (data_fmt fmt)
     return supported_fmt_table[fmt];
 }
 
+static int swscale_slot_is (const swscale_slot* s,
+                             int src_width, int src_height,
+                             enum PixelFormat src_fmt,
+                             int dst_width, int dst_height,
+                             enum PixelFormat dst_fmt, int flags)
+{
+    return s->src_width == src_width && s->src_height == src_height &&
+           s->src_fmt == src_fmt &&
+           s->dst_width == dst_width && s->dst_height == dst_height &&
+           s->dst_fmt == dst_fmt && s->flags == flags;
+}
+
+/* find the thread's context for this conversion, taking one prepare built
+ * or building it in place of the least recently used slot on a miss. only
+ * the calling thread touches its slots, so only the handover from prepare
+ * needs the lock */
+static struct SwsContext* swscale_get_context (pthread_mutex_t* mutex,
+                                               swscale_decode_context* c,
+                                               swscale_thread* t,
+                                               int src_width,
+                                               int src_height,
+                                               enum PixelFormat src_fmt,
+                                               int dst_width,
+                                               int dst_height,
+                                               enum PixelFormat dst_fmt,
+                                               int flags)
+{
+    swscale_slot* victim = &t->slot[0];
+    swscale_slot* s;
+    int i;
+
+    struct SwsContext* ready = NULL;
+
+    for (i = 0; i < SWS_SLOTS; i++) {
+        s = &t->slot[i];
+        if (s->sws && swscale_slot_is (s, src_width, src_height, src_fmt,
+                             dst_width, dst_height, dst_fmt, flags))
+        {
+            s->used = ++t->tick;
+            return s->sws;
+        }
+        if (s->used < victim->used) {
+            victim = s;
+        }
+    }
+
+    pthread_mutex_lock (mutex);
+    for (i = 0; i < SWS_SLOTS; i++) {
+        s = &c->ready[i];
+        if (s->sws && swscale_slot_is (s, src_width, src_height, src_fmt,
+                                       dst_width, dst_height, dst_fmt, flags))
+        {
+            ready = s->sws;
+            s->sws = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock (mutex);
+
+    if (NULL != ready) {
+        sws_freeContext (victim->sws);
+        victim->sws = ready;
+    } else {
+        /* frees the old context when the parameters differ */
+        victim->sws = sws_getCachedContext (victim->sws,
+                                            src_width, src_height, src_fmt,
+                                            dst_width, dst_height, dst_fmt,
+                                            flags, NULL, NULL, NULL);
+    }
+    if (NULL == victim->sws) {
+        victim->used = 0;
+        return NULL;
+    }
+
+    victim->src_width = src_width;
+    victim->src_height = src_height;
+    victim->src_fmt = src_fmt;
+    victim->dst_width = dst_width;
+    victim->dst_height = dst_height;
+    victim->dst_fmt = dst_fmt;
+    victim->flags = flags;
+    victim->used = ++t->tick;
+    return victim->sws;
+}
+
+static int gcd (int a, int b)
+{
+    while (b) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* slices index rows of a single plane */
+static int swscale_sliceable (enum PixelFormat fmt)
+{
+    switch (fmt) {
+        case PIX_FMT_BGR24:     case PIX_FMT_RGB24:
+        case PIX_FMT_BGR32:     case PIX_FMT_RGB32:
+        case PIX_FMT_BGR32_1:   case PIX_FMT_RGB32_1:
+        case PIX_FMT_YUYV422:   case PIX_FMT_UYVY422:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void swscale_slice_task (void* arg, int i)
+{
+    swscale_job* j = arg;
+    swscale_slice* s = &j->t->slice[i];
+    int u0 = (int64_t) i * j->units / j->nslices;
+    int u1 = (int64_t) (i + 1) * j->units / j->nslices;
+    int e0 = u0 - j->margin < 0 ? 0 : u0 - j->margin;
+    int e1 = j->units < u1 + j->margin ? j->units : u1 + j->margin;
+    int src_height = (e1 - e0) * j->src_unit;
+    int dst_height = (e1 - e0) * j->dst_unit;
+    const uint8_t* src[4] = {NULL};
+    uint8_t* dst[4] = {NULL};
+    int src_stride[4] = {0};
+    int dst_stride[4] = {0};
+    size_t size = (size_t) dst_height * j->dst_stride;
+
+    s->failed = 1;
+
+    /* the band is widened by a margin of units on both sides so the rows it
+     * keeps see the same filter taps as they would in the whole frame */
+    s->sws = sws_getCachedContext (s->sws,
+                                   j->src_width, src_height, j->src_fmt,
+                                   j->dst_width, dst_height, j->dst_fmt,
+                                   j->flags, NULL, NULL, NULL);
+    if (NULL == s->sws) {
+        return;
+    }
+
+    if (s->size < size) {
+        free (s->scratch);
+        s->size = 0;
+        if (NULL == (s->scratch = malloc (size))) {
+            return;
+        }
+        s->size = size;
+    }
+
+    src[0] = j->src + (size_t) e0 * j->src_unit * j->src_stride;
+    src_stride[0] = j->src_stride;
+    dst[0] = s->scratch;
+    dst_stride[0] = j->dst_stride;
+
+    if (dst_height != sws_scale (s->sws, src, src_stride, 0, src_height,
+                                 dst, dst_stride))
+    {
+        return;
+    }
+
+    memcpy (j->dst + (size_t) u0 * j->dst_unit * j->dst_stride,
+            s->scratch + (size_t) (u0 - e0) * j->dst_unit * j->dst_stride,
+            (size_t) (u1 - u0) * j->dst_unit * j->dst_stride);
+    s->failed = 0;
+}
+
+/* work out how a frame would be cut into slices. returns 1 if it is worth
+ * slicing, 0 otherwise */
+static int swscale_plan (swscale_decode_context* c,
+                         swscale_job* j,
+                         int src_width,
+                         int src_height,
+                         enum PixelFormat src_fmt,
+                         int dst_width,
+                         int dst_height)
+{
+    int64_t pixels;
+    int taps;
+
+    pixels = (int64_t) src_width * src_height;
+    if (pixels < (int64_t) dst_width * dst_height) {
+        pixels = (int64_t) dst_width * dst_height;
+    }
+    if (NULL == c->pool || 2 > workpool_threads (c->pool) ||
+        pixels < c->slice_pixels ||
+        !swscale_sliceable (src_fmt) || !swscale_sliceable (c->dst_sws_fmt))
+    {
+        return 0;
+    }
+
+    j->units = gcd (src_height, dst_height);
+    j->src_unit = src_height / j->units;
+    j->dst_unit = dst_height / j->units;
+    j->nslices = workpool_threads (c->pool);
+    if (SWS_MAX_SLICES < j->nslices) {
+        j->nslices = SWS_MAX_SLICES;
+    }
+    if (j->units < j->nslices) {
+        j->nslices = j->units;
+    }
+
+    /* source rows under the widest filter the scaler may pick, stretched
+     * when downscaling */
+    taps = 4 * ((src_height + dst_height - 1) / dst_height) + 4;
+    j->margin = (taps + j->src_unit - 1) / j->src_unit;
+
+    /* slices that would be mostly margin are not worth it */
+    return 2 <= j->nslices && j->margin <= j->units / j->nslices;
+}
+
+/* scale a large frame in horizontal slices on the pool. returns 1 if the
+ * frame was scaled, 0 if it cannot be sliced and -1 on errors */
+static int swscale_slices (swscale_decode_context* c,
+                           swscale_thread* t,
+                           AVPicture* src,
+                           int src_width,
+                           int src_height,
+                           enum PixelFormat src_fmt,
+                           AVPicture* dst,
+                           int dst_width,
+                           int dst_height,
+                           int flags)
+{
+    swscale_job j;
+    int i;
+
+    if (!swscale_plan (c, &j, src_width, src_height, src_fmt,
+                       dst_width, dst_height))
+    {
+        return 0;
+    }
+
+    j.t = t;
+    j.src = src->data[0];
+    j.src_stride = src->linesize[0];
+    j.src_width = src_width;
+    j.src_fmt = src_fmt;
+    j.dst = dst->data[0];
+    j.dst_stride = dst->linesize[0];
+    j.dst_width = dst_width;
+    j.dst_fmt = c->dst_sws_fmt;
+    j.flags = flags;
+
+    workpool_run (c->pool, swscale_slice_task, &j, j.nslices);
+
+    for (i = 0; i < j.nslices; i++) {
+        if (t->slice[i].failed) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/* count the frame against the preset it was scaled with and, in adaptive
+ * mode, move along the presets when the moving average of scale times leaves
+ * the budget. the threads share the cpus, so a frame may take num_threads
+ * budgets of wall time before the pipeline falls behind */
+static void swscale_adapt (plugin_context* ctx,
+                           swscale_decode_context* c,
+                           int level,
+                           double seconds)
+{
+    double budget;
+
+    pthread_mutex_lock (&ctx->mutex);
+
+    c->frames[level]++;
+    if (!c->adaptive || level != c->level) {
+        pthread_mutex_unlock (&ctx->mutex);
+        return;
+    }
+
+    budget = c->budget * ctx->num_threads;
+    c->average = c->settle == SWS_SETTLE ? seconds
+                                         : 0.75 * c->average + 0.25 * seconds;
+    if (0 < c->settle--) {
+        pthread_mutex_unlock (&ctx->mutex);
+        return;
+    }
+
+    if (budget < c->average && 0 < c->level) {
+        c->level--;
+    } else if (c->average < budget / 4 && c->level < SWS_PRESETS - 1) {
+        c->level++;
+    } else {
+        c->settle = 0;
+        pthread_mutex_unlock (&ctx->mutex);
+        return;
+    }
+
+    c->switches++;
+    c->settle = SWS_SETTLE;
+    fprintf (stderr, "swscale: %.1f ms per frame, switching to %s\n",
+             c->average * 1000, swscale_presets[c->level].name);
+
+    pthread_mutex_unlock (&ctx->mutex);
+}
+
 int swscale_decode_exec (plugin_context*  ctx,
                          int              thread_id,
                          image_t**        src_data,
@@ -265,19 +755,23 @@ int swscale_decode_exec (plugin_context*  ctx,
     int ret_val = -1;
 
     image_t* sim;
-    uint8_t* pix;
+    buf_pool_entry* e;
+    int size;
 
     int dst_width;
     int dst_height;
 
-    (void) thread_id;
+    int flags;
+    int level;
+    struct timespec start;
+    struct timespec end;
 
     if (NULL == (sim = *src_data) || NULL != *dst_data) {
         error_exit ("Bad src/dst data pointers");
     }
 
     assert (NULL != (c = ctx->data));
-    assert (NULL != c->sws_context_queue);
+    assert (NULL != c->threads);
 
     if (c->dst_width <= 0 || c->dst_height <= 0) {
         dst_width = sim->width;
@@ -287,33 +781,63 @@ int swscale_decode_exec (plugin_context*  ctx,
         dst_height = c->dst_height;
     }
 
-    if (NULL == (sws_context = async_queue_pop (c->sws_context_queue, false)))
+    /* planes, strides and any palette are laid out as avpicture_fill
+     * expects them for the target format */
+    if ((size = avpicture_get_size (c->dst_sws_fmt, dst_width, dst_height)) <= 0)
     {
-        sws_context = sws_getContext (sim->width, sim->height, native_to_sws (sim->fmt),
-                                      dst_width, dst_height, c->dst_sws_fmt,
-                                      SWS_BICUBIC, NULL, NULL, NULL);
-        if (NULL == sws_context) {
-            error_exit ( "Error creating sws_context");
-        }
-        
+        error_exit ("Unsupported output format or size");
     }
-
-    if (NULL == (pix = malloc ((sizeof *pix) * dst_width * dst_height * 3))) {
+    if (NULL == (e = buf_pool_get (c->bufs, size))) {
         error_exit ("Out of memory");
     }
 
     avpicture_fill (&src_picture, sim->pix, native_to_sws (sim->fmt), sim->width, sim->height);
-    avpicture_fill (&dst_picture, pix, c->dst_sws_fmt, dst_width, dst_height);
+    avpicture_fill (&dst_picture, e->data, c->dst_sws_fmt, dst_width, dst_height);
 
-    if (dst_height != sws_scale (sws_context,
-                                 (const uint8_t**) src_picture.data, src_picture.linesize,
-                                 0, dst_height,
-                                 dst_picture.data, dst_picture.linesize))
+    pthread_mutex_lock (&ctx->mutex);
+    level = c->adaptive ? c->level : SWS_PRESETS;
+    flags = c->adaptive ? swscale_presets[level].flags : c->flags;
+    pthread_mutex_unlock (&ctx->mutex);
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+
+    switch (swscale_slices (c, &c->threads[thread_id],
+                            &src_picture, sim->width, sim->height,
+                            native_to_sws (sim->fmt),
+                            &dst_picture, dst_width, dst_height, flags))
     {
-        error_exit ("sws_scale failed to convert src->dst");
+        case 1:
+            break;
+        case 0:
+            if (NULL == (sws_context = swscale_get_context (&ctx->mutex, c,
+                                                            &c->threads[thread_id],
+                                                            sim->width, sim->height,
+                                                            native_to_sws (sim->fmt),
+                                                            dst_width, dst_height,
+                                                            c->dst_sws_fmt,
+                                                            flags)))
+            {
+                buf_pool_put (e);
+                error_exit ("Error creating sws_context");
+            }
+
+            if (dst_height != sws_scale (sws_context,
+                                         (const uint8_t**) src_picture.data, src_picture.linesize,
+                                         0, sim->height,
+                                         dst_picture.data, dst_picture.linesize))
+            {
+                buf_pool_put (e);
+                error_exit ("sws_scale failed to convert src->dst");
+            }
+            break;
+        default:
+            buf_pool_put (e);
+            error_exit ("sws_scale failed to convert src->dst slices");
     }
 
-    assert (async_queue_push (c->sws_context_queue, sws_context));
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    swscale_adapt (ctx, c, level, (end.tv_sec - start.tv_sec) +
+                                  (end.tv_nsec - start.tv_nsec) / 1e9);
 
     if (sim->ext_data && sim->ext_free) {
         sim->ext_free (sim->ext_data);
@@ -324,8 +848,13 @@ int swscale_decode_exec (plugin_context*  ctx,
     }
 
     sim->fmt = c->dst_native_fmt;
-    sim->pix = pix;
-    sim->bpp = 24;
+    sim->pix = e->data;
+    sim->ext_data = e;
+    sim->ext_free = buf_pool_put;
+    sim->size = size;
+    sim->width = dst_width;
+    sim->height = dst_height;
+    sim->bpp = image_fmt_bpp (c->dst_native_fmt);
 
     *dst_data = sim;
     *src_data = NULL;
@@ -335,3 +864,138 @@ int swscale_decode_exec (plugin_context*  ctx,
 exit:
     return ret_val;
 }
+
+/* raw frames already carry their shape, the scaled one follows from the
+ * options alone */
+int swscale_decode_probe (plugin_context* ctx,
+                          image_t*        src_data,
+                          image_t*        info)
+{
+    swscale_decode_context* c;
+
+    if (NULL == (c = ctx->data) ||
+        src_data->width <= 0 || src_data->height <= 0)
+    {
+        return -1;
+    }
+
+    if (c->dst_width <= 0 || c->dst_height <= 0) {
+        info->width = src_data->width;
+        info->height = src_data->height;
+    } else {
+        info->width = c->dst_width;
+        info->height = c->dst_height;
+    }
+    info->fmt = c->dst_native_fmt;
+    info->bpp = image_fmt_bpp (c->dst_native_fmt);
+
+    return 0;
+}
+
+/* get frames shaped like info ready before the first of them reaches exec:
+ * fill the output pool with a buffer per thread and build a context for
+ * the first thread to miss on the shape, then report the shape they scale
+ * to. frames that get sliced build their slice contexts on first use, and
+ * shapes among the last few prepared are not prepared again */
+int swscale_decode_prepare (plugin_context* ctx,
+                            image_t*        info)
+{
+    swscale_decode_context* c;
+    swscale_slot* victim;
+    swscale_slot* s;
+    struct SwsContext* sws = NULL;
+    buf_pool_entry** e;
+    swscale_job j;
+    enum PixelFormat src_fmt;
+    int dst_width;
+    int dst_height;
+    int flags;
+    int size;
+    int i;
+
+    if (NULL == (c = ctx->data) || info->width <= 0 || info->height <= 0) {
+        return -1;
+    }
+
+    if (c->dst_width <= 0 || c->dst_height <= 0) {
+        dst_width = info->width;
+        dst_height = info->height;
+    } else {
+        dst_width = c->dst_width;
+        dst_height = c->dst_height;
+    }
+    src_fmt = native_to_sws (info->fmt);
+
+    if ((size = avpicture_get_size (c->dst_sws_fmt, dst_width, dst_height)) <= 0)
+    {
+        return -1;
+    }
+
+    /* claim a slot for the shape before building, so that racing prepares
+     * of the same shape find it taken */
+    pthread_mutex_lock (&ctx->mutex);
+    flags = c->adaptive ? swscale_presets[c->level].flags : c->flags;
+    victim = &c->ready[0];
+    for (i = 0; i < SWS_SLOTS; i++) {
+        s = &c->ready[i];
+        if (s->used && swscale_slot_is (s, info->width, info->height, src_fmt,
+                                        dst_width, dst_height,
+                                        c->dst_sws_fmt, flags))
+        {
+            pthread_mutex_unlock (&ctx->mutex);
+            return swscale_decode_probe (ctx, info, info);
+        }
+        if (s->used < victim->used) {
+            victim = s;
+        }
+    }
+    sws = victim->sws;
+    victim->sws = NULL;
+    victim->src_width = info->width;
+    victim->src_height = info->height;
+    victim->src_fmt = src_fmt;
+    victim->dst_width = dst_width;
+    victim->dst_height = dst_height;
+    victim->dst_fmt = c->dst_sws_fmt;
+    victim->flags = flags;
+    victim->used = ++c->ready_tick;
+    pthread_mutex_unlock (&ctx->mutex);
+
+    sws_freeContext (sws);
+    sws = NULL;
+
+    if (!swscale_plan (c, &j, info->width, info->height, src_fmt,
+                       dst_width, dst_height))
+    {
+        sws = sws_getContext (info->width, info->height, src_fmt,
+                              dst_width, dst_height, c->dst_sws_fmt,
+                              flags, NULL, NULL, NULL);
+    }
+
+    /* the buffers are all taken before any is put back so that the pool
+     * ends up holding one per thread */
+    if (NULL != (e = calloc (ctx->num_threads, sizeof *e))) {
+        for (i = 0; i < ctx->num_threads; i++) {
+            e[i] = buf_pool_get (c->bufs, size);
+        }
+        for (i = 0; i < ctx->num_threads; i++) {
+            buf_pool_put (e[i]);
+        }
+        free (e);
+    }
+
+    /* the slot may have gone to another shape meanwhile */
+    pthread_mutex_lock (&ctx->mutex);
+    if (NULL != sws && NULL == victim->sws &&
+        swscale_slot_is (victim, info->width, info->height, src_fmt,
+                         dst_width, dst_height, c->dst_sws_fmt, flags))
+    {
+        victim->sws = sws;
+        sws = NULL;
+    }
+    pthread_mutex_unlock (&ctx->mutex);
+
+    sws_freeContext (sws);
+
+    return swscale_decode_probe (ctx, info, info);
+}
@@ -0,0 +1,377 @@
+/******************************************************************************
+ * Copyright (c) 2010 Joey Degges
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include <turbojpeg.h>
+
+#include "image.h"
+#include "plugin.h"
+#include "rbio.h"
+
+/* function definitions */
+int turbojpeg_query (plugin_stage   stage,
+                     plugin_info**  pi);
+
+int tj_decode_init (plugin_context* ctx,
+                    int             thread_id,
+                    char*           args);
+int tj_decode_exec (plugin_context* ctx,
+                    int             thread_id,
+                    image_t**       src_data,
+                    image_t**       dst_data);
+int tj_decode_exit (plugin_context* ctx,
+                    int             thread_id);
+int tj_decode_probe (plugin_context* ctx,
+                     image_t*        src_data,
+                     image_t*        info);
+
+/* decode plugin configuration */
+static const char decode_name[] = "turbojpeg_decode";
+static const data_fmt decode_src_fmt[] = {FMT_JPEG, FMT_MJPEG, -1};
+static const data_fmt decode_dst_fmt[] = {
+    FMT_RGB24,      FMT_BGR24,      FMT_RGB32,
+    FMT_BGR32,      FMT_GREY8,      FMT_YUV420P,
+    FMT_YUV422P,    FMT_YUV444P,    -1};
+static plugin_info pi_turbojpeg_decode = {.stage=PLUGIN_STAGE_DECODE,
+                                          .type=PLUGIN_TYPE_ASYNC,
+                                          .src_fmt=decode_src_fmt,
+                                          .dst_fmt=decode_dst_fmt,
+                                          .name=decode_name,
+                                          .init=tj_decode_init,
+                                          .exit=tj_decode_exit,
+                                          .exec=tj_decode_exec,
+                                          .probe=tj_decode_probe};
+
+int turbojpeg_query (plugin_stage stage, plugin_info** pi)
+{
+    *pi = NULL;
+    switch (stage) {
+        case PLUGIN_STAGE_DECODE:
+            *pi = &pi_turbojpeg_decode;
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+typedef struct tj_decode_context {
+    tjhandle*       handles;
+    buf_pool*       pool;
+    tjscalingfactor scale;
+    data_fmt        fmt;
+    int             pixel_fmt;
+    int             planar;
+    int             flags;
+    int             references;
+} tj_decode_context;
+
+/* map a native packed format onto the TurboJPEG pixel format with the same
+ * byte order; the 32 bit formats are native endian words */
+static int tj_pixel_fmt (data_fmt fmt)
+{
+    switch (fmt) {
+        case FMT_RGB24:     return TJPF_RGB;
+        case FMT_BGR24:     return TJPF_BGR;
+        case FMT_GREY8:     return TJPF_GRAY;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        case FMT_RGB32:     return TJPF_BGRA;
+        case FMT_BGR32:     return TJPF_RGBA;
+#else
+        case FMT_RGB32:     return TJPF_ARGB;
+        case FMT_BGR32:     return TJPF_ABGR;
+#endif
+        default:            return -1;
+    }
+}
+
+/* planar output is taken straight from the IDCT, which requires the jpeg to
+ * already use the matching chroma subsampling */
+static int tj_planar_subsamp (data_fmt fmt)
+{
+    switch (fmt) {
+        case FMT_YUV420P:   return TJSAMP_420;
+        case FMT_YUV422P:   return TJSAMP_422;
+        case FMT_YUV444P:   return TJSAMP_444;
+        default:            return -1;
+    }
+}
+
+/* parse a "num/denom" scale and check it against the factors the library
+ * can apply during the IDCT */
+static int tj_parse_scale (const char* str, tjscalingfactor* sf)
+{
+    tjscalingfactor* factors;
+    int num, denom = 1;
+    int n, i;
+
+    if (1 > sscanf (str, "%d/%d", &num, &denom) || 0 >= num || 0 >= denom) {
+        return -1;
+    }
+
+    if (NULL == (factors = tjGetScalingFactors (&n))) {
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (factors[i].num * denom == num * factors[i].denom) {
+            *sf = factors[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int tj_decode_init (plugin_context* ctx,
+                    int             thread_id,
+                    char*           args)
+{
+    tj_decode_context* c;
+    char* param;
+    int ret_val = -1;
+
+    pthread_mutex_lock (&ctx->mutex);
+
+    if (NULL == ctx->data) {
+        if (NULL == (c = calloc (1, sizeof *c)) ||
+            NULL == (c->handles = calloc (ctx->num_threads,
+                                          sizeof *c->handles)) ||
+            NULL == (c->pool = buf_pool_new (0, 2 * ctx->num_threads)))
+        {
+            error_exit ("Out of memory");
+        }
+
+        c->scale.num = c->scale.denom = 1;
+        parse_args (args, 0, "scale", &param);
+        if (NULL != param && tj_parse_scale (param, &c->scale)) {
+            free (param);
+            error_exit ("Unsupported ``scale'' option, try 1/2, 1/4 or 1/8");
+        }
+        free (param);
+
+        parse_args (args, 0, "fmt", &param);
+        c->fmt = NULL != param ? image_fmt_from_str (param) : FMT_RGB24;
+        free (param);
+
+        c->pixel_fmt = tj_pixel_fmt (c->fmt);
+        c->planar = -1 == c->pixel_fmt;
+        if (c->planar && -1 == tj_planar_subsamp (c->fmt)) {
+            error_exit ("Unsupported ``fmt'' option");
+        }
+
+        /* fast:1 trades a little accuracy for the fast integer IDCT and
+         * nearest neighbour chroma upsampling */
+        c->flags = 0;
+        parse_args (args, 0, "fast", &param);
+        if (NULL != param && atoi (param)) {
+            c->flags |= TJFLAG_FASTDCT | TJFLAG_FASTUPSAMPLE;
+        }
+        free (param);
+
+        ctx->data = c;
+    }
+
+    if (NULL == (c = (tj_decode_context*) ctx->data) ||
+        NULL != c->handles[thread_id])
+    {
+        error_exit ("Invalid context");
+    }
+
+    /* decompressor handles are not thread safe, give each thread its own */
+    if (NULL == (c->handles[thread_id] = tjInitDecompress ())) {
+        error_exit ("Unable to create decompressor: %s",
+                    tjGetErrorStr2 (NULL));
+    }
+
+    c->references++;
+    ret_val = 0;
+
+exit:
+    pthread_mutex_unlock (&ctx->mutex);
+    return ret_val;
+}
+
+int tj_decode_exec (plugin_context* ctx,
+                    int             thread_id,
+                    image_t**       src_data,
+                    image_t**       dst_data)
+{
+    tj_decode_context* c;
+    tjhandle h;
+    image_t* sim;
+    image_t* dim = NULL;
+    int width, height, subsamp, colorspace;
+    size_t size;
+    int err;
+    int ret_val = -1;
+
+    if (NULL == (c = (tj_decode_context*) ctx->data) ||
+        NULL == (h = c->handles[thread_id]) ||
+        NULL == (sim = *src_data) ||
+        NULL != *dst_data)
+    {
+        error_exit ("Invalid context");
+    }
+
+    if (tjDecompressHeader3 (h, sim->pix, sim->size, &width, &height,
+                             &subsamp, &colorspace))
+    {
+        error_exit ("Unable to read jpeg header: %s", tjGetErrorStr2 (h));
+    }
+
+    width = TJSCALED (width, c->scale);
+    height = TJSCALED (height, c->scale);
+
+    if (c->planar) {
+        if (tj_planar_subsamp (c->fmt) != subsamp) {
+            error_exit ("Jpeg chroma subsampling does not match ``fmt''");
+        }
+        size = tjBufSizeYUV2 (width, 1, height, subsamp);
+    } else {
+        size = (size_t) width * height * tjPixelSize[c->pixel_fmt];
+    }
+
+    if (NULL == (dim = calloc (1, sizeof *dim)) ||
+        buf_pool_attach (c->pool, dim, size))
+    {
+        free (dim);
+        dim = NULL;
+        error_exit ("Out of memory");
+    }
+
+    /* scaling happens inside the IDCT, so smaller outputs skip most of the
+     * transform and colour conversion work */
+    if (c->planar) {
+        err = tjDecompressToYUV2 (h, sim->pix, sim->size, dim->pix, width, 1,
+                                  height, c->flags);
+    } else {
+        err = tjDecompress2 (h, sim->pix, sim->size, dim->pix, width,
+                             width * tjPixelSize[c->pixel_fmt], height,
+                             c->pixel_fmt, c->flags);
+    }
+
+    /* truncated or slightly corrupt streams only raise warnings and still
+     * produce a usable image */
+    if (err && TJERR_WARNING != tjGetErrorCode (h)) {
+        error_exit ("Unable to decode jpeg: %s", tjGetErrorStr2 (h));
+    }
+
+    dim->width = width;
+    dim->height = height;
+    dim->bpp = image_fmt_bpp (c->fmt);
+    dim->size = size;
+    dim->fmt = c->fmt;
+    dim->frame = sim->frame;
+
+    *dst_data = dim;
+    dim = NULL;
+    ret_val = 0;
+
+exit:
+    if (NULL != dim) {
+        image_close (dim);
+    }
+    return ret_val;
+}
+
+/* probes run on the input threads, which have no handle of their own */
+int tj_decode_probe (plugin_context* ctx,
+                     image_t*        src_data,
+                     image_t*        info)
+{
+    tj_decode_context* c;
+    tjhandle h = NULL;
+    int width, height, subsamp, colorspace;
+    int ret_val = -1;
+
+    if (NULL == (c = (tj_decode_context*) ctx->data) ||
+        NULL == src_data || NULL == info)
+    {
+        error_exit ("Invalid context");
+    }
+
+    if (NULL == (h = tjInitDecompress ())) {
+        error_exit ("Unable to create decompressor: %s",
+                    tjGetErrorStr2 (NULL));
+    }
+
+    if (tjDecompressHeader3 (h, src_data->pix, src_data->size, &width,
+                             &height, &subsamp, &colorspace))
+    {
+        error_exit ("Unable to read jpeg header: %s", tjGetErrorStr2 (h));
+    }
+
+    info->width = TJSCALED (width, c->scale);
+    info->height = TJSCALED (height, c->scale);
+    info->bpp = image_fmt_bpp (c->fmt);
+    info->fmt = c->fmt;
+    ret_val = 0;
+
+exit:
+    if (NULL != h) {
+        tjDestroy (h);
+    }
+    return ret_val;
+}
+
+int tj_decode_exit (plugin_context* ctx,
+                    int             thread_id)
+{
+    tj_decode_context* c;
+    int ret_val = -1;
+
+    pthread_mutex_lock (&ctx->mutex);
+
+    if (NULL == (c = (tj_decode_context*) ctx->data)) {
+        error_exit ("Invalid context");
+    }
+
+    if (NULL != c->handles[thread_id]) {
+        tjDestroy (c->handles[thread_id]);
+        c->handles[thread_id] = NULL;
+    }
+
+    if (--c->references) {
+        ret_val = 0;
+        goto exit;
+    }
+
+    buf_pool_free (c->pool);
+    free (c->handles);
+    free (c);
+
+    ctx->data = NULL;
+    ret_val = 0;
+
+exit:
+    pthread_mutex_unlock (&ctx->mutex);
+    return ret_val;
+}
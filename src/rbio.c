@@ -0,0 +1,547 @@
+/******************************************************************************
+ * Copyright (c) 2010 Joey Degges
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "rbio.h"
+
+buf_pool* buf_pool_new (size_t align, int max_free)
+{
+    buf_pool* p;
+
+    if (NULL == (p = calloc (1, sizeof *p))) {
+        return NULL;
+    }
+
+    if (pthread_mutex_init (&p->mutex, NULL)) {
+        free (p);
+        return NULL;
+    }
+
+    p->align = align;
+    p->max_free = max_free;
+    return p;
+}
+
+static void buf_pool_destroy_entry (buf_pool_entry* e)
+{
+    free (e->data);
+    free (e);
+}
+
+static void buf_pool_destroy (buf_pool* p)
+{
+    buf_pool_entry* e;
+
+    while (NULL != (e = p->free_list)) {
+        p->free_list = e->next;
+        buf_pool_destroy_entry (e);
+    }
+
+    pthread_mutex_destroy (&p->mutex);
+    free (p);
+}
+
+void buf_pool_free (buf_pool* p)
+{
+    if (NULL == p) {
+        return;
+    }
+
+    pthread_mutex_lock (&p->mutex);
+    p->closed = 1;
+    if (p->outstanding) {
+        pthread_mutex_unlock (&p->mutex);
+        return;
+    }
+    pthread_mutex_unlock (&p->mutex);
+
+    buf_pool_destroy (p);
+}
+
+buf_pool_entry* buf_pool_get (buf_pool* p, size_t size)
+{
+    buf_pool_entry* e;
+    buf_pool_entry** prev;
+
+    pthread_mutex_lock (&p->mutex);
+
+    /* first fit from the buffers that have been put back */
+    for (prev = &p->free_list; NULL != (e = *prev); prev = &e->next) {
+        if (size <= e->size) {
+            *prev = e->next;
+            p->nfree--;
+            break;
+        }
+    }
+    p->outstanding++;
+
+    pthread_mutex_unlock (&p->mutex);
+
+    if (NULL == e) {
+        if (NULL == (e = calloc (1, sizeof *e))) {
+            goto error;
+        }
+
+        if (p->align) {
+            if (posix_memalign ((void**) &e->data, p->align, size)) {
+                e->data = NULL;
+            }
+        } else {
+            e->data = malloc (size);
+        }
+
+        if (NULL == e->data) {
+            free (e);
+            goto error;
+        }
+
+        e->size = size;
+        e->pool = p;
+    }
+
+    e->next = NULL;
+    return e;
+
+error:
+    pthread_mutex_lock (&p->mutex);
+    p->outstanding--;
+    pthread_mutex_unlock (&p->mutex);
+    return NULL;
+}
+
+void buf_pool_put (void* entry)
+{
+    buf_pool_entry* e = entry;
+    buf_pool* p;
+    int destroy;
+
+    if (NULL == e) {
+        return;
+    }
+
+    p = e->pool;
+
+    pthread_mutex_lock (&p->mutex);
+
+    if (p->closed || p->max_free <= p->nfree) {
+        buf_pool_destroy_entry (e);
+    } else {
+        e->next = p->free_list;
+        p->free_list = e;
+        p->nfree++;
+    }
+
+    destroy = !--p->outstanding && p->closed;
+
+    pthread_mutex_unlock (&p->mutex);
+
+    if (destroy) {
+        buf_pool_destroy (p);
+    }
+}
+
+int buf_pool_attach (buf_pool* p, image_t* im, size_t size)
+{
+    buf_pool_entry* e;
+
+    if (NULL == (e = buf_pool_get (p, size))) {
+        return -1;
+    }
+
+    im->pix = e->data;
+    im->ext_data = e;
+    im->ext_free = buf_pool_put;
+    return 0;
+}
+
+
+int rb_reader_init (rb_reader* r, int fd, size_t chunk)
+{
+    memset (r, 0, sizeof *r);
+    r->fd = fd;
+    r->chunk = chunk;
+
+    if (NULL == (r->buf = malloc (chunk))) {
+        return -1;
+    }
+    r->cap = chunk;
+    return 0;
+}
+
+void rb_reader_close (rb_reader* r)
+{
+    free (r->buf);
+    r->buf = NULL;
+    r->pos = r->len = r->cap = 0;
+}
+
+static ssize_t read_full (int fd, uint8_t* dst, size_t n)
+{
+    size_t done = 0;
+
+    while (done < n) {
+        ssize_t got = read (fd, dst + done, n - done);
+        if (got < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return -1;
+        }
+        if (0 == got) {
+            break;
+        }
+        done += got;
+    }
+    return done;
+}
+
+/* make room for at least n bytes past r->pos, moving the live bytes to the
+ * front of the buffer and growing it geometrically when needed */
+static int rb_reader_reserve (rb_reader* r, size_t n)
+{
+    if (r->pos) {
+        memmove (r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+    }
+
+    if (r->cap < n) {
+        size_t cap = r->cap ? r->cap : r->chunk;
+        uint8_t* buf;
+
+        while (cap < n) {
+            cap *= 2;
+        }
+        if (NULL == (buf = realloc (r->buf, cap))) {
+            return -1;
+        }
+        r->buf = buf;
+        r->cap = cap;
+    }
+    return 0;
+}
+
+ssize_t rb_reader_peek (rb_reader* r, size_t n, uint8_t** data)
+{
+    if (r->len - r->pos < n && !r->eof) {
+        if (rb_reader_reserve (r, n)) {
+            return -1;
+        }
+
+        /* read at least a full chunk so small peeks don't turn into small
+         * reads */
+        while (r->len < n && !r->eof) {
+            size_t want = r->cap - r->len;
+            ssize_t got = read (r->fd, r->buf + r->len,
+                                want < r->chunk ? want : r->chunk);
+            if (got < 0) {
+                if (EINTR == errno) {
+                    continue;
+                }
+                return -1;
+            }
+            if (0 == got) {
+                r->eof = 1;
+            }
+            r->len += got;
+        }
+    }
+
+    *data = r->buf + r->pos;
+    return r->len - r->pos < n ? r->len - r->pos : n;
+}
+
+void rb_reader_skip (rb_reader* r, size_t n)
+{
+    r->pos += n;
+    if (r->pos >= r->len) {
+        r->pos = r->len = 0;
+    }
+}
+
+ssize_t rb_reader_read (rb_reader* r, uint8_t* dst, size_t n)
+{
+    size_t buffered = r->len - r->pos;
+    ssize_t got;
+
+    if (n <= buffered) {
+        memcpy (dst, r->buf + r->pos, n);
+        rb_reader_skip (r, n);
+        return n;
+    }
+
+    memcpy (dst, r->buf + r->pos, buffered);
+    rb_reader_skip (r, buffered);
+
+    if (r->eof) {
+        return buffered;
+    }
+
+    if ((got = read_full (r->fd, dst + buffered, n - buffered)) < 0) {
+        return -1;
+    }
+    if ((size_t) got < n - buffered) {
+        r->eof = 1;
+    }
+    return buffered + got;
+}
+
+ssize_t rb_reader_slurp (rb_reader* r, uint8_t** data)
+{
+    uint8_t* p;
+    ssize_t size;
+
+    while (!r->eof) {
+        if (rb_reader_peek (r, r->len - r->pos + r->chunk, &p) < 0) {
+            return -1;
+        }
+    }
+
+    if (r->pos) {
+        rb_reader_reserve (r, 0);
+    }
+
+    size = r->len;
+    *data = r->buf;
+
+    r->buf = NULL;
+    r->pos = r->len = r->cap = 0;
+    return size;
+}
+
+int rb_writev_full (int fd, struct iovec* iov, int iovcnt)
+{
+    while (iovcnt) {
+        ssize_t done = writev (fd, iov, iovcnt);
+
+        if (done < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return -1;
+        }
+
+        /* skip over whatever made it out and resume mid-iovec */
+        while (iovcnt && (size_t) done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (uint8_t*) iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return 0;
+}
+
+
+int rb_fd_is_pipe (int fd)
+{
+    struct stat sbuf;
+
+    return 0 == fstat (fd, &sbuf) && S_ISFIFO (sbuf.st_mode);
+}
+
+int rb_pipe_grow (int fd)
+{
+    int size = fcntl (fd, F_GETPIPE_SZ);
+
+    if (0 <= size && size < RB_PIPE_SIZE &&
+        0 <= fcntl (fd, F_SETPIPE_SZ, RB_PIPE_SIZE))
+    {
+        size = fcntl (fd, F_GETPIPE_SZ);
+    }
+    return size;
+}
+
+int rb_writer_init (rb_writer* w, int fd, int splice)
+{
+    int size;
+
+    memset (w, 0, sizeof *w);
+    w->fd = fd;
+    w->page_size = sysconf (_SC_PAGESIZE);
+
+    if (splice && rb_fd_is_pipe (fd) && 0 < (size = rb_pipe_grow (fd))) {
+        w->splice = 1;
+        w->pipe_size = size;
+    }
+    return 0;
+}
+
+static int vmsplice_full (int fd, struct iovec iov)
+{
+    while (iov.iov_len) {
+        ssize_t done = vmsplice (fd, &iov, 1, 0);
+
+        if (done < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return -1;
+        }
+        iov.iov_base = (uint8_t*) iov.iov_base + done;
+        iov.iov_len -= done;
+    }
+    return 0;
+}
+
+/* a waiting reap stops waiting on a reader that has not drained the pipe
+ * for this many 1ms passes */
+#define RB_REAP_STALLS 10000
+
+/* release the frames whose bytes have left the pipe. the pipe never holds
+ * more than pipe_size bytes, which bounds what is still queued when the
+ * reader can't be asked. returns -1 if a waiting reap gave up with frames
+ * still in the pipe */
+static int rb_writer_reap (rb_writer* w, int wait)
+{
+    int stalls = 0;
+
+    while (w->head) {
+        struct timespec ts = {0, 1000000};
+        uint64_t consumed;
+        int queued;
+        int released = 0;
+
+        struct pollfd pfd = {w->fd, POLLOUT, 0};
+
+        /* nobody is left to read what is queued, the pipe dropped it */
+        if (0 < poll (&pfd, 1, 0) && (pfd.revents & (POLLERR | POLLHUP))) {
+            consumed = UINT64_MAX;
+        } else {
+            if (ioctl (w->fd, FIONREAD, &queued) < 0) {
+                queued = w->pipe_size;
+            }
+            consumed = (uint64_t) queued < w->written ? w->written - queued
+                                                      : 0;
+        }
+
+        while (w->head && w->head->end <= consumed) {
+            rb_inflight* f = w->head;
+
+            w->head = f->next;
+            image_close (f->im);
+            free (f);
+            released = 1;
+        }
+
+        if (NULL == w->head) {
+            w->tail = NULL;
+        } else if (!wait) {
+            break;
+        } else if (RB_REAP_STALLS <= (stalls = released ? 0 : stalls + 1)) {
+            return -1;
+        } else {
+            nanosleep (&ts, NULL);
+        }
+    }
+    return 0;
+}
+
+int rb_writer_writev (rb_writer* w, struct iovec* iov, int iovcnt,
+                      image_t* im)
+{
+    rb_inflight* f;
+    int spliced = 0;
+    int i;
+
+    /* frames that can't be tracked are copied, since only tracked frames
+     * are kept alive while the pipe refers to them */
+    if (!w->splice || NULL == (f = malloc (sizeof *f))) {
+        rb_writer_reap (w, 0);
+        image_close (im);
+        return rb_writev_full (w->fd, iov, iovcnt);
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len >= w->page_size) {
+            if (vmsplice_full (w->fd, iov[i])) {
+                goto error;
+            }
+            spliced = 1;
+        } else if (rb_writev_full (w->fd, &iov[i], 1)) {
+            goto error;
+        }
+        w->written += iov[i].iov_len;
+    }
+
+    if (spliced && NULL != im) {
+        f->im = im;
+        f->end = w->written;
+        f->next = NULL;
+        if (w->tail) {
+            w->tail->next = f;
+        } else {
+            w->head = f;
+        }
+        w->tail = f;
+    } else {
+        free (f);
+        image_close (im);
+    }
+
+    rb_writer_reap (w, 0);
+    return 0;
+
+error:
+    /* how much of a failed splice reached the pipe is unknown, so such a
+     * frame stays pinned until the reader is gone */
+    if (spliced || iov[i].iov_len >= w->page_size) {
+        f->im = im;
+        f->end = UINT64_MAX;
+        f->next = NULL;
+        if (w->tail) {
+            w->tail->next = f;
+        } else {
+            w->head = f;
+        }
+        w->tail = f;
+    } else {
+        free (f);
+        image_close (im);
+    }
+    rb_writer_reap (w, 0);
+    return -1;
+}
+
+void rb_writer_close (rb_writer* w)
+{
+    /* a reader that stopped draining leaves its frames pinned rather than
+     * letting their buffers be reused under it. later writes are copied */
+    if (rb_writer_reap (w, 1)) {
+        fprintf (stderr, "rbio: reader stalled, its frames stay pinned\n");
+        w->splice = 0;
+    }
+}
@@ -0,0 +1,146 @@
+/******************************************************************************
+ * Copyright (c) 2010 Joey Degges
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef _H_RB_RBIO
+#define _H_RB_RBIO
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "image.h"
+
+/* Buffer pool and stream helpers shared by the i/o plugins. Like parse_args
+ * these live in the core and are resolved by the plugins at load time. */
+
+typedef struct buf_pool buf_pool;
+
+typedef struct buf_pool_entry {
+    buf_pool*               pool;
+    struct buf_pool_entry*  next;
+    uint8_t*                data;
+    size_t                  size;
+} buf_pool_entry;
+
+struct buf_pool {
+    pthread_mutex_t     mutex;
+    buf_pool_entry*     free_list;
+    size_t              align;
+    int                 nfree;
+    int                 max_free;
+    int                 outstanding;
+    int                 closed;
+};
+
+/* buffers are aligned to align bytes (0 for malloc alignment); at most
+ * max_free released buffers are kept around for reuse */
+buf_pool* buf_pool_new (size_t align, int max_free);
+
+/* the pool is destroyed once it has been freed and every buffer handed out
+ * has been put back, so images may outlive the plugin that created them */
+void buf_pool_free (buf_pool* p);
+
+buf_pool_entry* buf_pool_get (buf_pool* p, size_t size);
+
+/* has the signature of image_t.ext_free */
+void buf_pool_put (void* entry);
+
+/* back im->pix with a pooled buffer of at least size bytes */
+int buf_pool_attach (buf_pool* p, image_t* im, size_t size);
+
+
+typedef struct rb_reader {
+    int         fd;
+    uint8_t*    buf;
+    size_t      pos;
+    size_t      len;
+    size_t      cap;
+    size_t      chunk;
+    int         eof;
+} rb_reader;
+
+int rb_reader_init (rb_reader* r, int fd, size_t chunk);
+void rb_reader_close (rb_reader* r);
+
+/* make at least n bytes available at *data. returns the number of bytes
+ * available, which is less than n only at the end of the stream */
+ssize_t rb_reader_peek (rb_reader* r, size_t n, uint8_t** data);
+
+/* drop n bytes previously made available by rb_reader_peek */
+void rb_reader_skip (rb_reader* r, size_t n);
+
+/* copy up to n bytes to dst. buffered bytes are drained first, the rest is
+ * read straight into dst */
+ssize_t rb_reader_read (rb_reader* r, uint8_t* dst, size_t n);
+
+/* read the remainder of the stream and hand over the buffer holding it; the
+ * buffer must be released with free() */
+ssize_t rb_reader_slurp (rb_reader* r, uint8_t** data);
+
+/* writev that retries until every iovec has been written. the iovecs are
+ * modified */
+int rb_writev_full (int fd, struct iovec* iov, int iovcnt);
+
+
+/* pipes are grown to this size so large frames need fewer wakeups */
+#define RB_PIPE_SIZE (1 << 20)
+
+int rb_fd_is_pipe (int fd);
+
+/* try to grow the pipe behind fd; returns its (possibly unchanged) size */
+int rb_pipe_grow (int fd);
+
+typedef struct rb_inflight {
+    image_t*            im;
+    uint64_t            end;
+    struct rb_inflight* next;
+} rb_inflight;
+
+/* Writes frames to a file descriptor. When the descriptor is a pipe, large
+ * buffers are vmsplice'd into it instead of copied. The pipe then refers to
+ * the frame's pages, so the frame is kept alive until the reader has
+ * consumed it. */
+typedef struct rb_writer {
+    int             fd;
+    int             splice;
+    size_t          page_size;
+    size_t          pipe_size;
+    uint64_t        written;
+    rb_inflight*    head;
+    rb_inflight*    tail;
+} rb_writer;
+
+int rb_writer_init (rb_writer* w, int fd, int splice);
+
+/* write the iovecs and take ownership of im. every iovec of at least a page
+ * must point into im's buffers, since those are the ones that get spliced */
+int rb_writer_writev (rb_writer* w, struct iovec* iov, int iovcnt,
+                      image_t* im);
+
+/* wait until the reader has drained everything that was spliced and
+ * release the remaining frames. a reader that stops draining for 10s is
+ * given up on: its frames stay pinned for good, since the pipe may still
+ * refer to them, and later writes are copied. the descriptor is left open */
+void rb_writer_close (rb_writer* w);
+
+#endif
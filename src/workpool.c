@@ -0,0 +1,184 @@
+/******************************************************************************
+ * Copyright (c) 2010 Joey Degges
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "workpool.h"
+
+/* claim the next task of the batch at the head of the queue, dropping the
+ * batch from the queue once all of its tasks are claimed. called locked */
+static int workpool_claim (workpool* wp, workpool_batch* b)
+{
+    workpool_batch* prev = NULL;
+    workpool_batch* it;
+    int task = b->next++;
+
+    if (b->next == b->ntasks) {
+        for (it = wp->head; it != b; it = it->next_batch) {
+            prev = it;
+        }
+        if (NULL == prev) {
+            wp->head = b->next_batch;
+        } else {
+            prev->next_batch = b->next_batch;
+        }
+        if (wp->tail == b) {
+            wp->tail = prev;
+        }
+    }
+    return task;
+}
+
+/* run a claimed task and account for it. called locked, returns locked */
+static void workpool_do (workpool* wp, workpool_batch* b, int task)
+{
+    pthread_mutex_unlock (&wp->mutex);
+    b->fn (b->arg, task);
+    pthread_mutex_lock (&wp->mutex);
+
+    if (++b->done == b->ntasks) {
+        pthread_cond_broadcast (&wp->done);
+    }
+}
+
+static void* workpool_worker (void* arg)
+{
+    workpool* wp = arg;
+    workpool_batch* b;
+
+    pthread_mutex_lock (&wp->mutex);
+    for (;;) {
+        while (!wp->quit && NULL == wp->head) {
+            pthread_cond_wait (&wp->work, &wp->mutex);
+        }
+        if (wp->quit) {
+            break;
+        }
+        b = wp->head;
+        workpool_do (wp, b, workpool_claim (wp, b));
+    }
+    pthread_mutex_unlock (&wp->mutex);
+    return NULL;
+}
+
+workpool* workpool_new (int nthreads)
+{
+    workpool* wp;
+    int i;
+
+    if (0 >= nthreads) {
+        nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+    }
+    if (0 >= nthreads) {
+        nthreads = 1;
+    }
+
+    if (NULL == (wp = calloc (1, sizeof *wp))) {
+        return NULL;
+    }
+    if (NULL == (wp->threads = calloc (nthreads, sizeof *wp->threads))) {
+        free (wp);
+        return NULL;
+    }
+    pthread_mutex_init (&wp->mutex, NULL);
+    pthread_cond_init (&wp->work, NULL);
+    pthread_cond_init (&wp->done, NULL);
+
+    /* the caller of workpool_run is the first worker */
+    wp->nthreads = 1;
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create (&wp->threads[i], NULL, workpool_worker, wp)) {
+            break;
+        }
+        wp->nthreads++;
+    }
+    return wp;
+}
+
+void workpool_free (workpool* wp)
+{
+    int i;
+
+    if (NULL == wp) {
+        return;
+    }
+
+    pthread_mutex_lock (&wp->mutex);
+    wp->quit = 1;
+    pthread_cond_broadcast (&wp->work);
+    pthread_mutex_unlock (&wp->mutex);
+
+    for (i = 1; i < wp->nthreads; i++) {
+        pthread_join (wp->threads[i], NULL);
+    }
+
+    pthread_cond_destroy (&wp->done);
+    pthread_cond_destroy (&wp->work);
+    pthread_mutex_destroy (&wp->mutex);
+    free (wp->threads);
+    free (wp);
+}
+
+void workpool_run (workpool* wp, workpool_fn fn, void* arg, int ntasks)
+{
+    workpool_batch b = {.fn=fn, .arg=arg, .ntasks=ntasks};
+    int i;
+
+    if (0 >= ntasks) {
+        return;
+    }
+
+    /* nothing to hand out, skip the queue entirely */
+    if (NULL == wp || 1 == wp->nthreads || 1 == ntasks) {
+        for (i = 0; i < ntasks; i++) {
+            fn (arg, i);
+        }
+        return;
+    }
+
+    pthread_mutex_lock (&wp->mutex);
+
+    if (NULL == wp->tail) {
+        wp->head = wp->tail = &b;
+    } else {
+        wp->tail = wp->tail->next_batch = &b;
+    }
+    pthread_cond_broadcast (&wp->work);
+
+    /* help with our own batch rather than sleeping, so a saturated pool
+     * still makes progress */
+    while (b.next < b.ntasks) {
+        workpool_do (wp, &b, workpool_claim (wp, &b));
+    }
+    while (b.done < b.ntasks) {
+        pthread_cond_wait (&wp->done, &wp->mutex);
+    }
+
+    pthread_mutex_unlock (&wp->mutex);
+}
+
+int workpool_threads (workpool* wp)
+{
+    return NULL == wp ? 1 : wp->nthreads;
+}
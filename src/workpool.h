@@ -0,0 +1,67 @@
+/******************************************************************************
+ * Copyright (c) 2010 Joey Degges
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef _H_RB_WORKPOOL
+#define _H_RB_WORKPOOL
+
+#include <pthread.h>
+
+/* Fork/join helper threads for plugins that split a single frame across
+ * cores. Like the rbio helpers this lives in the core and is resolved by the
+ * plugins at load time. */
+
+typedef void (*workpool_fn) (void* arg, int task);
+
+typedef struct workpool_batch {
+    workpool_fn             fn;
+    void*                   arg;
+    int                     ntasks;
+    int                     next;
+    int                     done;
+    struct workpool_batch*  next_batch;
+} workpool_batch;
+
+typedef struct workpool {
+    pthread_mutex_t     mutex;
+    pthread_cond_t      work;
+    pthread_cond_t      done;
+    pthread_t*          threads;
+    int                 nthreads;
+    workpool_batch*     head;
+    workpool_batch*     tail;
+    int                 quit;
+} workpool;
+
+/* nthreads counts the calling thread, which always helps with its own batch;
+ * 0 or less means one per online cpu */
+workpool* workpool_new (int nthreads);
+
+void workpool_free (workpool* wp);
+
+/* run fn (arg, i) for i in [0, ntasks) and return once every task is done.
+ * several pipeline threads may run batches on the same pool at once */
+void workpool_run (workpool* wp, workpool_fn fn, void* arg, int ntasks);
+
+/* number of threads a batch can be spread over, for sizing tasks */
+int workpool_threads (workpool* wp);
+
+#endif